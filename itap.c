@@ -1,7 +1,7 @@
 /******************************************************************************
  iTAP by @Shark (c)20/01/2026
  
- $ gcc itap.c -o itap -w (Ubuntu)
+ $ gcc itap.c -o itap -w -pthread (Ubuntu)
 
  Based on STAP - Split TAPes
  Author: TSM
@@ -18,27 +18,90 @@
  It detects pilot tones to identify program boundaries and creates
  separate TAP files for each program with corrected headers.
 ******************************************************************************/
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64    // Large file I/O (> 2 GB)
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 
 #include <conio.h>
 #define CR 13
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
 
 #else
 
 #include <termios.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <limits.h>
 #define CR 10
 #define _MAX_PATH PATH_MAX
 #define getch(x) nixgetch(x)
+#define fseek64 fseeko
+#define ftell64 ftello
+
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
+
+// 64-bit file offsets, lengths and counters
+#ifdef _MSC_VER
+typedef unsigned __int64 tapoff;
+#define PRIOFF "I64"
+#else
+typedef unsigned long long tapoff;
+#define PRIOFF "ll"
+#endif
+#define TAP_MAXSIZE 0xffffffffULL  // TAP header size field is 32 bits
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
 
+// Kernel templates are specialized on constant arguments, never called;
+// rare paths they call stay out of line
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#define COLD __declspec(noinline)
+#elif defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#define COLD __attribute__((cold,noinline))
+#else
+#define FORCE_INLINE inline
+#define COLD
 #endif
 
 #define PROGVERSION "1.01"
+#define PILOT_RUN 32            // Min pilot-range run left untouched by -q
+#define C64_CLOCK 985248.0      // PAL CPU clock (TAP pulse unit is 8 cycles)
+#define HDR_TAIL 0x400          // Pulses read past a block to end a header near it
+#define HDR_SYNC_MAX 4096       // Frames tried before giving up on a header
+#define HDR_WINDOW 0x100000     // Pulses of a block searched for its header
+#define SCAN_CHUNK 0x10000      // Bytes read at a time by the pilot scan
+#define COPY_CHUNK 0x10000      // Bytes copied at a time when a block is streamed
 
 // Global variables
 char tapname[_MAX_PATH];        // Input TAP filename
@@ -46,8 +109,71 @@ char batchmode=0;               // Batch mode flag (no user interaction)
 char listonly=0;                // List mode flag (only list blocks, don't split)
 char addnames=0;                // Add program names to output files flag
 char verbose=0;                 // Verbosity level (0-2)
-unsigned char blocknames[100][20]; // Array to store program names
+char quantize=0;                // Quantize data pulses flag (-q)
+tapoff fastpilot=0;             // Pilot pulses kept by -p, 0 to keep all
+int fastpause=1000;             // Longest pause kept by -p, in ms (--pause)
+char autogroup=0;               // Group header/data blocks into programs (-g)
+char *joinspec=NULL;            // Manual grouping spec (-j)
+char createidx=0;               // Create index (idx) flag (-i)
+char cleanmode=0;               // Create cleaned TAP flag (-c)
+char packmode=0;                // Create compact archive flag (-z)
+char unpackmode=0;              // Expand compact archive flag (-u)
+char incremental=0;             // Incremental split (-r), 2 removes stale files
+char repairmode=0;              // Repair ROM blocks from their two copies (-f)
+char calibrate=0;               // Pulse windows calibrated on each block (-a)
+char sidecar=0;                 // Pulse class sidecar (-s)
+char container=0;               // Single tar/zip output (--container)
+char wavtap=0;                  // Write the TAP converted from a WAV (-w)
+char wav_invert=0;              // WAV edge polarity (--polarity neg)
+unsigned int wav_rate=0;        // WAV sample rate override (--rate)
+int wav_threshold=2;            // WAV hysteresis, % of full scale (--threshold)
+char *outdir=NULL;              // Output directory (--out)
+char *idxdir=NULL;              // Index directory (--idx)
+char *ndjson=NULL;              // NDJSON results file (--ndjson)
+char *watchdir=NULL;            // Watched folder (--watch)
+char *journal=NULL;             // Processed-file journal (--journal)
+int workers=0;                  // Watch worker processes (--workers)
+int threads=0;                  // Name decoding threads (--threads)
+char *servesock=NULL;           // Block server socket (--serve)
+int cache_mb=256;               // Block server cache in MB (--cache)
+FILE *tap_inp=NULL;             // Input file of the tape being processed
+int tap_nblocks=0;              // Number of blocks of the tape processed
+jmp_buf *fail_jmp=NULL;         // Where itap_exit() returns to in a worker
+char is_archive=0;              // Input is a compact archive (.itz)
+int hdrminsize=7000;            // Minimum pilot length for a new block
+int blockminsize=14000;         // Minimum block size
+int max_blocks=0;               // Allocated entries in the block tables
+tapoff *array_blocks;           // Block start positions, plus end of data
+unsigned char (*blocknames)[20]; // Array to store program names
 unsigned char tap_version;      // TAP file version (0, 1, or 2)
+int ext_len=1;                  // Bytes of an extended pulse (1 on v0, 4 on v1/v2)
+unsigned char quant_table[256]; // Pulse -> canonical pulse lookup (-q)
+unsigned char pulse_win[3][2]={ // Short/medium/long windows of the tables
+    {0x24,0x36},{0x37,0x49},{0x4a,0x64}};
+
+// Decoded ROM header of a block
+struct block_info
+{
+  int hdr;             // 1 header found in block, 0 not found, -1 unknown
+  unsigned char type;  // Header type (byte 9)
+  unsigned int load;   // Start address
+  unsigned int end;    // End address
+  char state;          // Name decoding result (NAME_*)
+  double pilot;        // Pulse ratio of the pilot (-a)
+  int sig;             // Signature identified (--sigs), 0 for none
+} *blockinfo;
+
+#define NAME_TODO  0    // block_info states: not decoded yet
+#define NAME_OK    1    // 0x89 frame found in the block
+#define NAME_NOHDR 2    // No 0x89 frame starts inside the block
+#define NAME_LIMIT 3    // Gave up after HDR_SYNC_MAX frames
+
+// Structure to store pilot tone positions
+struct record_pilot
+{
+  tapoff start;        // Start position of pilot tone
+  tapoff end;          // End position of pilot tone
+} *array_pilot;
 
 /*------------------------------------------------------------------------*/
 #ifndef _WIN32
@@ -72,6 +198,194 @@ int nixgetch( )
 }
 #endif
 
+/*------------------------------------------------------------------------*/
+/**
+ * now_ms() - Get a monotonic time stamp
+ *
+ * Returns: Time in milliseconds
+ */
+double now_ms(void)
+{
+#ifdef _WIN32
+    return (double)clock()*1000.0/CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+#endif
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * out_path() - Build an output file path
+ * @dst: Output buffer (_MAX_PATH bytes)
+ * @dir: Output directory, or NULL for the current one
+ * @file: File name
+ */
+void out_path(char *dst, const char *dir, const char *file)
+{
+    if(dir && *dir)
+    {
+        snprintf(dst, _MAX_PATH, "%s/%s", dir, file);
+    }
+    else
+    {
+        snprintf(dst, _MAX_PATH, "%s", file);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * out_base() - Build the base name (without extension) of an output file
+ * @dst: Output buffer (_MAX_PATH bytes)
+ * @dir: Output directory, or NULL to write next to the input file
+ * @tapname: Input TAP filename
+ */
+void out_base(char *dst, const char *dir, const char *tapname)
+{
+    const char *base=tapname,*p;
+    char *ext;
+
+    if(dir && *dir)
+    {
+        for(p=tapname;*p;p++)
+        {
+            if( (*p=='/')||(*p=='\\') )
+            {
+                base=p+1;
+            }
+        }
+    }
+    out_path(dst, dir, base);
+    dst[_MAX_PATH-1]=0;
+    ext=strrchr(dst,'.');
+    if( ext && !strchr(ext,'/') && !strchr(ext,'\\') )
+    {
+        *ext=0;  // Remove original extension
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * fnv1a() - 64-bit FNV-1a hash of a buffer
+ */
+unsigned long long fnv1a(const void *data, size_t len, unsigned long long h)
+{
+    const unsigned char *p=data;
+
+    while(len--)
+    {
+        h^=*p++;
+        h*=0x100000001b3ULL;
+    }
+    return h;
+}
+#define FNV_INIT 0xcbf29ce484222325ULL
+
+/*------------------------------------------------------------------------*/
+/*
+ * Growable string, used to build NDJSON results
+ */
+struct strbuf
+{
+    char *b;
+    size_t len, cap;
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * sb_printf() - Append formatted text to a growable string
+ */
+void sb_printf(struct strbuf *sb, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for(;;)
+    {
+        va_start(ap, fmt);
+        n=vsnprintf(sb->b ? sb->b+sb->len : NULL,
+                    sb->b ? sb->cap-sb->len : 0, fmt, ap);
+        va_end(ap);
+        if( (n>=0) && sb->b && (sb->len+n < sb->cap) )
+        {
+            sb->len+=n;
+            return;
+        }
+        sb->cap=(sb->cap+n+1)*2;
+        sb->b=realloc(sb->b, sb->cap);
+        if(!sb->b)
+        {
+            printf("\nError: Cannot allocate memory\n");
+            exit(1);
+        }
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * sb_json() - Append a JSON string literal to a growable string
+ */
+void sb_json(struct strbuf *sb, const char *str)
+{
+    const unsigned char *p;
+
+    sb_printf(sb, "\"");
+    for(p=(const unsigned char *)str;*p;p++)
+    {
+        if( (*p=='"')||(*p=='\\') )
+        {
+            sb_printf(sb, "\\%c", *p);
+        }
+        else if( (*p<0x20)||(*p>=0x7f) )
+        {
+            sb_printf(sb, "\\u%04x", *p);
+        }
+        else
+        {
+            sb_printf(sb, "%c", *p);
+        }
+    }
+    sb_printf(sb, "\"");
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * grow_blocks() - Make room for at least n blocks in the block tables
+ * @n: Number of blocks needed
+ *
+ * Block tables grow with the number of pilot tones found, the scan itself
+ * keeps a constant memory footprint whatever the image size.
+ */
+void grow_blocks(int n)
+{
+    int old=max_blocks;
+
+    if(n<=max_blocks)
+    {
+        return;
+    }
+    max_blocks=(max_blocks<64) ? 64 : max_blocks;
+    while(max_blocks<n)
+    {
+        max_blocks*=2;
+    }
+    array_blocks=realloc(array_blocks,(max_blocks+2)*sizeof(*array_blocks));
+    array_pilot =realloc(array_pilot ,(max_blocks+1)*sizeof(*array_pilot ));
+    blocknames  =realloc(blocknames  ,(max_blocks+1)*sizeof(*blocknames  ));
+    blockinfo   =realloc(blockinfo   ,(max_blocks+1)*sizeof(*blockinfo   ));
+    if( !array_blocks || !array_pilot || !blocknames || !blockinfo )
+    {
+        printf("\nError: Cannot allocate memory for %d blocks\n",n);
+        exit(1);
+    }
+    memset(array_blocks+old,0,(max_blocks+2-old)*sizeof(*array_blocks));
+    memset(array_pilot +old,0,(max_blocks+1-old)*sizeof(*array_pilot ));
+    memset(blocknames  +old,0,(max_blocks+1-old)*sizeof(*blocknames  ));
+    memset(blockinfo   +old,0,(max_blocks+1-old)*sizeof(*blockinfo   ));
+}
+
 /*------------------------------------------------------------------------*/
 /**
  * ispilot() - Check if byte value is within pilot tone range
@@ -147,827 +461,9639 @@ int isshort(unsigned char pulse)
 
 /*------------------------------------------------------------------------*/
 /**
- * obtain_number() - Interactive menu to select block number
- * @max: Maximum block number
- * 
- * Allows user to navigate with + and - keys and confirm with Enter
- * 
- * Returns: Selected block number, or max+2 if ESC pressed
+ * init_quant_table() - Build the pulse quantization lookup table
+ *
+ * Every pulse in the short/medium/long windows maps to its canonical value
+ * (0x30, 0x42, 0x56), anything else (pauses, extended pulse markers) maps
+ * to itself.
  */
-unsigned char obtain_number(unsigned int max)
+void init_quant_table(void)
 {
-    unsigned char current=1,key=0;
+    static const unsigned char canon[3]={0x30,0x42,0x56};
+    int i,k;
 
-    printf("\nChoose with <+> and <->, confirm with <Enter>\n");
-    while (key!=CR)
+    for(i=0;i<256;i++)
     {
-        printf("\rChoice: %02d - %-16s",current,blocknames[current-1]);
-        key=(unsigned char)getch();
-        if ( key == 0x1b )  // ESC key
-        {
-            return max+2;
-        }
-        if ( (key=='+')&&(current<(max-1)) )
-        {
-            current++;
-        }
-        if ( (key=='-')&&(current>1) )
+        quant_table[i]=(unsigned char)i;
+        for(k=0;k<3;k++)
         {
-            current--;
+            if( (i>=pulse_win[k][0]) && (i<=pulse_win[k][1]) )
+            {
+                quant_table[i]=canon[k];
+            }
         }
     }
-    return current;
 }
 
 /*------------------------------------------------------------------------*/
-/**
- * get_pulse() - Read one pulse length from TAP file
- * @file_inp: Input file pointer
- * 
- * TAP files encode pulses as:
- * - Values 1-255: Direct pulse length
- * - Value 0: Extended pulse (next 3 bytes contain length in little-endian)
- * 
- * Returns: Pulse length, or EOF on end of file
+/*
+ * Event trace (-d2, --trace)
+ *
+ * The scan and the decoders record their events (pulses over 0xff,
+ * frames with a bad bit, blocks without a header, block bounds) in a ring
+ * of the last TRACE_EVENTS events of each thread. Recording is always on
+ * and costs a few stores; the rings are only written out on demand or on
+ * error:
+ *
+ *   -d2             the events of every tape are printed after it
+ *   --trace FILE    the rings are appended to FILE when a tape fails or
+ *                   the program crashes (after every tape with -d2)
+ *
+ * --trace-dump FILE prints a dump, --trace-json FILE converts it to the
+ * Trace Event format (chrome://tracing, Perfetto), with the TAP position
+ * as the time line.
+ *
+ * A dump is a sequence of rings, in host byte order:
+ *   0  "ITAPTRC1"
+ *   8  event size, thread number, events that follow (4 each)
+ *  20  events, oldest first
  */
-int get_pulse(FILE *file_inp)
+#define TRACE_EVENTS 8192       // Events kept per thread (power of 2)
+#define TRACE_RINGS  256        // Rings, one per thread
+#define TRACE_MAGIC  "ITAPTRC1"
+#define TRACE_HDR    20
+
+#define TRACE_HIGHPULSE 1       // Event types: pulse over 0xff (value: length/8)
+#define TRACE_BADBYTE   2       // Frame with a bad bit (value: byte read)
+#define TRACE_NOHDR     3       // Block without a header (value: frames tried)
+#define TRACE_BLOCK     4       // Block found by the scan (value: length)
+
+const char *trace_names[]={ "EVENT", "HIGHPULSE", "BADBYTE", "NOHEADER", "BLOCK" };
+
+struct trace_event
 {
-    unsigned char data;
-    int pulse_length = 0,pos=0;
-    unsigned char size[3];
-    size_t res;
+    tapoff off;                 // TAP position
+    unsigned int value;
+    unsigned short block;       // Block number, 0 if none
+    unsigned char type;
+    unsigned char thread;
+};
 
-    res = fread(&data, 1, 1, file_inp);
+struct trace_ring
+{
+    struct trace_event ev[TRACE_EVENTS];
+    unsigned int n;             // Events since the last trace_reset()
+    int thread;                 // Index in trace_rings
+    int live;                   // Owned by a running thread
+};
 
-    if (res == 0)
-    {
-        return EOF;
-    }
+char *tracefile=NULL;           // Trace dump file (--trace)
+char *tracedump=NULL;           // Dump to decode (--trace-dump, --trace-json)
+char tracejson=0;               // Convert it for a trace viewer (--trace-json)
+struct trace_ring *trace_rings[TRACE_RINGS];
+int trace_nrings=0;
 
-    if (data == 0)  // Extended pulse format
-    {
-        if (tap_version == 0)
-        {
-            pulse_length = 0x100;
-        }
-        else
-        {
-            // Read 3-byte little-endian pulse length
-            res = fread(size, 3, 1, file_inp);
-            if (res == 0)
-            {
-                return EOF;
-            }
-            // Convert to pulse length (divided by 8)
-            pulse_length = ((size[2] << 16) | (size[1] << 8) | size[0]) >> 3;
-        }
-        if(verbose>1)
-        {
-            if (pulse_length>0xff)
-            {
-                pos=ftell(file_inp);
-                if(pulse_length==0x100)
-                {
-                    pos--;
-                }
-                else
-                {
-                    pos-=4;
-                }
-                printf("HIGHPULSE @ 0x%08x=0x%08x\n",(unsigned int)pos,pulse_length);
-            }
-        }
-    }
-    else
-    {
-        pulse_length = data;
-    }
+#ifndef _WIN32
+#define TRACE_LOCAL __thread
+pthread_mutex_t trace_lock=PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t trace_key;        // Releases the ring of an ending thread
+pthread_once_t trace_once=PTHREAD_ONCE_INIT;
+int trace_fd=-1;                // tracefile, for crash dumps
+#else
+#define TRACE_LOCAL
+#endif
 
-    return (int)pulse_length;
-}
+TRACE_LOCAL struct trace_ring *trace_own=NULL;  // Ring of this thread
+TRACE_LOCAL tapoff trace_base=0;    // File offset of the buffer being decoded
+TRACE_LOCAL int trace_blk=0;        // Block being processed (1-based)
 
+#ifndef _WIN32
 /*------------------------------------------------------------------------*/
 /**
- * readbyte() - Read one data byte from TAP file
- * @file_inp: Input file pointer
- * @start: Start position for reading
- * @end: End position for reading
- * 
- * Reads a byte by decoding pulse sequences:
- * 1. Find sync pattern (long pulse followed by medium pulse)
- * 2. Read 8 bits (each bit is 2 pulses)
- * 3. Short-medium/long = bit 0, Medium/long-short = bit 1
- * 
- * Returns: Decoded byte value
+ * trace_release() - Hand the ring of an ending thread back (key destructor)
+ * @ring: Ring
+ *
+ * Its events stay until the next trace_reset().
  */
-unsigned char readbyte(FILE *file_inp,
-                       unsigned int start,
-                       unsigned int end)
+void trace_release(void *ring)
 {
-    int syncfound=0,cgot;
-    unsigned int i=0,counter=0,times;
-    unsigned char impulse,impulseprev;
-    unsigned char byte=0;
-    unsigned char bit=0;
+    pthread_mutex_lock(&trace_lock);
+    ((struct trace_ring *)ring)->live=0;
+    pthread_mutex_unlock(&trace_lock);
+}
 
-    // Find sync pattern
-    i=start;
-    if( (cgot=get_pulse(file_inp))==EOF)
-    {
-        return 0;
-    }
+void trace_key_init(void)
+{
+    pthread_key_create(&trace_key, trace_release);
+}
+#endif
+
+/*------------------------------------------------------------------------*/
+/**
+ * trace_ring_get() - Give the calling thread a ring
+ *
+ * Reuses an empty ring of an ended thread, or allocates one.
+ *
+ * Returns: Ring, NULL if there is none left
+ */
+struct trace_ring *trace_ring_get(void)
+{
+    struct trace_ring *r=NULL;
+    int i;
 
-    impulseprev=(unsigned char)cgot;
-    while ( !syncfound )
+#ifndef _WIN32
+    pthread_once(&trace_once, trace_key_init);
+    pthread_mutex_lock(&trace_lock);
+#endif
+    for(i=0;i<trace_nrings;i++)
     {
-        if( (cgot=get_pulse(file_inp))==EOF)
+        if( !trace_rings[i]->live && !trace_rings[i]->n )
         {
+            r=trace_rings[i];
             break;
         }
-        impulse=(unsigned char)cgot;
-        // Sync is: long pulse followed by medium pulse
-        if ( islong( impulseprev ) && ismedium( impulse ) )
-        {
-            syncfound=1;
-        }
-        else
-        {
-            impulseprev=impulse;
-        }
-        i++;
     }
-
-    if(!(syncfound))
+    if( !r && (trace_nrings<TRACE_RINGS) && (r=calloc(1,sizeof(*r)))!=NULL )
     {
-        if(verbose)
-        {
-            printf(" !!! SYNC NOT FOUND !!! \n");
-        }
-        return 0;
+        r->thread=trace_nrings;
+        trace_rings[trace_nrings++]=r;
     }
-    
-    // Read 8 bits
-    i=0;
-    times=0;
-    for (times=0;(times<8)&&(i<end);times++)
+    if(r)
     {
-        if( (cgot=get_pulse(file_inp))==EOF)
-        {
-            break;
-        }
-        impulseprev=(unsigned char)cgot;
-        if( (cgot=get_pulse(file_inp))==EOF)
-        {
-            break;
-        }
-        impulse=(unsigned char)cgot;
-
-        // Decode bit: short then medium/long = bit 0
-        if ( isshort( impulseprev ) &&  (ismedium( impulse ) || islong( impulse )) )
-        {
-            bit=0;
-        }
-        // Decode bit: medium/long then short = bit 1
-        if (( ismedium( impulseprev ) || islong( impulseprev )) &&  isshort( impulse ) )
-        {
-            bit=128;
-            counter++;
-        }
-        byte=byte>>1;
-        byte=byte|bit;
-        i+=2;
+        r->live=1;
+#ifndef _WIN32
+        pthread_setspecific(trace_key, r);
+#endif
     }
+#ifndef _WIN32
+    pthread_mutex_unlock(&trace_lock);
+#endif
+    trace_own=r;
+    return r;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * trace_put() - Record an event in the ring of the calling thread
+ * @type: TRACE_* event
+ * @off: TAP position
+ * @value: Event value
+ */
+COLD void trace_put(int type, tapoff off, unsigned int value)
+{
+    struct trace_ring *r=trace_own;
+    struct trace_event *e;
 
-    // Read trailing pulses (parity/stop bits)
-    if( (cgot=get_pulse(file_inp))==EOF)
+    if( !r && (r=trace_ring_get())==NULL )
     {
-        return 0;
+        return;
     }
-    impulseprev=(unsigned char)cgot;
-    if( (cgot=get_pulse(file_inp))==EOF)
+    e=&r->ev[r->n++ & (TRACE_EVENTS-1)];
+    e->off=off;
+    e->value=value;
+    e->block=(unsigned short)trace_blk;
+    e->type=(unsigned char)type;
+    e->thread=(unsigned char)r->thread;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * trace_reset() - Forget the events of the previous tape
+ */
+void trace_reset(void)
+{
+    int i;
+
+    for(i=0;i<trace_nrings;i++)
     {
-        return 0;
+        trace_rings[i]->n=0;
     }
-    impulse=(unsigned char)cgot;
-
-    return byte;
+    trace_blk=0;
 }
 
 /*------------------------------------------------------------------------*/
 /**
- * fixendtape() - Fix tape ending by removing trailing short pulses
- * @b: Buffer containing tape data
- * @len: Pointer to data length (will be updated)
- * 
- * Searches backwards from end of data to find the last non-short pulse
- * followed by a zero byte, and truncates the data there.
+ * trace_span() - Oldest events of a ring, in order
+ * @r: Ring
+ * @first: Output index of the oldest event
+ *
+ * Returns: Number of events kept
  */
-void fixendtape(unsigned char *b, int *len)
+unsigned int trace_span(struct trace_ring *r, unsigned int *first)
 {
-    int i,l=*len,e=l-0x4000;
-    i=l-4;
-    if(b[i]!=0)
+    if(r->n<=TRACE_EVENTS)
     {
-        for( ;i>e;i--)
+        *first=0;
+        return r->n;
+    }
+    *first=r->n & (TRACE_EVENTS-1);
+    return TRACE_EVENTS;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * trace_header() - Build the dump header of a ring
+ * @hdr: Output (TRACE_HDR bytes)
+ * @thread: Thread number
+ * @count: Events that follow
+ */
+void trace_header(unsigned char *hdr, int thread, unsigned int count)
+{
+    unsigned int size=sizeof(struct trace_event),t=thread;
+
+    memcpy(hdr, TRACE_MAGIC, 8);
+    memcpy(hdr+8, &size, 4);
+    memcpy(hdr+12, &t, 4);
+    memcpy(hdr+16, &count, 4);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * trace_print() - Print an event as text
+ * @e: Event
+ */
+void trace_print(const struct trace_event *e)
+{
+    printf("T%d %02d) %s @ 0x%08" PRIOFF "x=0x%0*x\n",
+           e->thread, e->block,
+           trace_names[(e->type<=TRACE_BLOCK) ? e->type : 0],
+           e->off, (e->type==TRACE_BADBYTE) ? 2 : 8, e->value);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * trace_flush() - Write the events of the tape just processed
+ * @failed: The tape failed
+ *
+ * Appends the rings to --trace FILE on a failure or with -d2, otherwise
+ * -d2 prints them.
+ */
+void trace_flush(int failed)
+{
+    unsigned char hdr[TRACE_HDR];
+    struct trace_ring *r;
+    unsigned int first,count,k;
+    FILE *f;
+    int i;
+
+    if( tracefile && (failed || (verbose>1)) )
+    {
+        if( (f=fopen(tracefile,"ab"))==NULL )
         {
-            if(isshort(b[i]))
+            printf("\nWarning: Cannot write trace file %s\n", tracefile);
+            return;
+        }
+        for(i=0;i<trace_nrings;i++)
+        {
+            r=trace_rings[i];
+            if( (count=trace_span(r,&first))==0 )
             {
-               continue;
+                continue;
             }
-            if(b[i]==0)
+            trace_header(hdr, r->thread, count);
+            fwrite(hdr, 1, TRACE_HDR, f);
+            fwrite(r->ev+first, sizeof(*r->ev), count-first, f);
+            fwrite(r->ev, sizeof(*r->ev), first, f);
+        }
+        fclose(f);
+    }
+    else if(verbose>1)
+    {
+        printf("\nTrace:\n");
+        for(i=0;i<trace_nrings;i++)
+        {
+            r=trace_rings[i];
+            count=trace_span(r,&first);
+            for(k=0;k<count;k++)
             {
-                *len=i+4;
-                break;
+                trace_print(&r->ev[(first+k) & (TRACE_EVENTS-1)]);
             }
         }
     }
-    return;
 }
 
+#ifndef _WIN32
 /*------------------------------------------------------------------------*/
 /**
- * isHdr() - Check if byte is a header marker
- * @byte: Byte value to check
- * 
- * In Commodore tape format, 0x89 indicates a header block
- * 
- * Returns: 1 if header marker, 0 otherwise
+ * trace_on_crash() - Dump the rings before dying of a fatal signal
+ * @sig: Signal
+ *
+ * Only calls write(), the rings may be caught mid-update.
  */
-int isHdr( unsigned char byte )
+void trace_on_crash(int sig)
 {
-    if( byte==0x89 )
+    unsigned char hdr[TRACE_HDR];
+    struct trace_ring *r;
+    unsigned int first,count;
+    int i;
+
+    for(i=0;i<trace_nrings;i++)
     {
-        return 1;
+        r=trace_rings[i];
+        if( (count=trace_span(r,&first))==0 )
+        {
+            continue;
+        }
+        trace_header(hdr, r->thread, count);
+        if( (write(trace_fd, hdr, TRACE_HDR)<0) ||
+            (write(trace_fd, r->ev+first, (count-first)*sizeof(*r->ev))<0) ||
+            (write(trace_fd, r->ev, first*sizeof(*r->ev))<0) )
+        {
+            break;
+        }
     }
-    return 0;
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
 /*------------------------------------------------------------------------*/
 /**
- * GetPrgName() - Extract program name from tape data
- * @start: Start position in file
- * @end: End position in file
- * @file_inp: Input file pointer
- * @blockname: Output buffer for program name (20 bytes)
- * 
- * MODIFIED VERSION: Replaces empty/NULL names with "NO-NAME"
- * 
- * Reads tape data to find header (0x89) and extracts the 16-character
- * program name that follows it. Cleans invalid characters, removes
- * trailing spaces, and replaces empty names with "NO-NAME".
+ * trace_crash_dumps() - Dump the rings to --trace FILE on a crash
  */
-void GetPrgName(unsigned int start,
-                unsigned int end,
-                FILE *file_inp,
-                unsigned char *blockname)
+void trace_crash_dumps(void)
 {
-    unsigned char byte[16]={0};
-    unsigned char name[20]={0};
-    int i;
-    fseek(file_inp, start, SEEK_SET);
-    byte[0]=0;
+    if( (trace_fd=open(tracefile, O_WRONLY|O_APPEND|O_CREAT, 0644))<0 )
+    {
+        printf("\nWarning: Cannot open trace file %s\n", tracefile);
+        return;
+    }
+    signal(SIGSEGV, trace_on_crash);
+    signal(SIGBUS, trace_on_crash);
+    signal(SIGFPE, trace_on_crash);
+    signal(SIGABRT, trace_on_crash);
+}
+#else
+void trace_crash_dumps(void)
+{
+}
+#endif
+
+/*------------------------------------------------------------------------*/
+/**
+ * trace_decode() - Print a trace dump or convert it to the Trace Event format
+ * @name: Dump written by --trace
+ * @json: Write it to a .json file for a trace viewer instead of printing
+ *
+ * Returns: 0 on success
+ */
+int trace_decode(const char *name, int json)
+{
+    unsigned char hdr[TRACE_HDR];
+    char out[_MAX_PATH+8];
+    struct trace_event e;
+    unsigned int size,thread,count,k;
+    FILE *f,*fo=NULL;
+    int sep=0,ok=1;
 
-    // Search for header marker (0x89)
-    while ( !isHdr(byte[0]) && !feof(file_inp) )
+    if( (f=fopen(name,"rb"))==NULL )
     {
-        byte[0]=readbyte(file_inp,start,end);
+        printf("\nOpen error or File not found: %s.\n",name);
+        return 1;
     }
-    if(feof(file_inp))
+    if(json)
     {
-        if(verbose)
+        out_base(out, outdir, name);
+        strcat(out, ".json");
+        if( (fo=fopen(out,"w"))==NULL )
         {
-            printf("\n!!! Premature end of file !!!");
+            printf("\nError: Cannot create %s\n",out);
+            fclose(f);
+            return 1;
         }
-        printf("\n");
-        return;
-    }
-    
-    // Read 13 bytes of header data
-    for(i=1;i<14 && !feof(file_inp);i++)
-    {
-        byte[i]=readbyte(file_inp,start,end);
+        fprintf(fo, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
     }
-    
-    // Read 16 bytes of program name
-    for(i=0;i<16 && !feof(file_inp);i++)
+    while( ok && (fread(hdr,1,TRACE_HDR,f)==TRACE_HDR) )
     {
-        name[i]=readbyte(file_inp,start,end);
-        // Clean control characters
-        if((name[i]>0) && (name[i]<0x20))
+        memcpy(&size, hdr+8, 4);
+        memcpy(&thread, hdr+12, 4);
+        memcpy(&count, hdr+16, 4);
+        if( memcmp(hdr,TRACE_MAGIC,8) || (size!=sizeof(e)) )
         {
-            name[i]='_';
+            printf("\n%s isn't a trace of this iTAP build.\n",name);
+            ok=0;
+            break;
         }
-        // Clean high-bit characters
-        else if((name[i]>=0xa0) && (name[i]<0xff))
+        if(!json)
         {
-            name[i]&=0x7f;
+            printf("\nThread %u, %u events:\n", thread, count);
+        }
+        for(k=0;k<count;k++)
+        {
+            if(fread(&e,sizeof(e),1,f)!=1)
+            {
+                ok=0;
+                break;
+            }
+            if(!json)
+            {
+                trace_print(&e);
+                continue;
+            }
+            fprintf(fo, "%s{\"name\":\"%s\",\"cat\":\"itap\",\"ph\":\"i\",\"s\":\"t\","
+                    "\"pid\":1,\"tid\":%d,\"ts\":%" PRIOFF "u,"
+                    "\"args\":{\"value\":%u,\"block\":%d}}",
+                    sep ? ",\n" : "", trace_names[(e.type<=TRACE_BLOCK) ? e.type : 0],
+                    e.thread, e.off, e.value, e.block);
+            sep=1;
         }
     }
-    name[16]=0;
-    strcpy(blockname,name);
+    fclose(f);
+    if(json)
+    {
+        fprintf(fo, "\n]}\n");
+        if(fclose(fo))
+        {
+            ok=0;
+        }
+        printf("\nTrace converted: %s\n",out);
+    }
+    return !ok;
+}
 
-    // Remove trailing spaces
-    for(i=15; (i>=0) && (blockname[i]) && (blockname[i]==0x20) ;i--)
+/*------------------------------------------------------------------------*/
+/**
+ * itap_exit() - Give up on the current tape
+ * @code: Exit code
+ *
+ * Exits the program, except in a watch worker where only the current tape
+ * is abandoned and the worker goes on with the next one.
+ */
+void itap_exit(int code)
+{
+    if(code)
     {
-        blockname[i]=0;
+        trace_flush(1);
+    }
+    if(fail_jmp)
+    {
+        longjmp(*fail_jmp, code ? code : 1);
     }
+    exit(code);
+}
 
-    // Replace invalid filename characters
-    for(i=0;blockname[i];i++)
+/*------------------------------------------------------------------------*/
+/*
+ * ROM loader byte decoding
+ *
+ * The KERNAL saves every header and data block twice: a countdown
+ * 0x89..0x81 followed by the data and an XOR checksum, then the same with
+ * the countdown 0x09..0x01. Each byte is a frame of 20 pulses: the marker
+ * (long, medium), 8 bits LSB first and an odd parity bit, where a bit is a
+ * pulse pair (short, medium) for 0 and (medium, short) for 1. The last
+ * frame of a copy is followed by the end-of-data marker (long, short).
+ *
+ * Decoding works on pulses in memory: every pulse maps to its class with
+ * class_table, every pair of classes to its meaning with pair_table.
+ */
+#define PULSE_S   0     // Pulse classes
+#define PULSE_M   1
+#define PULSE_L   2
+#define PULSE_X   3
+#define PAIR_0    0     // Pulse pair meanings
+#define PAIR_1    1
+#define PAIR_MARK 2     // Byte marker
+#define PAIR_END  3     // End-of-data marker, also read as bit 1
+#define PAIR_BAD  4
+#define ROM_FRAME 20    // Pulses per byte
+#define ROM_COUNT 9     // Countdown bytes per copy
+
+#define ROM_OK      0   // decode_byte() results
+#define ROM_EOD     1   // Valid byte followed by the end-of-data marker
+#define ROM_BAD    -1   // Bit pair, parity or following marker error
+#define ROM_NOSYNC -2   // No byte marker before the end of the buffer
+
+unsigned char class_table[256];    // Pulse class of every pulse value
+unsigned char pair_table[16];      // Meaning of every (class<<2|class) pair
+
+/*------------------------------------------------------------------------*/
+/**
+ * init_class_table() - Build the pulse class and pulse pair lookup tables
+ */
+void init_class_table(void)
+{
+    int i,a,c;
+
+    for(i=0;i<256;i++)
     {
-        if( strchr("*<>?:|^",blockname[i])!=NULL )
+        class_table[i]=PULSE_X;
+        for(a=PULSE_S;a<=PULSE_L;a++)
         {
-            blockname[i]='_';
+            if( (i>=pulse_win[a][0]) && (i<=pulse_win[a][1]) )
+            {
+                class_table[i]=a;
+            }
         }
-        else if(strchr(",\\/",blockname[i])!=NULL )
+    }
+    for(i=0;i<16;i++)
+    {
+        a=i>>2;
+        c=i&3;
+        if( (a==PULSE_S) && ((c==PULSE_M)||(c==PULSE_L)) )
         {
-            blockname[i]='.';
+            pair_table[i]=PAIR_0;
         }
-        else if(blockname[i] == '\"')
+        else if( (a==PULSE_M) && (c==PULSE_S) )
         {
-            blockname[i]='\'';
+            pair_table[i]=PAIR_1;
         }
-        else if(blockname[i]>0x7f)
+        else if( (a==PULSE_L) && (c==PULSE_M) )
         {
-            blockname[i]='_';
+            pair_table[i]=PAIR_MARK;
         }
-    }
-
-    // **NEW: Check if name is empty and replace with "NO-NAME"**
-    // This checks if the name is NULL, empty, or contains only spaces/underscores
-    int is_empty = 1;
-    for(i=0; blockname[i]; i++)
-    {
-        // If we find any character that's not space, underscore, or null
-        if(blockname[i] != 0x20 && blockname[i] != '_' && blockname[i] != 0)
+        else if( (a==PULSE_L) && (c==PULSE_S) )
         {
-            is_empty = 0;
-            break;
+            pair_table[i]=PAIR_END;
+        }
+        else
+        {
+            pair_table[i]=PAIR_BAD;
         }
     }
+}
 
-    // If name is empty or first character is null, replace with "NO-NAME"
-    if(is_empty || blockname[0] == 0)
+/*------------------------------------------------------------------------*/
+/**
+ * classify_pulses() - Map a run of pulses to their pulse classes
+ * @b: Pulse buffer
+ * @cls: Output classes (@len bytes)
+ * @len: Number of pulses
+ *
+ * Same mapping as class_table, done 16 pulses at a time with SSE2 range
+ * compares where available.
+ */
+void classify_pulses(const unsigned char *b, unsigned char *cls, tapoff len)
+{
+    tapoff i=0;
+
+#ifdef USE_SSE2
+    const __m128i s_lo=_mm_set1_epi8(pulse_win[0][0]);
+    const __m128i s_rng=_mm_set1_epi8(pulse_win[0][1]-pulse_win[0][0]);
+    const __m128i m_lo=_mm_set1_epi8(pulse_win[1][0]);
+    const __m128i m_rng=_mm_set1_epi8(pulse_win[1][1]-pulse_win[1][0]);
+    const __m128i l_lo=_mm_set1_epi8(pulse_win[2][0]);
+    const __m128i l_rng=_mm_set1_epi8(pulse_win[2][1]-pulse_win[2][0]);
+    const __m128i m_cls=_mm_set1_epi8(PULSE_M);
+    const __m128i l_cls=_mm_set1_epi8(PULSE_L);
+    const __m128i x_cls=_mm_set1_epi8(PULSE_X);
+    __m128i x,d,s,m,l,r;
+
+    for( ;i+16<=len;i+=16)
     {
-        strcpy(blockname, "NO-NAME");
+        x=_mm_loadu_si128((const __m128i *)(b+i));
+        d=_mm_sub_epi8(x,s_lo);
+        s=_mm_cmpeq_epi8(_mm_min_epu8(d,s_rng),d);
+        d=_mm_sub_epi8(x,m_lo);
+        m=_mm_cmpeq_epi8(_mm_min_epu8(d,m_rng),d);
+        d=_mm_sub_epi8(x,l_lo);
+        l=_mm_cmpeq_epi8(_mm_min_epu8(d,l_rng),d);
+        r=_mm_or_si128(_mm_and_si128(m,m_cls),_mm_and_si128(l,l_cls));
+        r=_mm_or_si128(r,_mm_andnot_si128(_mm_or_si128(s,_mm_or_si128(m,l)),x_cls));
+        _mm_storeu_si128((__m128i *)(cls+i),r);
     }
-
-    printf("%-16s",blockname);
-    if(verbose)
+#endif
+    for( ;i<len;i++)
     {
-        printf(" type %02X from $%02X%02X to $%02X%02X", byte[9], byte[11],byte[10],byte[13],byte[12]);
+        cls[i]=class_table[b[i]];
     }
-    printf("\n");
 }
 
 /*------------------------------------------------------------------------*/
 /**
- * save() - Save a program block to a new TAP file
- * @start: Start position in original TAP file
- * @end: End position in original TAP file
- * @chr1: Block number (0-based)
- * @nameread: Original TAP filename
- * 
- * **THIS FUNCTION GENERATES THE NEW HEADER FOR EACH SPLIT TAP FILE**
- * 
- * Creates a new TAP file containing:
- * 1. TAP signature (12 bytes): "C64-TAPE-RAW"
- * 2. TAP version (1 byte): Version from original file
- * 3. Reserved bytes (3 bytes): 0x00, 0x00, 0x00
- * 4. Data size (4 bytes): Little-endian size of the extracted data
- * 5. Tape data: The actual program data from start to end
+ * pulse_pair() - Meaning of the pulse pair at a position
  */
-void save( unsigned int start,
-           unsigned int end,
-           int chr1,
-           char *nameread)
+#define pulse_pair(b,p) pair_table[(class_table[(b)[p]]<<2)|class_table[(b)[(p)+1]]]
+
+/*------------------------------------------------------------------------*/
+/**
+ * decode_frame() - Decode the next ROM loader byte of a pulse buffer
+ * @b: Pulse buffer
+ * @len: Number of pulses
+ * @pos: Cursor, moved past the decoded frame
+ * @val: Output decoded byte
+ * @ext: Bytes of an extended pulse (1 on v0, 4 on v1/v2)
+ *
+ * Looks for the next byte marker from the cursor (skipping pauses and
+ * extended pulses), then decodes the 8 bits and checks the parity bit and
+ * the marker that follows the frame. Template of the decode_byte() kernels.
+ *
+ * Returns: ROM_OK, ROM_EOD, ROM_BAD (@val is still the best guess) or
+ * ROM_NOSYNC
+ */
+static FORCE_INLINE int decode_frame(const unsigned char *b, tapoff len, tapoff *pos,
+                                     unsigned char *val, const int ext)
 {
-    char msg[] = "C64-TAPE-RAW";  // TAP file signature
-    unsigned int l0,l1,l2,l3;
-    FILE *file_out, *file_inp;
-    char name[_MAX_PATH+8]={0};
-    char *p,*b;
-    unsigned int len ;
+    tapoff p=*pos;
+    int k,pair,bad=0,par=1;
+    unsigned char v=0;
 
-    // Construct output filename
-    strcpy(name,nameread);
-    name[_MAX_PATH-1]=0;
-    p=strrchr(name,'.');
-    if(p)
+    // Find the byte marker
+    while(p+ROM_FRAME<=len)
     {
-        *p=0;  // Remove original extension
+        if(b[p]==0)
+        {
+            p+=ext;
+            continue;
+        }
+        if(pulse_pair(b,p)==PAIR_MARK)
+        {
+            break;
+        }
+        p++;
     }
-    
-    // Add suffix based on naming mode
-    switch(addnames)
+    if(p+ROM_FRAME>len)
     {
-    case 1:
-        sprintf(name,"%s_%02d_%s",name,chr1+1,blocknames[chr1]);
-        break;
-    case 2:
-        sprintf(name,"%02d_%s",chr1+1,blocknames[chr1]);
-        break;
-    case 3:
-        sprintf(name,"%s",blocknames[chr1]);
-        break;
-    default:
-        sprintf(name,"%s_%02d",name,chr1+1);
-        break;
+        *pos=len;
+        return ROM_NOSYNC;
     }
-    strcat(name,".tap");
-    printf("%s\n",name);
 
-    // Create output file
-    file_out=fopen(name,"wb");
-    
-    // **WRITE NEW TAP HEADER - PART 1: Signature**
-    fwrite(msg,1,sizeof(msg)-1,file_out);  // Write "C64-TAPE-RAW" (12 bytes)
+    // 8 data bits, LSB first, then the parity bit
+    for(k=0;k<9;k++)
+    {
+        pair=pulse_pair(b,p+2+2*k);
+        if( (pair==PAIR_MARK)||(pair==PAIR_BAD) )
+        {
+            bad=1;
+            pair=PAIR_0;
+        }
+        pair=(pair!=PAIR_0);
+        if(k<8)
+        {
+            v|=pair<<k;
+            par^=pair;
+        }
+        else if(pair!=par)
+        {
+            bad=1;
+        }
+    }
+    *val=v;
+    *pos=p+ROM_FRAME;
+    if(bad)
+    {
+        trace_put(TRACE_BADBYTE, trace_base+p, v);
+        return ROM_BAD;
+    }
 
-    // Read data from original file
-    file_inp=fopen(nameread, "rb");
-    fseek(file_inp, start, SEEK_SET);
-    len=end-start;
-    b=malloc(len);
-    if(b)
+    // Another byte or the end of data must follow
+    if(*pos+2<=len)
     {
-        fread(b,len,1,file_inp);
-        
-        // Fix tape ending (remove trailing pulses)
-        fixendtape(b,&len);
-        
-        // **PREPARE DATA SIZE FOR HEADER**
-        // Calculate little-endian bytes for data size
-        l3=(len    )&0xff;  // Byte 0 (LSB)
-        l2=(len>> 8)&0xff;  // Byte 1
-        l1=(len>>16)&0xff;  // Byte 2
-        l0=(len>>24)&0xff;  // Byte 3 (MSB)
-        
-        // **WRITE NEW TAP HEADER - PART 2: Version and Size**
-        putc(tap_version, file_out);  // Byte 12: TAP version (0, 1, or 2)
-        putc(0, file_out);             // Byte 13: Reserved
-        putc(0, file_out);             // Byte 14: Reserved
-        putc(0, file_out);             // Byte 15: Reserved
-        putc(l3, file_out);            // Byte 16: Data size LSB
-        putc(l2, file_out);            // Byte 17: Data size byte 1
-        putc(l1, file_out);            // Byte 18: Data size byte 2
-        putc(l0, file_out);            // Byte 19: Data size MSB
-        
-        // **WRITE TAP DATA**
-        fwrite(b,len,1,file_out);
-        free(b);
+        pair=pulse_pair(b,*pos);
+        if(pair==PAIR_END)
+        {
+            return ROM_EOD;
+        }
+        if(pair!=PAIR_MARK)
+        {
+            return ROM_BAD;
+        }
     }
-    fclose(file_out);
-    fclose(file_inp);
+    return ROM_OK;
 }
 
+// Called with every piece of TAP data the pilot scan reads (-s)
+void (*scan_hook)(const unsigned char *, size_t)=NULL;
+
+// State of a pilot scan between two pieces of TAP data
+struct scan_state
+{
+    tapoff pos;             // TAP position of the next pulse
+    tapoff start,count;     // Pilot tone being measured
+    int ok,skip;            // In a pilot tone, length bytes still to skip
+};
+
+// Pulses over 0xff of a scan, traced apart from it
+struct high_state
+{
+    tapoff pos;             // TAP position of the next pulse
+    tapoff extpos;          // Extended pulse being read
+    unsigned int extlen;
+    int extleft;            // Length bytes of it still to read
+};
+
 /*------------------------------------------------------------------------*/
 /**
- * create_cleaned_tap() - Create cleaned TAP file with validated programs
- * @tapname: Original TAP filename
- * @nblocks: Number of valid blocks/programs
- * @array_blocks: Array of block start positions
- * @file_inp: Input file pointer (original TAP)
- * 
- * Creates filename_cleaned.tap with:
- * - 20-byte TAP header (corrected size)
- * - All cleaned program data sequentially
+ * scan_high() - Trace the pulses over 0xff of a piece of TAP data
+ * @hs: State, carried from the previous piece
+ * @buf: TAP data
+ * @n: Length
+ * @ext: Bytes of an extended pulse (1 on v0, 4 on v1/v2)
+ *
+ * Kept out of the pilot scan loop: a piece without a 0x00 byte is
+ * skipped with memchr().
  */
-void create_cleaned_tap(char *tapname, 
-                       int nblocks, 
-                       unsigned int *array_blocks,
-                       FILE *file_inp)
+void scan_high(struct high_state *hs, const unsigned char *buf, size_t n, int ext)
 {
-    FILE *cleaned_file;
-    char cleaned_filename[_MAX_PATH];
-    char *p;
-    int i;
-    unsigned char *block_data;
-    unsigned int block_len;
-    unsigned int total_len = 0;
-    unsigned int l0, l1, l2, l3;
-    char msg[] = "C64-TAPE-RAW";
-    
-    // ============================================================
-    // STEP A: Build file name
-    // ============================================================
-    strcpy(cleaned_filename, tapname);
-    cleaned_filename[_MAX_PATH-1] = 0;
-    
-    // Find and remove file extension
-    p = strrchr(cleaned_filename, '.');
-    if(p)
+    tapoff pos=hs->pos;
+    size_t i;
+
+    hs->pos+=n;
+    if( !hs->extleft && !memchr(buf,0,n) )
     {
-        *p = 0;  // Remove file extension
+        return;
     }
-    
-    // Añadir "_cleaned.tap"
-    strcat(cleaned_filename, "_cleaned.tap");
-    
-    printf("\nCreating cleaned TAP file: %s\n", cleaned_filename);
-    
-    // ============================================================
-    // Step B: Calc cleaned data size
-    // ============================================================
-    // First round: Calc total size
-    for(i = 0; i < nblocks; i++)
+    for(i=0;i<n;i++,pos++)
     {
-        block_len = array_blocks[i+1] - array_blocks[i];
-        
-        // Buffered
-        block_data = malloc(block_len);
-        if(!block_data)
+        if(hs->extleft)  // Length bytes, maybe left over by the previous piece
         {
-            printf("\nError: Cannot allocate memory for block %d\n", i+1);
-            return;
+            hs->extlen|=buf[i]<<(8*(3-hs->extleft));
+            if( (--hs->extleft==0) && ((hs->extlen>>3)>0xff) )
+            {
+                trace_put(TRACE_HIGHPULSE, hs->extpos, hs->extlen>>3);
+            }
+        }
+        else if( (buf[i]==0) && (ext==1) )
+        {
+            trace_put(TRACE_HIGHPULSE, pos, 0x100);
+        }
+        else if(buf[i]==0)
+        {
+            hs->extpos=pos;
+            hs->extlen=0;
+            hs->extleft=3;
         }
-        
-        // Read data block
-        fseek(file_inp, array_blocks[i], SEEK_SET);
-        fread(block_data, block_len, 1, file_inp);
-        
-        // Clean end tap (remove final pulses)
-        fixendtape(block_data, &block_len);
-        
-        // Add total
-        total_len += block_len;
-        
-        free(block_data);
     }
-    
-    // Statistics
-    printf("  Original size: %u bytes\n", array_blocks[nblocks] - 20);
-    printf("  Cleaned size:  %u bytes\n", total_len);
-    printf("  Reduction:     %u bytes (%.1f%%)\n", 
-           (array_blocks[nblocks] - 20) - total_len,
-           100.0 * ((array_blocks[nblocks] - 20) - total_len) / (array_blocks[nblocks] - 20));
-    printf("\n");
-    
-    // ============================================================
-    // Step C: Create clan tap file
-    // ============================================================
-    cleaned_file = fopen(cleaned_filename, "wb");
-    if(!cleaned_file)
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * scan_piece() - Find the pilot tones in a piece of TAP data
+ * @st: Scan state, carried from the previous piece
+ * @buf: TAP data
+ * @n: Length
+ * @ext: Bytes of an extended pulse (1 on v0, 4 on v1/v2)
+ * @found: Called with the first and last position of every run of more
+ *         than hdrminsize pilot pulses
+ * @ctx: Passed to @found
+ *
+ * The length bytes of v1/v2 extended pulses are skipped, they are not
+ * pulses.
+ */
+static FORCE_INLINE void scan_piece(struct scan_state *st, const unsigned char *buf, size_t n,
+                                    const int ext,
+                                    void (*found)(void *, tapoff, tapoff), void *ctx)
+{
+    tapoff pos=st->pos,start=st->start,count=st->count;
+    size_t i;
+    int ok=st->ok,skip=st->skip;
+
+    for(i=0;i<n;i++,pos++)
+    {
+        if( (ext>1) && skip )  // Length bytes of an extended pulse
+        {
+            skip--;
+            continue;
+        }
+        if( (buf[i]>40) && (buf[i]<60) )  // Same range as ispilot()
+        {
+            if(!ok)  // Start of new pilot sequence
+            {
+                ok=1;
+                count=0;
+                start=pos;
+            }
+            count++;
+            continue;
+        }
+        if(ok)  // End of pilot sequence, recorded if long enough
+        {
+            ok=0;
+            if(count>(tapoff)hdrminsize)
+            {
+                found(ctx, start, pos-1);
+            }
+        }
+        if( (ext>1) && (buf[i]==0) )
+        {
+            skip=3;
+        }
+    }
+    st->pos=pos;
+    st->start=start;
+    st->count=count;
+    st->ok=ok;
+    st->skip=skip;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pilot_found() - Record a pilot tone in array_pilot (scan_piece callback)
+ * @ctx: Number of pilot tones so far
+ */
+void pilot_found(void *ctx, tapoff start, tapoff end)
+{
+    int *pilot_tones=ctx;
+
+    grow_blocks(*pilot_tones+2);
+    array_pilot[*pilot_tones].start=start;
+    array_pilot[*pilot_tones].end=end;
+    (*pilot_tones)++;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pilot_scan() - Find the pilot tones of a TAP
+ * @file_inp: Input file, positioned after the 20-byte header
+ * @ext: Bytes of an extended pulse (1 on v0, 4 on v1/v2)
+ *
+ * Records every run of more than hdrminsize pilot pulses in array_pilot.
+ * Template of the scan_pilots() kernels.
+ *
+ * Returns: Number of pilot tones found
+ */
+static FORCE_INLINE int pilot_scan(FILE *file_inp, const int ext)
+{
+    struct scan_state st={.pos=20};
+    struct high_state hs={.pos=20};
+    unsigned char *buf;
+    size_t n;
+    int pilot_tones=0;
+
+    buf=malloc(SCAN_CHUNK);
+    if(!buf)
+    {
+        printf("\nError: Cannot allocate memory\n");
+        itap_exit(1);
+    }
+    while( (n=fread(buf,1,SCAN_CHUNK,file_inp))>0 )
+    {
+        if(scan_hook)
+        {
+            scan_hook(buf,n);
+        }
+        scan_piece(&st, buf, n, ext, pilot_found, &pilot_tones);
+        scan_high(&hs, buf, n, ext);
+    }
+    free(buf);
+    return pilot_tones;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Specialized kernels
+ *
+ * The decode and scan templates are instanced once per extended pulse
+ * layout (v0, and v1/v2 which share it), so their loops carry no
+ * configuration tests. select_kernels() points decode_byte() and
+ * scan_pilots() to the right pair once the TAP version is known.
+ */
+#define DECODE_KERNEL(name,ext) \
+int name(const unsigned char *b, tapoff len, tapoff *pos, unsigned char *val) \
+{ \
+    return decode_frame(b,len,pos,val,ext); \
+}
+#define SCAN_KERNEL(name,ext) \
+int name(FILE *file_inp) \
+{ \
+    return pilot_scan(file_inp,ext); \
+}
+
+DECODE_KERNEL(decode_byte_v0, 1)
+DECODE_KERNEL(decode_byte_v1, 4)
+SCAN_KERNEL(scan_pilots_v0, 1)
+SCAN_KERNEL(scan_pilots_v1, 4)
+
+int (*decode_byte)(const unsigned char *, tapoff, tapoff *, unsigned char *)=decode_byte_v0;
+int (*scan_pilots)(FILE *)=scan_pilots_v0;
+
+/*------------------------------------------------------------------------*/
+/**
+ * select_kernels() - Pick the kernels for the TAP version
+ *
+ * Called whenever tap_version is set. v2 uses the v1 kernels: both store
+ * extended pulses as 0x00 plus 3 length bytes.
+ */
+void select_kernels(void)
+{
+    int v=(tap_version!=0);
+
+    ext_len=v ? 4 : 1;
+    decode_byte=v ? decode_byte_v1 : decode_byte_v0;
+    scan_pilots=v ? scan_pilots_v1 : scan_pilots_v0;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Adaptive pulse windows (-a)
+ *
+ * A deck running fast or slow stretches every pulse by the same ratio.
+ * The ratio is measured on the pilot of each block (made of short pulses,
+ * nominally 0x30) and then followed through the block: every CAL_WINDOW
+ * pulses the mean short pulse of the window just classified updates it.
+ * Each window is classified and quantized with the short/medium/long
+ * windows scaled by its own ratio.
+ */
+#define CAL_WINDOW 0x4000       // Pulses per drift step
+#define CAL_MIN    0.80         // Ratio limits
+#define CAL_MAX    1.25
+
+double *cal_scale=NULL;         // Ratio of every window of the block
+tapoff cal_n=0,cal_max=0;       // Windows in use/allocated
+double cal_pilot=1.0;           // Pilot ratio of the last calibrated block
+double cal_lo=1.0,cal_hi=1.0;   // Drift range of the last calibrated block
+
+/*------------------------------------------------------------------------*/
+/**
+ * set_windows() - Scale the short/medium/long windows and rebuild tables
+ * @scale: Pulse length ratio (1.0 for the nominal windows)
+ */
+void set_windows(double scale)
+{
+    static const unsigned char nominal[3][2]={{0x24,0x36},{0x37,0x49},{0x4a,0x64}};
+    static double current=1.0;
+    double hi;
+    int k;
+
+    if(scale==current)
     {
-        printf("\nError: Cannot create cleaned file: %s\n", cleaned_filename);
         return;
     }
-    
-    // ============================================================
-    // Step D: Write heaader (20 bytes)
-    // ============================================================
-    
-    // Write sign TAP (12 bytes): "C64-TAPE-RAW"
-    fwrite(msg, 1, sizeof(msg)-1, cleaned_file);
-    
-    // Write TAP version (1 byte)
-    putc(tap_version, cleaned_file);
-    
-    // Write reserved bytes (3 bytes): 0x00, 0x00, 0x00
-    putc(0, cleaned_file);
-    putc(0, cleaned_file);
-    putc(0, cleaned_file);
-    
-    // Write data size (4 bytes, little-endian)
-    l3 = (total_len      ) & 0xff;  // LSB
-    l2 = (total_len >>  8) & 0xff;
-    l1 = (total_len >> 16) & 0xff;
-    l0 = (total_len >> 24) & 0xff;  // MSB
-    
-    putc(l3, cleaned_file);  // Byte 16
-    putc(l2, cleaned_file);  // Byte 17
-    putc(l1, cleaned_file);  // Byte 18
-    putc(l0, cleaned_file);  // Byte 19
-    
-    // ============================================================
-    // Step E: Write cleaned data
-    // ============================================================
-    // Second round: write all the cleaned blocks
-    for(i = 0; i < nblocks; i++)
+    current=scale;
+    for(k=0;k<3;k++)
+    {
+        pulse_win[k][0]=k ? pulse_win[k-1][1]+1 : (unsigned char)(nominal[k][0]*scale+0.5);
+        hi=nominal[k][1]*scale+0.5;
+        pulse_win[k][1]=(hi>0xff) ? 0xff : (unsigned char)hi;
+    }
+    init_quant_table();
+    init_class_table();
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pilot_ratio() - Measure the pulse ratio on the first pilot of a block
+ * @b: Block data
+ * @len: Block length
+ *
+ * The first pulses of the pilot are skipped, the motor may still be
+ * speeding up.
+ *
+ * Returns: Mean pilot pulse / 0x30, or 1.0 if the block has no pilot
+ */
+double pilot_ratio(const unsigned char *b, tapoff len)
+{
+    tapoff i,k,run,sum;
+
+    for(i=0;i<len;i=run+1)
+    {
+        for(run=i;(run<len)&&ispilot(b[run]);run++);
+        if(run-i>=PILOT_RUN*8)
+        {
+            for(sum=0,k=i+PILOT_RUN;k<run;k++)
+            {
+                sum+=b[k];
+            }
+            return (double)sum/(run-i-PILOT_RUN)/0x30;
+        }
+    }
+    return 1.0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * calib_block() - Calibrate the pulse windows of a block
+ * @b: Block data
+ * @len: Block length
+ *
+ * Fills cal_scale with the ratio of every CAL_WINDOW pulses, plus
+ * cal_pilot, cal_lo and cal_hi for the report. The tables are left with
+ * the nominal windows.
+ */
+void calib_block(const unsigned char *b, tapoff len)
+{
+    double ratio;
+    tapoff w,i,n,sum,count;
+
+    ratio=pilot_ratio(b,len);
+    ratio=(ratio<CAL_MIN) ? CAL_MIN : (ratio>CAL_MAX) ? CAL_MAX : ratio;
+    cal_pilot=cal_lo=cal_hi=ratio;
+
+    cal_n=(len+CAL_WINDOW-1)/CAL_WINDOW;
+    if(cal_n>cal_max)
+    {
+        cal_max=cal_n;
+        cal_scale=realloc(cal_scale,cal_max*sizeof(*cal_scale));
+        if(!cal_scale)
+        {
+            printf("\nError: Cannot allocate memory\n");
+            itap_exit(1);
+        }
+    }
+    for(w=0;w<cal_n;w++)
+    {
+        cal_scale[w]=ratio;
+        cal_lo=(ratio<cal_lo) ? ratio : cal_lo;
+        cal_hi=(ratio>cal_hi) ? ratio : cal_hi;
+
+        // Follow the drift on the short pulses of this window
+        set_windows(ratio);
+        n=(len-w*CAL_WINDOW<CAL_WINDOW) ? len-w*CAL_WINDOW : CAL_WINDOW;
+        for(sum=count=0,i=w*CAL_WINDOW;i<w*CAL_WINDOW+n;i++)
+        {
+            if(class_table[b[i]]==PULSE_S)
+            {
+                sum+=b[i];
+                count++;
+            }
+        }
+        if(count>=CAL_WINDOW/16)
+        {
+            ratio=(3*ratio+(double)sum/count/0x30)/4;
+            ratio=(ratio<CAL_MIN) ? CAL_MIN : (ratio>CAL_MAX) ? CAL_MAX : ratio;
+        }
+    }
+    set_windows(1.0);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * calib_report() - Print the calibration of the last calibrated block
+ */
+void calib_report(void)
+{
+    printf("  calibration: pilot %+.1f%%, drift %+.1f%% to %+.1f%%\n",
+           (cal_pilot-1)*100, (cal_lo-1)*100, (cal_hi-1)*100);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * classify_block() - Map the pulses of a block to their pulse classes
+ * @b: Block data
+ * @cls: Output classes (@len bytes)
+ * @len: Block length
+ *
+ * With -a every window uses its calibrated windows (calib_block() must
+ * have run on the block), otherwise the nominal ones.
+ */
+void classify_block(const unsigned char *b, unsigned char *cls, tapoff len)
+{
+    tapoff w,n;
+
+    if(!calibrate)
+    {
+        classify_pulses(b,cls,len);
+        return;
+    }
+    for(w=0;w*CAL_WINDOW<len;w++)
+    {
+        n=(len-w*CAL_WINDOW<CAL_WINDOW) ? len-w*CAL_WINDOW : CAL_WINDOW;
+        set_windows(cal_scale[(w<cal_n) ? w : cal_n-1]);
+        classify_pulses(b+w*CAL_WINDOW,cls+w*CAL_WINDOW,n);
+    }
+    set_windows(1.0);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * quantize_span() - Rewrite a run of data pulses to canonical values
+ * @b: Pulse buffer
+ * @len: Number of pulses
+ *
+ * Same mapping as quant_table, done 16 pulses at a time with SSE2 range
+ * compares where available.
+ *
+ * Returns: Number of pulses changed
+ */
+tapoff quantize_span(unsigned char *b, tapoff len)
+{
+    tapoff i=0,changed=0;
+    unsigned char q;
+
+#ifdef USE_SSE2
+    const __m128i s_lo=_mm_set1_epi8(pulse_win[0][0]);
+    const __m128i s_rng=_mm_set1_epi8(pulse_win[0][1]-pulse_win[0][0]);
+    const __m128i m_lo=_mm_set1_epi8(pulse_win[1][0]);
+    const __m128i m_rng=_mm_set1_epi8(pulse_win[1][1]-pulse_win[1][0]);
+    const __m128i l_lo=_mm_set1_epi8(pulse_win[2][0]);
+    const __m128i l_rng=_mm_set1_epi8(pulse_win[2][1]-pulse_win[2][0]);
+    const __m128i s_val=_mm_set1_epi8(0x30);
+    const __m128i m_val=_mm_set1_epi8(0x42);
+    const __m128i l_val=_mm_set1_epi8(0x56);
+    __m128i x,d,s,m,l,r;
+    int diff;
+
+    for( ;i+16<=len;i+=16)
+    {
+        x=_mm_loadu_si128((const __m128i *)(b+i));
+        // x in [lo,lo+rng] <=> min(x-lo,rng)==x-lo (unsigned)
+        d=_mm_sub_epi8(x,s_lo);
+        s=_mm_cmpeq_epi8(_mm_min_epu8(d,s_rng),d);
+        d=_mm_sub_epi8(x,m_lo);
+        m=_mm_cmpeq_epi8(_mm_min_epu8(d,m_rng),d);
+        d=_mm_sub_epi8(x,l_lo);
+        l=_mm_cmpeq_epi8(_mm_min_epu8(d,l_rng),d);
+        r=_mm_or_si128(_mm_and_si128(s,s_val),
+                       _mm_or_si128(_mm_and_si128(m,m_val),
+                                    _mm_and_si128(l,l_val)));
+        r=_mm_or_si128(r,_mm_andnot_si128(_mm_or_si128(s,_mm_or_si128(m,l)),x));
+        diff=~_mm_movemask_epi8(_mm_cmpeq_epi8(r,x))&0xffff;
+        if(diff)
+        {
+            _mm_storeu_si128((__m128i *)(b+i),r);
+            for( ;diff;diff&=diff-1)
+            {
+                changed++;
+            }
+        }
+    }
+#endif
+    for( ;i<len;i++)
+    {
+        q=quant_table[b[i]];
+        if(q!=b[i])
+        {
+            b[i]=q;
+            changed++;
+        }
+    }
+    return changed;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * quantize_piece() - Quantize a span of a block
+ * @b: Block data
+ * @off: Span offset in the block
+ * @len: Span length
+ *
+ * With -a the span is cut at the calibration windows, each part is
+ * quantized with its own pulse windows.
+ *
+ * Returns: Number of pulses changed
+ */
+tapoff quantize_piece(unsigned char *b, tapoff off, tapoff len)
+{
+    tapoff end=off+len,w,n,changed=0;
+
+    if(!calibrate)
+    {
+        return quantize_span(b+off,len);
+    }
+    while(off<end)
+    {
+        w=off/CAL_WINDOW;
+        n=(w+1)*CAL_WINDOW-off;
+        n=(n>end-off) ? end-off : n;
+        set_windows(cal_scale[(w<cal_n) ? w : cal_n-1]);
+        changed+=quantize_span(b+off,n);
+        off+=n;
+    }
+    set_windows(1.0);
+    return changed;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * quantize_block() - Quantize all data pulses of a block
+ * @b: Block data
+ * @len: Block length
+ *
+ * Pilot tones (runs of at least PILOT_RUN pilot pulses), pauses and
+ * extended pulses (0x00 plus 3 length bytes on v1/v2) are left untouched,
+ * everything in between goes through quantize_piece().
+ *
+ * Returns: Number of pulses changed
+ */
+tapoff quantize_block(unsigned char *b, tapoff len)
+{
+    tapoff i=0,seg=0,run,changed=0;
+
+    while(i<len)
+    {
+        if(b[i]==0)  // Pause/extended pulse
+        {
+            changed+=quantize_piece(b,seg,i-seg);
+            i+=ext_len;
+            seg=i;
+            continue;
+        }
+        if(ispilot(b[i]))
+        {
+            for(run=i;(run<len)&&ispilot(b[run]);run++);
+            if(run-i>=PILOT_RUN)
+            {
+                changed+=quantize_piece(b,seg,i-seg);
+                seg=run;
+            }
+            i=run;
+            continue;
+        }
+        i++;
+    }
+    if(seg<len)
+    {
+        changed+=quantize_piece(b,seg,len-seg);
+    }
+    return changed;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * fast_block() - Shorten the pilots and pauses of a block for fast loading
+ * @b: Block data
+ * @len: Block length (updated)
+ *
+ * A pilot tone longer than fastpilot pulses loses its start, as long as a
+ * ROM loader byte, a pause or the end of the block follows it; tones of
+ * turbo loaders run into their own sync and are left alone. A pause longer
+ * than fastpause ms becomes one pause of fastpause ms (v1/v2 only, a v0
+ * pause has no length). Data pulses are never touched.
+ *
+ * Returns: Number of bytes removed
+ */
+tapoff fast_block(unsigned char *b, tapoff *len)
+{
+    unsigned long cycles,limit=(unsigned long)(fastpause*(C64_CLOCK/1000));
+    tapoff i=0,o=0,run,n=*len;
+
+    if(limit>0xffffff)
+    {
+        limit=0xffffff;
+    }
+    while(i<n)
+    {
+        // Pauses in a row, as one
+        if( (b[i]==0) && tap_version )
+        {
+            for(run=i,cycles=0;(run+4<=n)&&(b[run]==0);run+=4)
+            {
+                cycles+=b[run+1]|(b[run+2]<<8)|((unsigned long)b[run+3]<<16);
+            }
+            if( (run>i) && (cycles>limit) )
+            {
+                b[o]=0;
+                b[o+1]=limit&0xff;
+                b[o+2]=(limit>>8)&0xff;
+                b[o+3]=(limit>>16)&0xff;
+                o+=4;
+                i=run;
+                continue;
+            }
+            run=(run>i) ? run : n;
+            memmove(b+o,b+i,(size_t)(run-i));
+            o+=run-i;
+            i=run;
+            continue;
+        }
+
+        // Pilot tone, cut down to its end
+        if(ispilot(b[i]))
+        {
+            for(run=i;(run<n)&&ispilot(b[run]);run++);
+            if( (run-i>fastpilot) &&
+                ((run+1>=n) || (b[run]==0) || (pulse_pair(b,run)==PAIR_MARK)) )
+            {
+                i=run-fastpilot;
+            }
+            memmove(b+o,b+i,(size_t)(run-i));
+            o+=run-i;
+            i=run;
+            continue;
+        }
+        b[o++]=b[i++];
+    }
+    *len=o;
+    return n-o;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * ROM loader block repair (-f)
+ *
+ * Repair decodes both copies of a block, keeps for every position the byte
+ * of the copy whose frame is valid, and recovers one position that is bad
+ * in both copies from the checksum. Frames that don't carry the chosen
+ * byte are re-encoded in place with canonical pulses, so block lengths
+ * don't change.
+ */
+struct rom_byte
+{
+    tapoff pos;           // Frame position in the block
+    unsigned char val;    // Decoded byte
+    unsigned char ok;     // Marker, bit pairs and parity are valid
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * rom_decode() - Decode the ROM byte frame starting at a marker
+ * @cls: Pulse classes
+ * @pos: Frame position
+ * @val: Output decoded byte
+ *
+ * Returns: 1 if the frame is valid, 0 otherwise
+ */
+int rom_decode(const unsigned char *cls, tapoff pos, unsigned char *val)
+{
+    int k,ok,bit,par=1;
+
+    ok=(pair_table[(cls[pos]<<2)|cls[pos+1]]==PAIR_MARK);
+    *val=0;
+    for(k=0;k<9;k++)
+    {
+        bit=pair_table[(cls[pos+2+2*k]<<2)|cls[pos+3+2*k]];
+        if( (bit==PAIR_MARK)||(bit==PAIR_BAD) )
+        {
+            bit=0;
+            ok=0;
+        }
+        bit=(bit!=PAIR_0);
+        if(k<8)
+        {
+            *val|=bit<<k;
+            par^=bit;
+        }
+        else if(bit!=par)
+        {
+            ok=0;
+        }
+    }
+    return ok;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * rom_encode() - Write a canonical ROM byte frame
+ * @b: Frame position in the pulse buffer
+ * @val: Byte to encode
+ */
+void rom_encode(unsigned char *b, unsigned char val)
+{
+    int k,bit,par=1;
+
+    *b++=0x56;
+    *b++=0x42;
+    for(k=0;k<9;k++)
+    {
+        bit=(k<8) ? (val>>k)&1 : par;
+        par^=bit;
+        *b++=bit ? 0x42 : 0x30;
+        *b++=bit ? 0x30 : 0x42;
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * rom_run() - Collect the byte frames of one block copy
+ * @cls: Pulse classes
+ * @len: Number of pulses
+ * @pos: Position of the first marker, updated to the end of the copy
+ * @run: Frame array, grown as needed
+ * @max: Size of the frame array
+ *
+ * Frames follow each other every ROM_FRAME pulses until the end-of-data
+ * marker (long, short). A single damaged marker doesn't end the copy as
+ * long as the next one is there.
+ *
+ * Returns: Number of frames
+ */
+int rom_run(const unsigned char *cls,
+            tapoff len,
+            tapoff *pos,
+            struct rom_byte **run,
+            int *max)
+{
+    tapoff p=*pos;
+    int n=0;
+
+    while(p+ROM_FRAME<=len)
+    {
+        if(n==*max)
+        {
+            *max=*max ? *max*2 : 256;
+            *run=realloc(*run,*max*sizeof(**run));
+            if(!*run)
+            {
+                printf("\nError: Cannot allocate memory\n");
+                itap_exit(1);
+            }
+        }
+        (*run)[n].pos=p;
+        (*run)[n].ok=rom_decode(cls,p,&(*run)[n].val);
+        n++;
+        p+=ROM_FRAME;
+        if( (p+2>len) || ((cls[p]==PULSE_L) && (cls[p+1]==PULSE_S)) )
+        {
+            break;
+        }
+        if( (cls[p]!=PULSE_L) || (cls[p+1]!=PULSE_M) )
+        {
+            if( (p+ROM_FRAME+2>len) ||
+                (cls[p+ROM_FRAME]!=PULSE_L) || (cls[p+ROM_FRAME+1]!=PULSE_M) )
+            {
+                break;
+            }
+        }
+    }
+    *pos=p;
+    return n;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * rom_copy() - Tell which copy of a block a frame run is
+ *
+ * Returns: 0x89 for the first copy, 0x09 for the repeat, 0 if neither
+ */
+int rom_copy(struct rom_byte *run, int n)
+{
+    int k,c1=0,c2=0;
+
+    if(n<=ROM_COUNT)
+    {
+        return 0;
+    }
+    for(k=0;k<ROM_COUNT;k++)
+    {
+        c1+=(run[k].val==0x89-k);
+        c2+=(run[k].val==0x09-k);
+    }
+    return (c1>ROM_COUNT/2) ? 0x89 : (c2>ROM_COUNT/2) ? 0x09 : 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * rom_rewrite() - Re-encode the frames of a copy that don't match
+ * @b: Pulse buffer
+ * @run: Frames of the copy
+ * @n: Number of frames
+ * @cd: First countdown byte of the copy (0x89 or 0x09)
+ * @val: Chosen bytes after the countdown
+ * @known: Which of @val are known
+ *
+ * Frames spanning a pause or extended pulse are never touched.
+ *
+ * Returns: Number of frames rewritten
+ */
+int rom_rewrite(unsigned char *b,
+                struct rom_byte *run,
+                int n,
+                int cd,
+                unsigned char *val,
+                unsigned char *known)
+{
+    int k,fixed=0;
+    unsigned char v;
+
+    for(k=0;k<n;k++)
+    {
+        if(k<ROM_COUNT)
+        {
+            v=(unsigned char)(cd-k);
+        }
+        else if(known[k-ROM_COUNT])
+        {
+            v=val[k-ROM_COUNT];
+        }
+        else
+        {
+            continue;
+        }
+        if( (run[k].ok && (run[k].val==v)) ||
+            memchr(b+run[k].pos,0,ROM_FRAME) )
+        {
+            continue;
+        }
+        rom_encode(b+run[k].pos,v);
+        fixed++;
+    }
+    return fixed;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * rom_vote() - Repair a block from its two copies
+ * @b: Pulse buffer
+ * @a: Frames of the first copy (or NULL)
+ * @na: Number of frames of @a
+ * @c: Frames of the repeat (or NULL)
+ * @nc: Number of frames of @c
+ * @lost: Incremented by the bytes that can't be recovered
+ *
+ * Returns: Number of frames rewritten
+ */
+int rom_vote(unsigned char *b,
+             struct rom_byte *a, int na,
+             struct rom_byte *c, int nc,
+             int *lost)
+{
+    unsigned char *val,*known,x=0;
+    int k,n,u=-1,bad=0,fixed;
+    struct rom_byte *fa,*fc;
+
+    // Copies of different length can't be compared, repair each alone
+    if( a && c && (na!=nc) )
+    {
+        return rom_vote(b,a,na,NULL,0,lost)+rom_vote(b,NULL,0,c,nc,lost);
+    }
+    n=(a ? na : nc)-ROM_COUNT;
+    val=malloc(n);
+    known=malloc(n);
+    if(!val || !known)
+    {
+        printf("\nError: Cannot allocate memory\n");
+        itap_exit(1);
+    }
+
+    // Pick the byte of the valid copy, checksum included
+    for(k=0;k<n;k++)
+    {
+        fa=a ? &a[ROM_COUNT+k] : NULL;
+        fc=c ? &c[ROM_COUNT+k] : NULL;
+        known[k]=1;
+        if( fa && fa->ok && (!fc || !fc->ok || (fc->val==fa->val)) )
+        {
+            val[k]=fa->val;
+        }
+        else if( fc && fc->ok && (!fa || !fa->ok) )
+        {
+            val[k]=fc->val;
+        }
+        else
+        {
+            known[k]=0;
+            u=k;
+            bad++;
+            continue;
+        }
+        x^=val[k];
+    }
+
+    // The XOR of data and checksum is 0: one unknown byte can be rebuilt
+    if(bad==1)
+    {
+        val[u]=x;
+        known[u]=1;
+        bad=0;
+    }
+    else if( (bad==0) && x )
+    {
+        if(verbose)
+        {
+            printf("  checksum error, block left as is\n");
+        }
+        memset(known,0,n);
+        bad=n;
+    }
+    *lost+=bad;
+
+    fixed=0;
+    if(a)
+    {
+        fixed+=rom_rewrite(b,a,na,0x89,val,known);
+    }
+    if(c)
+    {
+        fixed+=rom_rewrite(b,c,nc,0x09,val,known);
+    }
+    free(val);
+    free(known);
+    return fixed;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * repair_block() - Repair the ROM loader blocks found in a tape block
+ * @b: Block data
+ * @len: Block length
+ * @lost: Output number of bytes that couldn't be recovered
+ *
+ * Every first copy is paired with the repeat that follows it; a copy
+ * without its partner is repaired from its own checksum. Anything that
+ * doesn't look like a ROM block (turbo loaders, noise) is left alone.
+ *
+ * Returns: Number of bytes rewritten
+ */
+int repair_block(unsigned char *b, tapoff len, int *lost)
+{
+    unsigned char *cls;
+    struct rom_byte *run[2]={NULL,NULL};
+    int max[2]={0,0},n[2]={0,0},cur=0,pending=0,fixed=0,kind;
+    tapoff pos=0;
+
+    *lost=0;
+    cls=malloc((size_t)len);
+    if(!cls)
+    {
+        printf("\nError: Cannot allocate memory\n");
+        itap_exit(1);
+    }
+    classify_block(b,cls,len);
+
+    while(pos+ROM_FRAME<=len)
+    {
+        if( (cls[pos]!=PULSE_L) || (cls[pos+1]!=PULSE_M) )
+        {
+            pos++;
+            continue;
+        }
+        n[cur]=rom_run(cls,len,&pos,&run[cur],&max[cur]);
+        kind=rom_copy(run[cur],n[cur]);
+        if(kind==0x89)
+        {
+            if(pending)
+            {
+                fixed+=rom_vote(b,run[cur^1],n[cur^1],NULL,0,lost);
+            }
+            pending=1;
+            cur^=1;
+        }
+        else if(kind==0x09)
+        {
+            if(pending)
+            {
+                fixed+=rom_vote(b,run[cur^1],n[cur^1],run[cur],n[cur],lost);
+            }
+            else
+            {
+                fixed+=rom_vote(b,NULL,0,run[cur],n[cur],lost);
+            }
+            pending=0;
+        }
+    }
+    if(pending)
+    {
+        fixed+=rom_vote(b,run[cur^1],n[cur^1],NULL,0,lost);
+    }
+
+    free(run[0]);
+    free(run[1]);
+    free(cls);
+    return fixed;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * obtain_number() - Interactive menu to select block number
+ * @max: Maximum block number
+ * 
+ * Allows user to navigate with + and - keys and confirm with Enter
+ * 
+ * Returns: Selected block number, or max+2 if ESC pressed
+ */
+int obtain_number(int max)
+{
+    int current=1;
+    unsigned char key=0;
+
+    printf("\nChoose with <+> and <->, confirm with <Enter>\n");
+    while (key!=CR)
+    {
+        printf("\rChoice: %02d - %-16s",current,blocknames[current-1]);
+        key=(unsigned char)getch();
+        if ( key == 0x1b )  // ESC key
+        {
+            return max+2;
+        }
+        if ( (key=='+')&&(current<(max-1)) )
+        {
+            current++;
+        }
+        if ( (key=='-')&&(current>1) )
+        {
+            current--;
+        }
+    }
+    return current;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * fixendtape() - Fix tape ending by removing trailing short pulses
+ * @b: Buffer containing tape data
+ * @len: Pointer to data length (will be updated)
+ * 
+ * Searches backwards from end of data to find the last non-short pulse
+ * followed by a zero byte, and truncates the data there.
+ */
+void fixendtape(unsigned char *b, tapoff *len)
+{
+    long long i,l=(long long)*len,e=l-0x4000;
+    if(e<-1)
+    {
+        e=-1;
+    }
+    i=l-4;
+    if( (i>=0) && (b[i]!=0) )
+    {
+        for( ;i>e;i--)
+        {
+            if(isshort(b[i]))
+            {
+               continue;
+            }
+            if(b[i]==0)
+            {
+                *len=i+4;
+                break;
+            }
+        }
+    }
+    return;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * isHdr() - Check if byte is a header marker
+ * @byte: Byte value to check
+ * 
+ * In Commodore tape format, 0x89 indicates a header block
+ * 
+ * Returns: 1 if header marker, 0 otherwise
+ */
+int isHdr( unsigned char byte )
+{
+    if( byte==0x89 )
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * read_at() - Read a range of a file without using its cursor
+ * @file_inp: Input file
+ * @start: File position
+ * @b: Output buffer
+ * @len: Bytes to read
+ *
+ * Every call has its own cursor, so name decoding threads can share the
+ * input file.
+ *
+ * Returns: Bytes read
+ */
+tapoff read_at(FILE *file_inp, tapoff start, unsigned char *b, tapoff len)
+{
+#ifdef _WIN32
+    fseek64(file_inp, start, SEEK_SET);
+    return fread(b, 1, (size_t)len, file_inp);
+#else
+    tapoff done=0;
+    ssize_t n;
+
+    while(done<len)
+    {
+        n=pread(fileno(file_inp), b+done, (size_t)(len-done), (off_t)(start+done));
+        if(n<=0)
+        {
+            break;
+        }
+        done+=n;
+    }
+    return done;
+#endif
+}
+
+// Where decode_prg_name() reads pulses: the TAP, or its sidecar (-s)
+tapoff (*read_pulses)(FILE *, tapoff, unsigned char *, tapoff)=read_at;
+
+/*------------------------------------------------------------------------*/
+/**
+ * decode_prg_name() - Extract program name from tape data
+ * @start: Start position in file
+ * @end: End position in file
+ * @file_inp: Input file pointer
+ * @blockname: Output buffer for program name (20 bytes)
+ * @info: Output decoded header (type and addresses)
+ * 
+ * MODIFIED VERSION: Replaces empty/NULL names with "NO-NAME"
+ * 
+ * Loads the block (plus a short tail to end a header that starts near its
+ * end) and decodes it in memory to find the header (0x89) and the
+ * 16-character program name that follows it. The search never looks for a
+ * header past the block and gives up after HDR_SYNC_MAX frames, so a
+ * damaged block costs no more than its own length. Without -a only the
+ * first HDR_WINDOW pulses are loaded: a header further in would follow
+ * minutes of tape that isn't its pilot. Cleans invalid
+ * characters, removes trailing spaces, and replaces empty names with
+ * "NO-NAME". The outcome is left in @info->state (NAME_*).
+ * Prints nothing and, without -a, only writes @blockname and @info; a
+ * block without a header is recorded in the event trace.
+ *
+ * Returns: 0 on success, 1 if out of memory
+ */
+int decode_prg_name(tapoff start,
+                    tapoff end,
+                    FILE *file_inp,
+                    unsigned char *blockname,
+                    struct block_info *info)
+{
+    unsigned char byte[16]={0};
+    unsigned char name[20]={0};
+    unsigned char *b;
+    tapoff hdrpos,len,pos=0,win=end-start;
+    int i,res,tries;
+
+    // Read the block and the tail
+    info->hdr=0;
+    len=win+HDR_TAIL;
+    if( !calibrate && (len>HDR_WINDOW) )
+    {
+        len=HDR_WINDOW;
+    }
+    b=malloc((size_t)len);
+    if(!b)
+    {
+        return 1;
+    }
+    len=read_pulses(file_inp, start, b, len);
+    trace_base=start;
+    if(calibrate)
+    {
+        calib_block(b,len);
+        set_windows(cal_pilot);
+        info->pilot=cal_pilot;
+    }
+
+    // Search for header marker (0x89), starting inside the block
+    info->state=NAME_OK;
+    for(tries=1;;tries++)
+    {
+        res=decode_byte(b,len,&pos,&byte[0]);
+        if( (res==ROM_NOSYNC) || (pos-ROM_FRAME>=win) )
+        {
+            info->state=NAME_NOHDR;
+            break;
+        }
+        if( (res!=ROM_BAD) && isHdr(byte[0]) )
+        {
+            break;
+        }
+        if(tries==HDR_SYNC_MAX)
+        {
+            info->state=NAME_LIMIT;
+            break;
+        }
+    }
+    hdrpos=start+pos;
+    if(info->state!=NAME_OK)
+    {
+        trace_put(TRACE_NOHDR, start, tries);
+        if(calibrate)
+        {
+            set_windows(1.0);
+        }
+        free(b);
+        return 0;
+    }
+    
+    // Read 13 bytes of header data and 16 bytes of program name
+    for(i=1;i<14;i++)
+    {
+        decode_byte(b,len,&pos,&byte[i]);
+    }
+    for(i=0;i<16;i++)
+    {
+        decode_byte(b,len,&pos,&name[i]);
+        // Clean control characters
+        if((name[i]>0) && (name[i]<0x20))
+        {
+            name[i]='_';
+        }
+        // Clean high-bit characters
+        else if((name[i]>=0xa0) && (name[i]<0xff))
+        {
+            name[i]&=0x7f;
+        }
+    }
+    if(calibrate)
+    {
+        set_windows(1.0);
+    }
+    free(b);
+    name[16]=0;
+    strcpy(blockname,name);
+    info->type=byte[9];
+    info->load=(byte[11]<<8)|byte[10];
+    info->end =(byte[13]<<8)|byte[12];
+
+    // A real header has the full countdown, a known type and belongs to
+    // this block (not to the next one the sync search ran into)
+    info->hdr=(hdrpos <= end) && (byte[9]>=1) && (byte[9]<=5);
+    for(i=1;i<9;i++)
+    {
+        if(byte[i]!=0x89-i)
+        {
+            info->hdr=0;
+        }
+    }
+
+    // Remove trailing spaces
+    for(i=15; (i>=0) && (blockname[i]) && (blockname[i]==0x20) ;i--)
+    {
+        blockname[i]=0;
+    }
+
+    // Replace invalid filename characters
+    for(i=0;blockname[i];i++)
+    {
+        if( strchr("*<>?:|^",blockname[i])!=NULL )
+        {
+            blockname[i]='_';
+        }
+        else if(strchr(",\\/",blockname[i])!=NULL )
+        {
+            blockname[i]='.';
+        }
+        else if(blockname[i] == '\"')
+        {
+            blockname[i]='\'';
+        }
+        else if(blockname[i]>0x7f)
+        {
+            blockname[i]='_';
+        }
+    }
+
+    // **NEW: Check if name is empty and replace with "NO-NAME"**
+    // This checks if the name is NULL, empty, or contains only spaces/underscores
+    int is_empty = 1;
+    for(i=0; blockname[i]; i++)
+    {
+        // If we find any character that's not space, underscore, or null
+        if(blockname[i] != 0x20 && blockname[i] != '_' && blockname[i] != 0)
+        {
+            is_empty = 0;
+            break;
+        }
+    }
+
+    // If name is empty or first character is null, replace with "NO-NAME"
+    if(is_empty || blockname[0] == 0)
+    {
+        strcpy(blockname, "NO-NAME");
+    }
+
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * next_copy() - Decode the next ROM loader copy of a pulse buffer
+ * @b: Pulses
+ * @len: Length
+ * @pos: Position, moved past the copy
+ * @out: Output bytes
+ * @max: Size of @out
+ * @n: Data bytes of the copy, checksum excluded
+ *
+ * A copy is a countdown from 0x89 or 0x09, data bytes, and the checksum
+ * followed by the end-of-data marker.
+ *
+ * Returns: 0 for a good copy of at most @max bytes, 1 for a damaged or
+ *          longer one, ROM_NOSYNC when there are no more copies
+ */
+int next_copy(const unsigned char *b, tapoff len, tapoff *pos,
+              unsigned char *out, unsigned int max, unsigned int *n)
+{
+    unsigned char v,x;
+    unsigned int k;
+    int res;
+
+    // Countdown
+    for(;;)
+    {
+        res=decode_byte(b,len,pos,&v);
+        if(res==ROM_NOSYNC)
+        {
+            return ROM_NOSYNC;
+        }
+        if( (res==ROM_OK) && ((v==0x89) || (v==0x09)) )
+        {
+            break;
+        }
+    }
+    for(x=v,k=1;k<ROM_COUNT;k++)
+    {
+        res=decode_byte(b,len,pos,&v);
+        if( (res!=ROM_OK) || (v!=x-k) )
+        {
+            return 1;
+        }
+    }
+
+    // Data, the last byte before the end of data being the checksum
+    for(x=0,k=0;;k++)
+    {
+        res=decode_byte(b,len,pos,&v);
+        if(res<0)
+        {
+            return 1;
+        }
+        if(k<max)
+        {
+            out[k]=v;
+        }
+        x^=v;
+        if(res==ROM_EOD)
+        {
+            break;
+        }
+    }
+    *n=k;
+    return (x || (k>max)) ? 1 : 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * decode_program() - Decode the program data that follows a ROM header
+ * @b: Pulses of the header block and the block after it
+ * @len: Length
+ * @info: Decoded header
+ * @out: Output data (end-load bytes)
+ *
+ * Takes the first good copy of exactly end-load bytes, so the copies of
+ * the header itself and damaged copies are passed over.
+ *
+ * Returns: 0 on success
+ */
+int decode_program(const unsigned char *b, tapoff len, struct block_info *info, unsigned char *out)
+{
+    unsigned int size=info->end-info->load,n;
+    tapoff pos=0;
+    int res;
+
+    while( (res=next_copy(b,len,&pos,out,size,&n))!=ROM_NOSYNC )
+    {
+        if( !res && (n==size) &&
+            !( (size==192) && (out[0]==info->type) &&
+               (out[1]==(info->load&0xff)) && (out[2]==(info->load>>8)) ) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Signature identification (--sigs)
+ *
+ * A signature file names known programs and loaders, one per line:
+ *
+ *   bytes HEX LOADER TITLE     bytes found anywhere in a decoded copy
+ *   hash  HEX LOADER TITLE     FNV-1a 64 of a whole decoded copy
+ *
+ * LOADER is one word ("-" for none), TITLE the rest of the line, and lines
+ * starting with '#' are comments. Every good copy of a block (headers and
+ * program data, checksums excluded) is run through an Aho-Corasick
+ * automaton of all byte patterns and looked up in a table of the hashes,
+ * so the cost per byte doesn't depend on the number of signatures. A hash
+ * match wins over patterns, and a longer pattern over a shorter one.
+ */
+#define SIG_COPY 0x10000        // Longest copy matched
+
+// Known program or loader
+struct signature
+{
+    char *title;
+    char *loader;
+    int len;                    // Pattern length, 0 for a hash
+};
+
+// Hash table of 64-bit keys (key 0 is stored as 1)
+struct keymap
+{
+    unsigned long long *key;
+    int *val;
+    unsigned int size, used;
+};
+
+// Aho-Corasick automaton state
+struct ac_state
+{
+    int parent;                 // State before the last byte
+    int fail;                   // Longest proper suffix that is a state
+    int best;                   // Best signature ending here, 0 for none
+    int depth;
+    int row;                    // Row of ac_dense plus 1, 0 for none
+    unsigned char c;            // Last byte
+};
+
+char *sigfile=NULL;             // Signature file (--sigs)
+struct signature *sigs=NULL;    // Signatures, from index 1
+int nsigs=0;
+struct ac_state *ac=NULL;       // Automaton, state 0 is the root
+int ac_states=0,ac_cap=0;
+struct keymap ac_edges;         // (state+1)<<8|byte -> next state
+int (*ac_dense)[256]=NULL;      // Next states of the root and depth 1
+struct keymap sig_hashes;       // Copy hash -> signature
+
+/*------------------------------------------------------------------------*/
+/**
+ * keymap_find() - Look up a key
+ *
+ * Returns: Value, -1 if the key isn't there
+ */
+int keymap_find(struct keymap *map, unsigned long long key)
+{
+    unsigned int i;
+
+    if(!map->size)
+    {
+        return -1;
+    }
+    key|=(key==0);
+    i=(unsigned int)((key*0x9e3779b97f4a7c15ULL)>>32) & (map->size-1);
+    for( ;map->key[i];i=(i+1)&(map->size-1))
+    {
+        if(map->key[i]==key)
+        {
+            return map->val[i];
+        }
+    }
+    return -1;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * keymap_put() - Add a key, keeping the value of a key already there
+ *
+ * Returns: 0 on success, 1 if out of memory
+ */
+int keymap_put(struct keymap *map, unsigned long long key, int val)
+{
+    unsigned long long *old_key;
+    int *old_val;
+    unsigned int i,k;
+
+    if(map->used*2 >= map->size)
+    {
+        old_key=map->key;
+        old_val=map->val;
+        k=map->size;
+        map->size=k ? k*2 : 1024;
+        map->key=calloc(map->size, sizeof(*map->key));
+        map->val=malloc(map->size*sizeof(*map->val));
+        if(!map->key || !map->val)
+        {
+            return 1;
+        }
+        map->used=0;
+        for(i=0;i<k;i++)
+        {
+            if(old_key[i])
+            {
+                keymap_put(map, old_key[i], old_val[i]);
+            }
+        }
+        free(old_key);
+        free(old_val);
+    }
+    key|=(key==0);
+    i=(unsigned int)((key*0x9e3779b97f4a7c15ULL)>>32) & (map->size-1);
+    for( ;map->key[i];i=(i+1)&(map->size-1))
+    {
+        if(map->key[i]==key)
+        {
+            return 0;
+        }
+    }
+    map->key[i]=key;
+    map->val[i]=val;
+    map->used++;
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * sig_better() - Pick the better of two signatures (0 for none)
+ *
+ * Returns: @a or @b
+ */
+int sig_better(int a, int b)
+{
+    if(!a || !b)
+    {
+        return a ? a : b;
+    }
+    if(!sigs[a].len || !sigs[b].len)
+    {
+        return !sigs[a].len ? a : b;
+    }
+    return (sigs[b].len>sigs[a].len) ? b : a;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * ac_next() - Follow a byte in the automaton
+ *
+ * Returns: Next state
+ */
+int ac_next(int s, unsigned char c)
+{
+    int t;
+
+    for(;;)
+    {
+        if(ac[s].row)
+        {
+            return ac_dense[ac[s].row-1][c];
+        }
+        t=keymap_find(&ac_edges, ((unsigned long long)(s+1)<<8)|c);
+        if( (t>=0) || !s )
+        {
+            return (t>=0) ? t : 0;
+        }
+        s=ac[s].fail;
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * ac_add() - Add a byte pattern to the automaton
+ *
+ * Returns: 0 on success, 1 if out of memory
+ */
+int ac_add(const unsigned char *p, int len, int sig)
+{
+    struct ac_state *grown;
+    unsigned long long key;
+    int s=0,t,k;
+
+    for(k=0;k<len;k++)
+    {
+        key=((unsigned long long)(s+1)<<8)|p[k];
+        if( (t=keymap_find(&ac_edges,key))<0 )
+        {
+            if(ac_states>=ac_cap)
+            {
+                ac_cap*=2;
+                if( (grown=realloc(ac,ac_cap*sizeof(*ac)))==NULL )
+                {
+                    return 1;
+                }
+                ac=grown;
+            }
+            t=ac_states++;
+            memset(&ac[t], 0, sizeof(ac[t]));
+            ac[t].parent=s;
+            ac[t].c=p[k];
+            ac[t].depth=k+1;
+            if(keymap_put(&ac_edges,key,t))
+            {
+                return 1;
+            }
+        }
+        s=t;
+    }
+    ac[s].best=sig_better(ac[s].best, sig);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * ac_link() - Set the failure links once every pattern is in
+ *
+ * States are handled by depth, so the link of the parent is known. Each
+ * state takes the best signature of its link too, so a match needs no
+ * walk along the links. The root and the states of depth 1, where most
+ * bytes of a copy are matched, get a full row of next states.
+ *
+ * Returns: 0 on success, 1 if out of memory
+ */
+int ac_link(void)
+{
+    int *order,*count;
+    int s,k,c,rows,depth=0;
+
+    for(s=0;s<ac_states;s++)
+    {
+        depth=(ac[s].depth>depth) ? ac[s].depth : depth;
+    }
+    order=malloc(ac_states*sizeof(*order));
+    count=calloc(depth+2, sizeof(*count));
+    if(!order || !count)
+    {
+        free(order);
+        free(count);
+        return 1;
+    }
+    for(s=0;s<ac_states;s++)
+    {
+        count[ac[s].depth+1]++;
+    }
+    for(k=1;k<=depth+1;k++)
+    {
+        count[k]+=count[k-1];
+    }
+    for(s=0;s<ac_states;s++)
+    {
+        order[count[ac[s].depth]++]=s;
+    }
+    for(k=1;k<ac_states;k++)
+    {
+        s=order[k];
+        ac[s].fail=(ac[s].depth==1) ? 0 : ac_next(ac[ac[s].parent].fail, ac[s].c);
+        ac[s].best=sig_better(ac[s].best, ac[ac[s].fail].best);
+    }
+
+    // Rows in depth order, so a row can fill its gaps from the root row
+    rows=count[1];
+    if( (ac_dense=malloc(rows*sizeof(*ac_dense)))==NULL )
+    {
+        free(order);
+        free(count);
+        return 1;
+    }
+    for(k=0;k<rows;k++)
+    {
+        s=order[k];
+        for(c=0;c<256;c++)
+        {
+            ac_dense[k][c]=ac_next(s, (unsigned char)c);
+        }
+        ac[s].row=k+1;
+    }
+    free(order);
+    free(count);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * load_sigs() - Load a signature file and build the automaton
+ * @name: Signature filename
+ *
+ * Exits on a bad file.
+ */
+void load_sigs(const char *name)
+{
+    char line[1024],kind[16],value[512],loader[64];
+    unsigned char pat[256];
+    unsigned long long h;
+    FILE *f;
+    char *title,*s;
+    int len,lineno=0,ok,k,c;
+
+    if( (f=fopen(name,"r"))==NULL )
+    {
+        printf("\nError: Cannot open signature file: %s\n", name);
+        exit(1);
+    }
+    ac_cap=1024;
+    ac_states=1;                // Root
+    ac=calloc(ac_cap, sizeof(*ac));
+    sigs=calloc(1, sizeof(*sigs));
+    if(!ac || !sigs)
+    {
+        printf("\nError: Memory allocation failed\n");
+        exit(1);
+    }
+    while(fgets(line,sizeof(line),f))
+    {
+        lineno++;
+        line[strcspn(line,"\r\n")]=0;
+        if( (line[0]=='#') || (sscanf(line,"%15s",kind)!=1) )
+        {
+            continue;
+        }
+        len=-1;
+        ok=(sscanf(line,"%15s %511s %63s %n",kind,value,loader,&len)==3) &&
+           (len>0) && line[len] && !(strlen(value)&1);
+        title=line;
+        if(ok)
+        {
+            title=line+len;
+            for(s=title+strlen(title);(s>title) && (s[-1]==' ');)
+            {
+                *--s=0;
+            }
+        }
+
+        // Hex bytes
+        for(k=0;ok && value[2*k];k++)
+        {
+            ok=(k<(int)sizeof(pat)) && (sscanf(value+2*k,"%2x",&c)==1);
+            pat[k]=(unsigned char)c;
+        }
+        ok=ok && k;
+        if(ok)
+        {
+            if( (sigs=realloc(sigs,(nsigs+2)*sizeof(*sigs)))==NULL )
+            {
+                printf("\nError: Memory allocation failed\n");
+                exit(1);
+            }
+            nsigs++;
+            sigs[nsigs].title=strdup(title);
+            sigs[nsigs].loader=strdup(loader);
+            sigs[nsigs].len=k;
+            if(!strcmp(kind,"bytes"))
+            {
+                ok=!ac_add(pat, k, nsigs);
+            }
+            else if( !strcmp(kind,"hash") && (k==8) )
+            {
+                sigs[nsigs].len=0;
+                h=strtoull(value, NULL, 16);
+                ok=(keymap_find(&sig_hashes,h)<0) ? !keymap_put(&sig_hashes,h,nsigs) : 1;
+            }
+            else
+            {
+                ok=0;
+            }
+        }
+        if(!ok)
+        {
+            printf("\nError: Bad signature at %s line %d\n", name, lineno);
+            exit(1);
+        }
+    }
+    fclose(f);
+    if(ac_link())
+    {
+        printf("\nError: Memory allocation failed\n");
+        exit(1);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * sig_match() - Best signature of a decoded copy
+ * @p: Copy bytes
+ * @n: Length
+ *
+ * Returns: Signature, 0 for none
+ */
+int sig_match(const unsigned char *p, unsigned int n)
+{
+    unsigned int k;
+    int s=0,best;
+
+    best=keymap_find(&sig_hashes, fnv1a(p, n, FNV_INIT));
+    if(best>0)
+    {
+        return best;
+    }
+    for(best=0,k=0;k<n;k++)
+    {
+        s=ac_next(s, p[k]);
+        best=sig_better(best, ac[s].best);
+    }
+    return best;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * identify_block() - Match the copies of a block against the signatures
+ * @start: Start position in file
+ * @end: End position in file
+ * @file_inp: TAP file
+ * @copy: Work buffer (SIG_COPY bytes)
+ *
+ * Returns: Best signature of the block, 0 for none
+ */
+int identify_block(tapoff start, tapoff end, FILE *file_inp, unsigned char *copy)
+{
+    unsigned char *b;
+    tapoff len=end-start,pos;
+    unsigned int n;
+    int res,sig=0;
+
+    if( (b=malloc((size_t)len))==NULL )
+    {
+        return 0;
+    }
+    len=read_pulses(file_inp, start, b, len);
+    trace_base=start;
+    for(pos=0;(res=next_copy(b,len,&pos,copy,SIG_COPY,&n))!=ROM_NOSYNC;)
+    {
+        if(!res)
+        {
+            sig=sig_better(sig, sig_match(copy,n));
+        }
+    }
+    free(b);
+    return sig;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * identify_blocks() - Match the copies of every block against the signatures
+ * @nblocks: Number of blocks
+ * @file_inp: TAP file
+ *
+ * Leaves the best signature of each block in blockinfo[].sig.
+ */
+void identify_blocks(int nblocks, FILE *file_inp)
+{
+    unsigned char *copy;
+    int i;
+
+    copy=malloc(SIG_COPY);
+    for(i=0;copy && (i<nblocks);i++)
+    {
+        trace_blk=i+1;
+        blockinfo[i].sig=identify_block(array_blocks[i], array_blocks[i+1], file_inp, copy);
+    }
+    free(copy);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * print_prg_name() - Print the decoded name and header of a block
+ * @blockname: Program name
+ * @info: Decoded header
+ */
+void print_prg_name(unsigned char *blockname, struct block_info *info)
+{
+    if(info->state!=NAME_OK)
+    {
+        if(info->sig)
+        {
+            printf("%-16s = %s (%s)", "", sigs[info->sig].title, sigs[info->sig].loader);
+        }
+        if(verbose)
+        {
+            printf((info->state==NAME_LIMIT) ?
+                   "\n!!! No header in the first %d frames !!!" :
+                   "\n!!! No header in block !!!", HDR_SYNC_MAX);
+        }
+        printf("\n");
+        return;
+    }
+    printf("%-16s",blockname);
+    if(verbose)
+    {
+        printf(" type %02X from $%04X to $%04X", info->type, info->load, info->end);
+    }
+    if(calibrate)
+    {
+        printf(" [pulses %+.1f%%]", (info->pilot-1)*100);
+    }
+    if(info->sig)
+    {
+        printf(" = %s (%s)", sigs[info->sig].title, sigs[info->sig].loader);
+    }
+    printf("\n");
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * GetPrgName() - Decode and print the program name of a block
+ * @start: Start position in file
+ * @end: End position in file
+ * @file_inp: Input file pointer
+ * @blockname: Output buffer for program name (20 bytes)
+ * @info: Output decoded header (type and addresses)
+ */
+void GetPrgName(tapoff start,
+                tapoff end,
+                FILE *file_inp,
+                unsigned char *blockname,
+                struct block_info *info)
+{
+    if(decode_prg_name(start,end,file_inp,blockname,info))
+    {
+        printf("\nError: Cannot allocate memory\n");
+        itap_exit(1);
+    }
+    print_prg_name(blockname,info);
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Parallel name decoding
+ *
+ * Listing a tape decodes the header of every block. decode_names() shares
+ * the blocks out to a pool of threads; each reads its blocks through
+ * read_at() and fills their own blocknames/blockinfo slots, then
+ * PrintBlocks() prints them in block order. -a updates the shared pulse
+ * windows while decoding, it keeps the serial path. Each thread records
+ * its events in its own trace ring.
+ */
+#ifndef _WIN32
+
+struct name_pool
+{
+    FILE *file;             // Input, only read with read_at()
+    int next;               // Next block to decode
+    int nblocks;
+    pthread_mutex_t lock;   // Protects next
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * name_worker() - Decode blocks until none is left
+ * @arg: Shared name_pool
+ *
+ * A block whose decoding fails stays undecoded and PrintBlocks() decodes
+ * it again, reporting the error.
+ */
+void *name_worker(void *arg)
+{
+    struct name_pool *pool=arg;
+    int i;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        i=pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if(i>=pool->nblocks)
+        {
+            return NULL;
+        }
+        trace_blk=i+1;
+        decode_prg_name(array_blocks[i], array_blocks[i+1], pool->file,
+                        blocknames[i], &blockinfo[i]);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * decode_names() - Decode the names of all blocks ahead of PrintBlocks()
+ * @nblocks: Number of blocks
+ * @file_inp: Input file
+ */
+void decode_names(int nblocks, FILE *file_inp)
+{
+    struct name_pool pool;
+    pthread_t *tid;
+    int n=threads,k;
+
+    if(n<1)
+    {
+        n=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    n=(n>nblocks) ? nblocks : n;
+    if( (n<2) || calibrate || is_archive )
+    {
+        return;
+    }
+    if( (tid=malloc(n*sizeof(*tid)))==NULL )
+    {
+        return;
+    }
+    pool.file=file_inp;
+    pool.next=0;
+    pool.nblocks=nblocks;
+    pthread_mutex_init(&pool.lock, NULL);
+    for(k=0;k<n;k++)
+    {
+        if(pthread_create(&tid[k], NULL, name_worker, &pool))
+        {
+            break;
+        }
+    }
+    while(k--)
+    {
+        pthread_join(tid[k], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    free(tid);
+}
+
+#else
+
+void decode_names(int nblocks, FILE *file_inp)
+{
+}
+
+#endif
+
+
+/*------------------------------------------------------------------------*/
+/*
+ * Compact archive (.itz)
+ *
+ * Layout (all values little-endian):
+ *   0  "ITAP-RLE"                 signature (8 bytes)
+ *   8  format version             (1 byte)
+ *   9  reserved                   (3 bytes)
+ *  12  number of blocks           (4 bytes)
+ *  16  TAP data length            (8 bytes)
+ *  24  original TAP header        (20 bytes)
+ *  44  block index, one entry per block:
+ *        TAP position (8), archive position (8), name (16)
+ *   .. record stream
+ *
+ * The record stream expands to the TAP data (everything after the 20 byte
+ * header). Every block starts on a record boundary, so any block can be
+ * decoded on its own straight from the index.
+ *
+ *   ARC_REPEAT  value, count       count copies of value (pilots, pauses)
+ *   ARC_LITERAL count, bytes       raw bytes
+ *   ARC_PACKED  count, codes       canonical pulses, 2 bits each (0x30,
+ *                                  0x42, 0x56), four per byte, LSB first
+ *   ARC_CODED   count, fresh, ...  range coded pulses, see arc_model; the
+ *                                  model starts afresh when fresh is 1
+ *
+ * Counts are stored as 7-bit varints. Version 3 archives store a block as
+ * ARC_REPEAT and ARC_CODED records, with a fresh model on the first
+ * ARC_CODED of every block. ARC_LITERAL and ARC_PACKED are only read, from
+ * version 2 archives.
+ */
+#define ARC_VERSION   3
+#define ARC_OLDEST    2         // Oldest version that can still be read
+#define ARC_HDRSIZE   44
+#define ARC_IDXSIZE   32
+#define ARC_REPEAT    0
+#define ARC_LITERAL   1
+#define ARC_PACKED    2
+#define ARC_CODED     3
+#define ARC_MIN_RUN   256       // Shortest run stored as ARC_REPEAT
+#define ARC_CONTEXTS  1024      // Two previous pulses, 5 bits each
+#define ARC_PROB_BITS 11        // Probabilities are 11-bit fractions
+#define ARC_PROB_MOVE 5         // Adaptation speed, higher is slower
+
+const char arc_magic[] = "ITAP-RLE";
+const unsigned char arc_pulse[4] = { 0x30, 0x42, 0x56, 0x56 };
+tapoff *arc_tap;                // TAP position of each archived block
+tapoff *arc_pos;                // Archive position of each archived block
+int arc_nblocks=0;              // Number of archived blocks
+
+/*
+ * Pulse model of ARC_CODED records: each pulse is coded MSB first as 8
+ * binary decisions along a 256 node tree, with a separate tree for every
+ * pair of previous pulses (5 bits of each). Pulses are made of pairs and
+ * bytes of a handful of lengths, so the two previous pulses tell a lot
+ * about the next one, and the jitter of an unquantized capture only costs
+ * the few bits it really has. The model starts afresh on each block.
+ */
+unsigned short arc_model[ARC_CONTEXTS][256];
+
+struct arc_coder
+{
+    FILE *file;
+    unsigned long long low;     // Encoder: low end of the interval
+    unsigned int range;
+    unsigned int code;          // Decoder: position inside the interval
+    unsigned char cache;        // Encoder: byte held back for a carry
+    tapoff pending;             // Encoder: cache plus pending 0xff bytes
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * put_le32() - Write a 32-bit little-endian value
+ */
+void put_le32(unsigned int v, FILE *file_out)
+{
+    putc((v    )&0xff, file_out);
+    putc((v>> 8)&0xff, file_out);
+    putc((v>>16)&0xff, file_out);
+    putc((v>>24)&0xff, file_out);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * get_le32() - Read a 32-bit little-endian value
+ */
+unsigned int get_le32(FILE *file_inp)
+{
+    unsigned int l0,l1,l2,l3;
+
+    l3=getc(file_inp);
+    l2=getc(file_inp);
+    l1=getc(file_inp);
+    l0=getc(file_inp);
+    return (l0<<24)+(l1<<16)+(l2<<8)+l3;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * put_le64() - Write a 64-bit little-endian value
+ */
+void put_le64(tapoff v, FILE *file_out)
+{
+    put_le32((unsigned int)(v    )&0xffffffff, file_out);
+    put_le32((unsigned int)(v>>32)&0xffffffff, file_out);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * get_le64() - Read a 64-bit little-endian value
+ */
+tapoff get_le64(FILE *file_inp)
+{
+    tapoff lo;
+
+    lo=get_le32(file_inp);
+    return lo|((tapoff)get_le32(file_inp)<<32);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * get_le() - Little-endian value of @n bytes of a buffer
+ */
+tapoff get_le(const unsigned char *b, int n)
+{
+    tapoff v=0;
+
+    while(n--)
+    {
+        v=(v<<8)|b[n];
+    }
+    return v;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * put_varint() - Write a 7-bit varint
+ */
+void put_varint(tapoff v, FILE *file_out)
+{
+    while(v>=0x80)
+    {
+        putc((v&0x7f)|0x80, file_out);
+        v>>=7;
+    }
+    putc(v, file_out);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * get_varint() - Read a 7-bit varint
+ */
+tapoff get_varint(FILE *file_inp)
+{
+    tapoff v=0;
+    int c,shift=0;
+
+    do
+    {
+        if( (c=getc(file_inp))==EOF )
+        {
+            break;
+        }
+        v|=(tapoff)(c&0x7f)<<shift;
+        shift+=7;
+    } while( (c&0x80) && (shift<64) );
+    return v;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_context() - Context of the next pulse in the ARC_CODED model
+ * @p1: Previous pulse
+ * @p2: Pulse before that
+ */
+static FORCE_INLINE int arc_context(unsigned char p1, unsigned char p2)
+{
+    p1=(p1<0x80) ? p1>>2 : 0x1f;
+    p2=(p2<0x80) ? p2>>2 : 0x1f;
+    return (p2<<5)|p1;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_model_reset() - Make every decision of the pulse model even again
+ */
+void arc_model_reset(void)
+{
+    int i,j;
+
+    for(i=0;i<ARC_CONTEXTS;i++)
+    {
+        for(j=0;j<256;j++)
+        {
+            arc_model[i][j]=1<<(ARC_PROB_BITS-1);
+        }
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_shift_low() - Move the top byte of the encoder interval to the file
+ *
+ * A byte is held back while a carry could still ripple into it.
+ */
+void arc_shift_low(struct arc_coder *rc)
+{
+    unsigned int carry;
+
+    if( (rc->low<0xff000000ULL) || (rc->low>0xffffffffULL) )
+    {
+        carry=(unsigned int)(rc->low>>32);
+        putc((rc->cache+carry)&0xff, rc->file);
+        for(;rc->pending>1;rc->pending--)
+        {
+            putc((0xff+carry)&0xff, rc->file);
+        }
+        rc->pending=0;
+        rc->cache=(unsigned char)(rc->low>>24);
+    }
+    rc->pending++;
+    rc->low=(rc->low&0x00ffffffULL)<<8;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_put_bit() - Range code one binary decision
+ * @rc: Encoder
+ * @prob: Probability of a 0, updated
+ * @bit: Decision
+ */
+static FORCE_INLINE void arc_put_bit(struct arc_coder *rc,
+                                     unsigned short *prob,
+                                     int bit)
+{
+    unsigned int bound=(rc->range>>ARC_PROB_BITS)*(*prob);
+
+    if(!bit)
+    {
+        rc->range=bound;
+        *prob+=((1<<ARC_PROB_BITS)-*prob)>>ARC_PROB_MOVE;
+    }
+    else
+    {
+        rc->low+=bound;
+        rc->range-=bound;
+        *prob-=*prob>>ARC_PROB_MOVE;
+    }
+    while(rc->range<(1U<<24))
+    {
+        rc->range<<=8;
+        arc_shift_low(rc);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_get_bit() - Decode one binary decision
+ * @rc: Decoder
+ * @prob: Probability of a 0, updated
+ *
+ * Returns: Decision
+ */
+static FORCE_INLINE int arc_get_bit(struct arc_coder *rc, unsigned short *prob)
+{
+    unsigned int bound=(rc->range>>ARC_PROB_BITS)*(*prob);
+    int bit;
+
+    if(rc->code<bound)
+    {
+        rc->range=bound;
+        *prob+=((1<<ARC_PROB_BITS)-*prob)>>ARC_PROB_MOVE;
+        bit=0;
+    }
+    else
+    {
+        rc->code-=bound;
+        rc->range-=bound;
+        *prob-=*prob>>ARC_PROB_MOVE;
+        bit=1;
+    }
+    while(rc->range<(1U<<24))
+    {
+        rc->range<<=8;
+        rc->code=(rc->code<<8)|(getc(rc->file)&0xff);
+    }
+    return bit;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_coded() - Write pulses as an ARC_CODED record
+ * @b: Pulses
+ * @len: Number of pulses
+ * @fresh: Start the model afresh (first record of a block)
+ * @file_out: Archive file
+ */
+void arc_coded(unsigned char *b, tapoff len, int fresh, FILE *file_out)
+{
+    struct arc_coder rc={.file=file_out, .range=0xffffffff, .pending=1};
+    unsigned char p1=0,p2=0;
+    unsigned short *tree;
+    tapoff i;
+    int k,node;
+
+    putc(ARC_CODED, file_out);
+    put_varint(len, file_out);
+    putc(fresh, file_out);
+    if(fresh)
+    {
+        arc_model_reset();
+    }
+    for(i=0;i<len;i++)
+    {
+        tree=arc_model[arc_context(p1,p2)];
+        for(k=7,node=1;k>=0;k--)
+        {
+            arc_put_bit(&rc, &tree[node], (b[i]>>k)&1);
+            node=(node<<1)|((b[i]>>k)&1);
+        }
+        p2=p1;
+        p1=b[i];
+    }
+    for(k=0;k<5;k++)
+    {
+        arc_shift_low(&rc);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_encode() - Encode one block into archive records
+ * @b: Block data
+ * @len: Block length
+ * @file_out: Archive file
+ *
+ * Long runs of one value (quantized pilots, silence) are stored as
+ * ARC_REPEAT, everything in between as ARC_CODED. The model learns the
+ * pulse lengths of the block across all its ARC_CODED records.
+ */
+void arc_encode(unsigned char *b, tapoff len, FILE *file_out)
+{
+    tapoff i=0,lit=0,r;
+    int fresh=1;
+
+    while(i<len)
+    {
+        for(r=i+1;(r<len)&&(b[r]==b[i]);r++);
+        if(r-i>=ARC_MIN_RUN)
+        {
+            if(i>lit)
+            {
+                arc_coded(b+lit, i-lit, fresh, file_out);
+                fresh=0;
+            }
+            putc(ARC_REPEAT, file_out);
+            putc(b[i], file_out);
+            put_varint(r-i, file_out);
+            lit=r;
+        }
+        i=r;
+    }
+    if(len>lit)
+    {
+        arc_coded(b+lit, len-lit, fresh, file_out);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_decode() - Stream-decode archive records
+ * @file_inp: Archive file, positioned on a record boundary
+ * @skip: Number of decoded bytes to drop first
+ * @len: Number of bytes to produce
+ * @b: Output buffer, or NULL to write to @file_out
+ * @file_out: Output file (used when @b is NULL)
+ *
+ * Returns: Number of bytes produced
+ */
+tapoff arc_decode(FILE *file_inp,
+                  tapoff skip,
+                  tapoff len,
+                  unsigned char *b,
+                  FILE *file_out)
+{
+    unsigned char buf[0x1000];
+    unsigned int fill=0;
+    struct arc_coder rc={.file=file_inp};
+    unsigned char p1=0,p2=0;
+    unsigned short *tree;
+    tapoff n,k,done=0;
+    int type,value=0,packed=0,shift;
+
+    while(done<len)
+    {
+        if( (type=getc(file_inp))==EOF )
+        {
+            break;
+        }
+        if(type==ARC_REPEAT)
+        {
+            value=getc(file_inp);
+        }
+        n=get_varint(file_inp);
+        if(type==ARC_CODED)
+        {
+            if(getc(file_inp))
+            {
+                arc_model_reset();
+            }
+            rc.range=0xffffffff;
+            for(rc.code=0,shift=0;shift<5;shift++)
+            {
+                rc.code=(rc.code<<8)|(getc(file_inp)&0xff);
+            }
+            p1=p2=0;
+        }
+
+        // Runs are skipped in one go
+        if( (type==ARC_REPEAT)&&(skip) )
+        {
+            k=(n<skip) ? n : skip;
+            skip-=k;
+            n-=k;
+        }
+        for(k=0,shift=8;(k<n)&&(done<len);k++)
+        {
+            if(type==ARC_PACKED)
+            {
+                if(shift==8)
+                {
+                    packed=getc(file_inp);
+                    shift=0;
+                }
+                value=arc_pulse[(packed>>shift)&3];
+                shift+=2;
+            }
+            else if(type==ARC_LITERAL)
+            {
+                value=getc(file_inp);
+            }
+            else if(type==ARC_CODED)
+            {
+                tree=arc_model[arc_context(p1,p2)];
+                for(value=1;value<0x100;)
+                {
+                    value=(value<<1)|arc_get_bit(&rc, &tree[value]);
+                }
+                value&=0xff;
+                p2=p1;
+                p1=(unsigned char)value;
+            }
+            if(skip)
+            {
+                skip--;
+                continue;
+            }
+            if(b)
+            {
+                b[done]=(unsigned char)value;
+            }
+            else
+            {
+                buf[fill++]=(unsigned char)value;
+                if(fill==sizeof(buf))
+                {
+                    fwrite(buf, fill, 1, file_out);
+                    fill=0;
+                }
+            }
+            done++;
+        }
+    }
+    if(fill)
+    {
+        fwrite(buf, fill, 1, file_out);
+    }
+    return done;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * arc_read() - Read a range of TAP data out of a compact archive
+ * @file_inp: Archive file
+ * @start: TAP position of the range
+ * @len: Length of the range
+ * @b: Output buffer, or NULL to write to @file_out
+ * @file_out: Output file (used when @b is NULL)
+ *
+ * Decoding starts at the archived block holding @start.
+ *
+ * Returns: 1 on success, 0 on short read
+ */
+int arc_read(FILE *file_inp,
+             tapoff start,
+             tapoff len,
+             unsigned char *b,
+             FILE *file_out)
+{
+    int k;
+
+    for(k=arc_nblocks-1;(k>0)&&(arc_tap[k]>start);k--);
+    fseek64(file_inp, arc_pos[k], SEEK_SET);
+    return arc_decode(file_inp, start-arc_tap[k], len, b, file_out)==len;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * load_block() - Read a range of TAP data into memory
+ * @file_inp: Input file (TAP or compact archive)
+ * @start: TAP position of the range
+ * @len: Length of the range
+ * @b: Output buffer
+ *
+ * Returns: 1 on success, 0 on short read
+ */
+int load_block(FILE *file_inp, tapoff start, tapoff len, unsigned char *b)
+{
+    if(is_archive)
+    {
+        return arc_read(file_inp, start, len, b, NULL);
+    }
+    fseek64(file_inp, start, SEEK_SET);
+    return fread(b, 1, (size_t)len, file_inp)==len;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * open_archive() - Read the header and block index of a compact archive
+ * @file_inp: Archive file
+ * @array_blocks: Output array of block start positions, plus end of data
+ *
+ * Block names come from the index, no pulse decoding is needed.
+ *
+ * Returns: Number of blocks
+ */
+int open_archive(FILE *file_inp)
+{
+    int i;
+
+    fseek(file_inp, sizeof(arc_magic)-1, SEEK_SET);
+    i=getc(file_inp);
+    if( (i<ARC_OLDEST)||(i>ARC_VERSION) )
+    {
+        printf("\n\nUnsupported archive version!\n\n");
+        itap_exit(1);
+    }
+    fseek(file_inp, 12, SEEK_SET);
+    arc_nblocks=get_le32(file_inp);
+    if( (arc_nblocks<1)||(arc_nblocks>0x1000000) )
+    {
+        printf("\n\nArchive index is damaged!\n\n");
+        itap_exit(1);
+    }
+    grow_blocks(arc_nblocks);
+    arc_tap=malloc(arc_nblocks*sizeof(*arc_tap));
+    arc_pos=malloc(arc_nblocks*sizeof(*arc_pos));
+    if( !arc_tap || !arc_pos )
+    {
+        printf("\nError: Cannot allocate archive index\n");
+        itap_exit(1);
+    }
+    array_blocks[arc_nblocks]=get_le64(file_inp)+20;
+
+    // Original TAP header
+    fseek(file_inp, 24+12, SEEK_SET);
+    tap_version=(unsigned char)getc(file_inp);
+    select_kernels();
+
+    fseek(file_inp, ARC_HDRSIZE, SEEK_SET);
+    for(i=0;i<arc_nblocks;i++)
+    {
+        arc_tap[i]=array_blocks[i]=get_le64(file_inp);
+        arc_pos[i]=get_le64(file_inp);
+        fread(blocknames[i], 16, 1, file_inp);
+        blocknames[i][16]=0;
+    }
+    return arc_nblocks;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * create_archive() - Create a compact archive (.itz) of the TAP
+ * @tapname: Original TAP filename
+ * @nblocks: Number of blocks/programs
+ * @array_blocks: Array of block start positions
+ * @file_inp: Input file pointer (original TAP)
+ *
+ * With -q the quantized tape is archived, otherwise the archive expands
+ * back to a byte-identical copy of the TAP.
+ */
+void create_archive(char *tapname,
+                    int nblocks,
+                    tapoff *array_blocks,
+                    FILE *file_inp)
+{
+    FILE *arc_file;
+    char arc_filename[_MAX_PATH+8];
+    unsigned char header[20];
+    unsigned char *block_data;
+    tapoff block_len,total;
+    tapoff *pos;
+    int i;
+
+    out_base(arc_filename, outdir, tapname);
+    strcat(arc_filename, ".itz");
+
+    printf("\nCreating compact archive: %s\n", arc_filename);
+
+    arc_file = fopen(arc_filename, "wb");
+    if(!arc_file)
+    {
+        printf("\nError: Cannot create archive: %s\n", arc_filename);
+        return;
+    }
+
+    // Header and original TAP header, index is written once known
+    fseek(file_inp, is_archive ? 24 : 0, SEEK_SET);
+    fread(header, sizeof(header), 1, file_inp);
+    fwrite(arc_magic, 1, sizeof(arc_magic)-1, arc_file);
+    putc(ARC_VERSION, arc_file);
+    putc(0, arc_file);
+    putc(0, arc_file);
+    putc(0, arc_file);
+    put_le32(nblocks, arc_file);
+    put_le64(array_blocks[nblocks]-20, arc_file);
+    fwrite(header, sizeof(header), 1, arc_file);
+    fseek64(arc_file, ARC_HDRSIZE+(tapoff)nblocks*ARC_IDXSIZE, SEEK_SET);
+    pos = malloc(nblocks*sizeof(*pos));
+    if(!pos)
+    {
+        printf("\nError: Cannot allocate archive index\n");
+        fclose(arc_file);
+        return;
+    }
+
+    for(i = 0; i < nblocks; i++)
+    {
+        block_len = array_blocks[i+1] - array_blocks[i];
+        block_data = malloc((size_t)block_len);
+        if(!block_data)
+        {
+            printf("\nError: Cannot allocate memory for block %d\n", i+1);
+            fclose(arc_file);
+            free(pos);
+            return;
+        }
+        load_block(file_inp, array_blocks[i], block_len, block_data);
+        if(quantize)
+        {
+            quantize_block(block_data, block_len);
+        }
+        pos[i] = ftell64(arc_file);
+        arc_encode(block_data, block_len, arc_file);
+        printf("  Block %02d (%s): %" PRIOFF "u -> %" PRIOFF "u bytes\n",
+               i+1, blocknames[i], block_len,
+               (tapoff)ftell64(arc_file) - pos[i]);
+        free(block_data);
+    }
+    total = ftell64(arc_file);
+
+    // Block index
+    fseek64(arc_file, ARC_HDRSIZE, SEEK_SET);
+    for(i = 0; i < nblocks; i++)
+    {
+        put_le64(array_blocks[i], arc_file);
+        put_le64(pos[i], arc_file);
+        fwrite(blocknames[i], 16, 1, arc_file);
+    }
+    fclose(arc_file);
+    free(pos);
+
+    printf("\n  TAP size:     %" PRIOFF "u bytes\n", array_blocks[nblocks]);
+    printf("  Archive size: %" PRIOFF "u bytes (%.1f%%)\n",
+           total, 100.0 * total / array_blocks[nblocks]);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * expand_archive() - Expand a compact archive back to a TAP file
+ * @arcname: Archive filename
+ * @file_inp: Archive file pointer
+ * @array_blocks: Array of block start positions
+ * @nblocks: Number of blocks
+ */
+void expand_archive(char *arcname,
+                    FILE *file_inp,
+                    tapoff *array_blocks,
+                    int nblocks)
+{
+    FILE *tap_file;
+    char tap_filename[_MAX_PATH+8];
+    unsigned char header[20];
+    tapoff len;
+
+    out_base(tap_filename, outdir, arcname);
+    strcat(tap_filename, ".tap");
+
+    if( !batchmode && (tap_file=fopen(tap_filename, "rb"))!=NULL )
+    {
+        fclose(tap_file);
+        printf("\n%s already exists, overwrite? (Y/n)", tap_filename);
+        if((getch()&0xdf)!='Y')
+        {
+            exit(1);
+        }
+        printf("\n");
+    }
+
+    printf("\nExpanding archive to: %s\n", tap_filename);
+    tap_file = fopen(tap_filename, "wb");
+    if(!tap_file)
+    {
+        printf("\nError: Cannot create TAP file: %s\n", tap_filename);
+        return;
+    }
+
+    fseek(file_inp, 24, SEEK_SET);
+    fread(header, sizeof(header), 1, file_inp);
+    fwrite(header, sizeof(header), 1, tap_file);
+
+    len = array_blocks[nblocks] - array_blocks[0];
+    if(!arc_read(file_inp, array_blocks[0], len, NULL, tap_file))
+    {
+        printf("\nError: Archive is truncated\n");
+    }
+    fclose(tap_file);
+    printf("  %" PRIOFF "u bytes written\n", len+20);
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Pulse class sidecar (-s)
+ *
+ * <tapname>.cls keeps the class of every pulse of a TAP in 2 bits (short,
+ * medium, long, other), the raw value of every "other" pulse (pauses,
+ * extended pulses and their length bytes, pulses out of the windows) and
+ * the block table. The pilot scan writes it; later runs with -s take the
+ * blocks from it and decode names from it, reading about a quarter of the
+ * data. Splits, repairs and -a still read the TAP itself.
+ *
+ * A sidecar is only used while the TAP keeps the size, mtime and sampled
+ * hash (first and last CLS_SAMPLE bytes, start of every block) it was
+ * built from, with the same -h/-k values and pulse windows.
+ *
+ *   0  "ITAPCLS1"
+ *   8  TAP version, pulse windows (6), reserved
+ *  16  TAP size, mtime, sampled hash (8 each)
+ *  40  -h and -k values, number of blocks, reserved (4 each)
+ *  56  pulses, exceptions, exceptions offset, blocks offset (8 each)
+ *  88  classes: pulse k of the TAP data in bits 2*(k&3) of byte k/4
+ *  ..  exceptions: position delta (varint) and raw value
+ *  ..  block starts, plus end of data (8 each)
+ */
+#define CLS_MAGIC  "ITAPCLS1"
+#define CLS_HEADER 88
+#define CLS_SAMPLE 0x10000      // Bytes hashed at each end of the TAP
+
+// Sidecar being written by the pilot scan
+struct side_state
+{
+    FILE *out;              // Sidecar
+    FILE *exc;              // Exceptions, appended to the sidecar at the end
+    tapoff pulses;          // Pulses classified
+    tapoff nexc,last;       // Exceptions, TAP position of the last one
+    int ext;                // Extended pulse length bytes still to come
+    unsigned char pack;     // Classes of the byte being packed
+} side;
+
+FILE *side_inp=NULL;            // Sidecar of the current tape
+tapoff side_pulses=0;           // Pulses in the sidecar
+tapoff side_nexc=0;             // Exceptions in the sidecar
+tapoff *side_pos=NULL;          // Exception TAP positions, ascending
+unsigned char *side_val=NULL;   // Exception raw values
+
+/*------------------------------------------------------------------------*/
+/**
+ * side_name() - Sidecar filename of the current tape
+ * @dst: Output buffer (_MAX_PATH bytes)
+ */
+void side_name(char *dst)
+{
+    out_base(dst, outdir, tapname);
+    strcat(dst, ".cls");
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * side_hash() - Sampled hash of a TAP
+ * @file_inp: TAP file
+ * @size: TAP size
+ * @blocks: Block starts
+ * @nblocks: Number of blocks
+ *
+ * Hashes both ends of the file and the first bytes of every block, so a
+ * changed TAP is caught without reading all of it.
+ *
+ * Returns: 64-bit hash
+ */
+unsigned long long side_hash(FILE *file_inp, tapoff size, tapoff *blocks, int nblocks)
+{
+    unsigned char *b;
+    unsigned long long h=FNV_INIT;
+    tapoff n=(size<CLS_SAMPLE) ? size : CLS_SAMPLE;
+    int i;
+
+    b=malloc(CLS_SAMPLE);
+    if(!b)
+    {
+        return 0;
+    }
+    h=fnv1a(b, (size_t)read_at(file_inp, 0, b, n), h);
+    h=fnv1a(b, (size_t)read_at(file_inp, size-n, b, n), h);
+    for(i=0;i<nblocks;i++)
+    {
+        h=fnv1a(b, (size_t)read_at(file_inp, blocks[i], b, 64), h);
+    }
+    free(b);
+    return h;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * side_chunk() - Classify and store a piece of the TAP data (scan_hook)
+ * @b: TAP data, following the previous piece
+ * @n: Length
+ */
+void side_chunk(const unsigned char *b, size_t n)
+{
+    size_t i;
+    unsigned char c;
+
+    for(i=0;i<n;i++)
+    {
+        c=class_table[b[i]];
+        if(side.ext)
+        {
+            c=PULSE_X;
+            side.ext--;
+        }
+        else if( (b[i]==0) && tap_version )
+        {
+            side.ext=3;
+        }
+        if(c==PULSE_X)
+        {
+            put_varint(20+side.pulses-side.last, side.exc);
+            putc(b[i], side.exc);
+            side.last=20+side.pulses;
+            side.nexc++;
+        }
+        side.pack|=c<<(2*(side.pulses&3));
+        if( (++side.pulses&3)==0 )
+        {
+            putc(side.pack, side.out);
+            side.pack=0;
+        }
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * side_begin() - Start writing the sidecar of the current tape
+ *
+ * The classes are filled in by the pilot scan through scan_hook.
+ */
+void side_begin(void)
+{
+    static const unsigned char zero[CLS_HEADER];
+    char name[_MAX_PATH];
+
+    memset(&side, 0, sizeof(side));
+    side_name(name);
+    if( (side.out=fopen(name,"w+b"))==NULL || (side.exc=tmpfile())==NULL )
+    {
+        printf("\nWarning: Cannot create %s\n", name);
+        if(side.out)
+        {
+            fclose(side.out);
+            side.out=NULL;
+        }
+        return;
+    }
+    fwrite(zero, 1, CLS_HEADER, side.out);
+    scan_hook=side_chunk;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * side_finish() - Complete the sidecar once the blocks are known
+ * @file_inp: Scanned TAP
+ * @nblocks: Number of blocks
+ */
+void side_finish(FILE *file_inp, int nblocks)
+{
+    unsigned char b[0x4000];
+    struct stat st;
+    tapoff exc_off,blk_off,size;
+    size_t n;
+    int i;
+
+    scan_hook=NULL;
+    if(side.pulses&3)
+    {
+        putc(side.pack, side.out);
+    }
+    exc_off=ftell64(side.out);
+    rewind(side.exc);
+    while( (n=fread(b,1,sizeof(b),side.exc))>0 )
+    {
+        fwrite(b, 1, n, side.out);
+    }
+    fclose(side.exc);
+    blk_off=ftell64(side.out);
+    for(i=0;i<=nblocks;i++)
+    {
+        put_le64(array_blocks[i], side.out);
+    }
+
+    stat(tapname, &st);
+    size=(tapoff)st.st_size;
+    fseek64(side.out, 0, SEEK_SET);
+    fwrite(CLS_MAGIC, 1, 8, side.out);
+    putc(tap_version, side.out);
+    fwrite(pulse_win, 1, 6, side.out);
+    putc(0, side.out);
+    put_le64(size, side.out);
+    put_le64((tapoff)st.st_mtime, side.out);
+    put_le64(side_hash(file_inp, size, array_blocks, nblocks), side.out);
+    put_le32(hdrminsize, side.out);
+    put_le32(blockminsize, side.out);
+    put_le32(nblocks, side.out);
+    put_le32(0, side.out);
+    put_le64(side.pulses, side.out);
+    put_le64(side.nexc, side.out);
+    put_le64(exc_off, side.out);
+    put_le64(blk_off, side.out);
+    if(fclose(side.out))
+    {
+        printf("\nWarning: Cannot write the pulse class sidecar\n");
+    }
+    side.out=NULL;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * side_read() - Rebuild TAP data from the sidecar (read_pulses)
+ * @file_inp: TAP file (used if the sidecar can't be read)
+ * @start: TAP position
+ * @b: Output buffer
+ * @len: Pulses to read
+ *
+ * Classes come back as the canonical pulses 0x30/0x42/0x56, which decode
+ * exactly like the originals; other pulses get their raw value back.
+ * Safe to call from several threads.
+ *
+ * Returns: Pulses read
+ */
+tapoff side_read(FILE *file_inp, tapoff start, unsigned char *b, tapoff len)
+{
+    static const unsigned char canon[4]={0x30,0x42,0x56,0x00};
+    unsigned char *packed;
+    tapoff first,k,i,lo,hi,mid;
+
+    if( (start<20) || (start-20>=side_pulses) )
+    {
+        return 0;
+    }
+    first=start-20;
+    if(first+len>side_pulses)
+    {
+        len=side_pulses-first;
+    }
+    packed=malloc((size_t)((first+len+3)/4-first/4));
+    if(!packed)
+    {
+        return read_at(file_inp, start, b, len);
+    }
+    read_at(side_inp, CLS_HEADER+first/4, packed, (first+len+3)/4-first/4);
+    for(i=0;i<len;i++)
+    {
+        k=first+i;
+        b[i]=canon[(packed[k/4-first/4]>>(2*(k&3)))&3];
+    }
+    free(packed);
+
+    // Raw values of the other pulses
+    for(lo=0,hi=side_nexc;lo<hi;)
+    {
+        mid=(lo+hi)/2;
+        if(side_pos[mid]<start)
+        {
+            lo=mid+1;
+        }
+        else
+        {
+            hi=mid;
+        }
+    }
+    for(;(lo<side_nexc)&&(side_pos[lo]<start+len);lo++)
+    {
+        b[side_pos[lo]-start]=side_val[lo];
+    }
+    return len;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * side_load() - Take the blocks of the current tape from its sidecar
+ * @file_inp: TAP file
+ *
+ * Without -a, names are then decoded from the sidecar as well.
+ *
+ * Returns: Number of blocks, 0 if there is no valid sidecar
+ */
+int side_load(FILE *file_inp)
+{
+    unsigned char hdr[CLS_HEADER];
+    char name[_MAX_PATH];
+    struct stat st;
+    FILE *f;
+    tapoff size,*blocks=NULL,k,pos=0;
+    int i,nblocks=0,ok;
+
+    side_name(name);
+    if( (f=fopen(name,"rb"))==NULL )
+    {
+        return 0;
+    }
+    ok=!stat(tapname,&st) && (fread(hdr,1,CLS_HEADER,f)==CLS_HEADER) &&
+       !memcmp(hdr,CLS_MAGIC,8) && !memcmp(hdr+9,pulse_win,6);
+    size=(tapoff)st.st_size;
+    ok=ok &&
+       (get_le(hdr+16,8)==size) && (get_le(hdr+24,8)==(tapoff)st.st_mtime) &&
+       (get_le(hdr+40,4)==(tapoff)hdrminsize) && (get_le(hdr+44,4)==(tapoff)blockminsize) &&
+       (get_le(hdr+56,8)+20==size);
+    if(ok)
+    {
+        nblocks=(int)get_le(hdr+48,4);
+        blocks=malloc((nblocks+1)*sizeof(*blocks));
+        fseek64(f, get_le(hdr+80,8), SEEK_SET);
+        for(i=0;blocks && (i<=nblocks);i++)
+        {
+            blocks[i]=get_le64(f);
+        }
+        ok=blocks && (side_hash(file_inp, size, blocks, nblocks)==get_le(hdr+32,8));
+    }
+    if(ok)
+    {
+        side_nexc=get_le(hdr+64,8);
+        side_pos=malloc((size_t)side_nexc*sizeof(*side_pos)+1);
+        side_val=malloc((size_t)side_nexc+1);
+        ok=side_pos && side_val;
+        fseek64(f, get_le(hdr+72,8), SEEK_SET);
+        for(k=0;ok && (k<side_nexc);k++)
+        {
+            pos+=get_varint(f);
+            side_pos[k]=pos;
+            side_val[k]=(unsigned char)getc(f);
+        }
+    }
+    if(!ok)
+    {
+        free(blocks);
+        free(side_pos);
+        free(side_val);
+        side_pos=NULL;
+        side_val=NULL;
+        side_nexc=0;
+        fclose(f);
+        return 0;
+    }
+
+    grow_blocks(nblocks+1);
+    memcpy(array_blocks, blocks, (nblocks+1)*sizeof(*blocks));
+    free(blocks);
+    tap_version=hdr[8];
+    select_kernels();
+    side_inp=f;
+    side_pulses=get_le(hdr+56,8);
+    if(!calibrate)
+    {
+        read_pulses=side_read;
+    }
+    if(verbose)
+    {
+        printf("\nBlocks%s from %s\n", calibrate ? "" : " and pulse classes", name);
+    }
+    return nblocks;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * side_close() - Stop using the sidecar of the current tape
+ */
+void side_close(void)
+{
+    if(side.out)  // Left open by a failed scan
+    {
+        fclose(side.out);
+        fclose(side.exc);
+        side.out=NULL;
+        scan_hook=NULL;
+    }
+    if(side_inp)
+    {
+        fclose(side_inp);
+        side_inp=NULL;
+    }
+    free(side_pos);
+    free(side_val);
+    side_pos=NULL;
+    side_val=NULL;
+    side_nexc=0;
+    read_pulses=read_at;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Incremental split (-r)
+ *
+ * The manifest (<tapname>.manifest, next to the outputs) lists every file
+ * written by the last split: content hash, size, mtime, source range and
+ * name. A planned output is only written when it differs from what is on
+ * disk: if size and mtime still match the manifest its hash is trusted,
+ * otherwise the file is compared byte by byte. Outputs left over from the
+ * previous run are reported as stale (and removed with -r2).
+ */
+struct manifest_entry
+{
+  char *name;                // Output filename
+  tapoff size;               // File size
+  long long mtime;           // File modification time
+  unsigned long long hash;   // FNV-1a of the whole file
+  tapoff start, end;         // Source range in the TAP
+  int used;                  // Planned again in this run
+} *manifest;
+int manifest_n=0, manifest_max=0;
+int inc_written=0, inc_same=0;
+
+/*------------------------------------------------------------------------*/
+/**
+ * manifest_name() - Build the manifest filename of a tape
+ */
+void manifest_name(char *dst, const char *tapname)
+{
+    out_base(dst, outdir, tapname);
+    strcat(dst, ".manifest");
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * manifest_find() - Find (and optionally add) the manifest entry of a file
+ *
+ * Returns: Entry, or NULL if not found and @add is 0
+ */
+struct manifest_entry *manifest_find(const char *name, int add)
+{
+    int i;
+
+    for(i=0;i<manifest_n;i++)
+    {
+        if(!strcmp(manifest[i].name,name))
+        {
+            return &manifest[i];
+        }
+    }
+    if(!add)
+    {
+        return NULL;
+    }
+    if(manifest_n==manifest_max)
+    {
+        manifest_max=manifest_max ? manifest_max*2 : 64;
+        manifest=realloc(manifest, manifest_max*sizeof(*manifest));
+        if(!manifest)
+        {
+            printf("\nError: Cannot allocate manifest\n");
+            itap_exit(1);
+        }
+    }
+    memset(&manifest[manifest_n],0,sizeof(*manifest));
+    manifest[manifest_n].name=strdup(name);
+    return &manifest[manifest_n++];
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * manifest_load() - Read the manifest of the previous split, if any
+ */
+void manifest_load(const char *tapname)
+{
+    FILE *f;
+    char fname[_MAX_PATH+16],line[_MAX_PATH+128],*p;
+    struct manifest_entry *e;
+    unsigned long long hash,size,start,end;
+    long long mtime;
+    int n;
+
+    manifest_n=0;
+    inc_written=inc_same=0;
+    manifest_name(fname, tapname);
+    if( (f=fopen(fname,"r"))==NULL )
+    {
+        return;
+    }
+    while(fgets(line,sizeof(line),f))
+    {
+        if( (line[0]=='#') ||
+            (sscanf(line,"%llx\t%llu\t%lld\t%llu\t%llu\t%n",
+                    &hash,&size,&mtime,&start,&end,&n)<5) )
+        {
+            continue;
+        }
+        p=line+n;
+        p[strcspn(p,"\r\n")]=0;
+        e=manifest_find(p,1);
+        e->hash=hash;
+        e->size=size;
+        e->mtime=mtime;
+        e->start=start;
+        e->end=end;
+    }
+    fclose(f);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * output_piece() - Get a piece of the data of a planned output
+ * @b: Data of the output, or NULL if it is streamed from tap_inp
+ * @start: TAP position of the data
+ * @off: Offset of the piece
+ * @n: Length of the piece (up to COPY_CHUNK)
+ * @buf: Buffer for a streamed piece (COPY_CHUNK bytes)
+ *
+ * Returns: The piece, NULL on short read
+ */
+const unsigned char *output_piece(const unsigned char *b, tapoff start, tapoff off, size_t n, unsigned char *buf)
+{
+    if(b)
+    {
+        return b+off;
+    }
+    return (read_at(tap_inp, start+off, buf, n)==n) ? buf : NULL;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * data_hash() - Carry a hash on over the data of a planned output
+ * @hash: Hash so far, updated
+ * @b: Data of the output, or NULL if it is streamed from tap_inp
+ * @start: TAP position of the data
+ * @len: Data length
+ *
+ * Returns: 1 on success, 0 on short read
+ */
+int data_hash(unsigned long long *hash, const unsigned char *b, tapoff start, tapoff len)
+{
+    unsigned char buf[COPY_CHUNK];
+    const unsigned char *p;
+    tapoff done;
+    size_t n;
+
+    for(done=0;done<len;done+=n)
+    {
+        n=(len-done < sizeof(buf)) ? (size_t)(len-done) : sizeof(buf);
+        if( (p=output_piece(b,start,done,n,buf))==NULL )
+        {
+            return 0;
+        }
+        *hash=fnv1a(p, n, *hash);
+    }
+    return 1;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * output_hash() - Hash of a planned output
+ * @header: TAP header of the output
+ * @b: Data of the output, or NULL if it is streamed from tap_inp
+ * @start: TAP position of the data
+ * @len: Data length
+ *
+ * Returns: 64-bit hash, the same whether the data is in memory or not
+ */
+unsigned long long output_hash(unsigned char *header, const unsigned char *b, tapoff start, tapoff len)
+{
+    unsigned long long hash=fnv1a(header, 20, FNV_INIT);
+
+    data_hash(&hash, b, start, len);
+    return hash;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * same_output() - Check if a planned output is already on disk
+ * @name: Output filename
+ * @header: TAP header of the output
+ * @b: Data of the output, or NULL if it is streamed from tap_inp
+ * @start: TAP position of the data
+ * @len: Data length
+ *
+ * Returns: 1 if the file exists with the same content, 0 otherwise
+ */
+int same_output(const char *name, unsigned char *header, const unsigned char *b, tapoff start, tapoff len)
+{
+    struct manifest_entry *e;
+    struct stat st;
+    unsigned char buf[COPY_CHUNK],piece[COPY_CHUNK];
+    const unsigned char *p;
+    tapoff done;
+    size_t n;
+    FILE *f;
+    int same;
+
+    if( stat(name,&st) || ((tapoff)st.st_size != len+20) )
+    {
+        return 0;
+    }
+
+    // Unchanged since the manifest was written: compare hashes
+    e=manifest_find(name,0);
+    if( e && (e->size==(tapoff)st.st_size) && (e->mtime==(long long)st.st_mtime) )
+    {
+        return output_hash(header,b,start,len)==e->hash;
+    }
+
+    // Otherwise compare the contents
+    if( (f=fopen(name,"rb"))==NULL )
+    {
+        return 0;
+    }
+    same=(fread(buf,1,20,f)==20) && !memcmp(buf,header,20);
+    for(done=0;same&&(done<len);done+=n)
+    {
+        n=(len-done < sizeof(buf)) ? (size_t)(len-done) : sizeof(buf);
+        same=(fread(buf,1,n,f)==n) && ((p=output_piece(b,start,done,n,piece))!=NULL) &&
+             !memcmp(buf,p,n);
+    }
+    fclose(f);
+    return same;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * manifest_record() - Record an output of this run in the manifest
+ *
+ * @b is NULL for an output streamed from tap_inp.
+ */
+void manifest_record(const char *name,
+                     unsigned char *header,
+                     const unsigned char *b,
+                     tapoff len,
+                     tapoff start,
+                     tapoff end)
+{
+    struct manifest_entry *e;
+    struct stat st;
+
+    e=manifest_find(name,1);
+    if(e->used)
+    {
+        printf("  Warning: %s is produced twice in this run\n", name);
+    }
+    e->used=1;
+    e->hash=output_hash(header,b,start,len);
+    e->size=len+20;
+    e->start=start;
+    e->end=end;
+    e->mtime=stat(name,&st) ? 0 : (long long)st.st_mtime;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * manifest_finish() - Report stale outputs and write the new manifest
+ */
+void manifest_finish(const char *tapname)
+{
+    FILE *f;
+    char fname[_MAX_PATH+16];
+    int i,stale=0;
+
+    for(i=0;i<manifest_n;i++)
+    {
+        if(manifest[i].used)
+        {
+            continue;
+        }
+        stale++;
+        if(incremental>1)
+        {
+            printf("Removing stale output: %s\n", manifest[i].name);
+            remove(manifest[i].name);
+        }
+        else
+        {
+            printf("Stale output: %s\n", manifest[i].name);
+        }
+    }
+
+    manifest_name(fname, tapname);
+    if( (f=fopen(fname,"w"))==NULL )
+    {
+        printf("\nError: Cannot write manifest: %s\n", fname);
+        return;
+    }
+    fprintf(f, "# iTAP manifest: hash size mtime start end name\n");
+    for(i=0;i<manifest_n;i++)
+    {
+        if(manifest[i].used)
+        {
+            fprintf(f, "%016llx\t%" PRIOFF "u\t%lld\t%" PRIOFF "u\t%" PRIOFF "u\t%s\n",
+                    manifest[i].hash, manifest[i].size, manifest[i].mtime,
+                    manifest[i].start, manifest[i].end, manifest[i].name);
+        }
+    }
+    fclose(f);
+
+    printf("\n%d written, %d unchanged, %d stale%s\n", inc_written, inc_same,
+           stale, (stale && incremental>1) ? " (removed)" : "");
+    for(i=0;i<manifest_n;i++)
+    {
+        free(manifest[i].name);
+    }
+    manifest_n=0;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Single-container output (--container tar|zip)
+ *
+ * All the files of a run (split blocks, index and a manifest of the
+ * members) go into one uncompressed archive, <tapname>.tar or .zip, as
+ * they are produced. A tar member header carries the size, so it's
+ * written first; a zip local header gets its CRC and sizes patched in
+ * once the member is complete, and the central directory is written on
+ * close. Zip is limited to 4 GB and 65535 members (no zip64).
+ */
+#define CONT_TAR 1
+#define CONT_ZIP 2
+
+struct cont_member
+{
+    char *name;                 // Member name
+    tapoff offset;              // Header offset in the container
+    tapoff size;                // Data size
+    unsigned int crc;           // CRC-32 (zip)
+    unsigned long long hash;    // FNV-1a (manifest)
+    tapoff start, end;          // Source range in the TAP
+} *cont_list;
+int cont_n=0, cont_max=0;
+FILE *cont_file=NULL;
+int cont_failed=0;              // A member is incomplete
+char cont_name[_MAX_PATH+8];
+unsigned int crc_table[256];
+
+/*------------------------------------------------------------------------*/
+/**
+ * crc32_update() - Update a CRC-32 (zip polynomial) with a buffer
+ */
+unsigned int crc32_update(unsigned int crc, const unsigned char *b, size_t n)
+{
+    unsigned int c;
+    int k;
+
+    if(!crc_table[1])
+    {
+        for(c=0;c<256;c++)
+        {
+            crc_table[c]=c;
+            for(k=0;k<8;k++)
+            {
+                crc_table[c]=(crc_table[c]&1) ? 0xedb88320^(crc_table[c]>>1) : crc_table[c]>>1;
+            }
+        }
+    }
+    crc=~crc;
+    while(n--)
+    {
+        crc=crc_table[(crc^*b++)&0xff]^(crc>>8);
+    }
+    return ~crc;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * put_le16() - Write a 16-bit little-endian value
+ */
+void put_le16(unsigned int v, FILE *file_out)
+{
+    putc(v&0xff, file_out);
+    putc((v>>8)&0xff, file_out);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * container_open() - Create the container of a tape
+ *
+ * Returns: 0 on success
+ */
+int container_open(const char *tapname)
+{
+    out_base(cont_name, outdir, tapname);
+    strcat(cont_name, (container==CONT_ZIP) ? ".zip" : ".tar");
+    if( (cont_file=fopen(cont_name,"w+b"))==NULL )
+    {
+        printf("\nError: Cannot create container: %s\n", cont_name);
+        return 1;
+    }
+    cont_n=0;
+    cont_failed=0;
+    printf("\nWriting to container: %s\n", cont_name);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * container_begin() - Start a new member
+ * @path: Member filename (the directory part is dropped)
+ * @size: Data size
+ * @start: Source start in the TAP (manifest)
+ * @end: Source end in the TAP (manifest)
+ *
+ * Returns: 0 on success
+ */
+int container_begin(const char *path, tapoff size, tapoff start, tapoff end)
+{
+    struct cont_member *m;
+    unsigned char hdr[512];
+    const char *name=path;
+    unsigned int sum;
+    int i;
+
+    for(i=0;path[i];i++)
+    {
+        if( (path[i]=='/') || (path[i]=='\\') )
+        {
+            name=path+i+1;
+        }
+    }
+    if( (container==CONT_ZIP) && ((cont_n>=0xffff) ||
+        ((tapoff)ftell64(cont_file)+size > TAP_MAXSIZE)) )
+    {
+        printf("Error: zip container is full (4 GB/65535 files), use --container tar\n");
+        return 1;
+    }
+    if(cont_n==cont_max)
+    {
+        cont_max=cont_max ? cont_max*2 : 64;
+        cont_list=realloc(cont_list, cont_max*sizeof(*cont_list));
+        if(!cont_list)
+        {
+            printf("\nError: Cannot allocate memory\n");
+            itap_exit(1);
+        }
+    }
+    m=&cont_list[cont_n++];
+    m->name=strdup(name);
+    m->offset=ftell64(cont_file);
+    m->size=size;
+    m->crc=0;
+    m->hash=FNV_INIT;
+    m->start=start;
+    m->end=end;
+
+    if(container==CONT_ZIP)
+    {
+        // Local header, CRC patched by container_end()
+        put_le32(0x04034b50, cont_file);
+        put_le16(10, cont_file);            // Version needed
+        put_le16(0, cont_file);             // Flags
+        put_le16(0, cont_file);             // Stored
+        put_le16(0, cont_file);             // Time
+        put_le16(0x21, cont_file);          // Date (1980-01-01)
+        put_le32(0, cont_file);             // CRC-32
+        put_le32((unsigned int)size, cont_file);
+        put_le32((unsigned int)size, cont_file);
+        put_le16(strlen(name), cont_file);
+        put_le16(0, cont_file);             // Extra field
+        fwrite(name, 1, strlen(name), cont_file);
+        return 0;
+    }
+
+    // ustar header
+    memset(hdr, 0, sizeof(hdr));
+    snprintf((char *)hdr, 100, "%s", name);
+    sprintf((char *)hdr+100, "%07o", 0644);
+    sprintf((char *)hdr+108, "%07o", 0);
+    sprintf((char *)hdr+116, "%07o", 0);
+    sprintf((char *)hdr+124, "%011llo", (unsigned long long)size);
+    sprintf((char *)hdr+136, "%011llo", (unsigned long long)time(NULL));
+    memset(hdr+148, ' ', 8);
+    hdr[156]='0';
+    memcpy(hdr+257, "ustar", 6);
+    memcpy(hdr+263, "00", 2);
+    for(sum=0,i=0;i<512;i++)
+    {
+        sum+=hdr[i];
+    }
+    sprintf((char *)hdr+148, "%06o", sum);
+    fwrite(hdr, 1, sizeof(hdr), cont_file);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * container_write() - Append data to the current member
+ */
+void container_write(const void *b, size_t n)
+{
+    struct cont_member *m=&cont_list[cont_n-1];
+
+    fwrite(b, 1, n, cont_file);
+    m->hash=fnv1a(b, n, m->hash);
+    if(container==CONT_ZIP)
+    {
+        m->crc=crc32_update(m->crc, b, n);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * container_end() - Finish the current member
+ */
+void container_end(void)
+{
+    struct cont_member *m=&cont_list[cont_n-1];
+    static const unsigned char pad[512];
+    tapoff pos;
+
+    if(container==CONT_ZIP)
+    {
+        pos=ftell64(cont_file);
+        fseek64(cont_file, m->offset+14, SEEK_SET);
+        put_le32(m->crc, cont_file);
+        fseek64(cont_file, pos, SEEK_SET);
+        return;
+    }
+    if(m->size%512)
+    {
+        fwrite(pad, 1, 512-m->size%512, cont_file);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * container_add() - Add a member from memory
+ *
+ * Returns: 0 on success
+ */
+int container_add(const char *name, const void *b, tapoff len, tapoff start, tapoff end)
+{
+    if(container_begin(name, len, start, end))
+    {
+        return 1;
+    }
+    container_write(b, (size_t)len);
+    container_end();
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * container_close() - Add the manifest and finish the container
+ * @tapname: Tape the container belongs to
+ *
+ * A container with an incomplete member is removed.
+ *
+ * Returns: 0 on success
+ */
+int container_close(const char *tapname)
+{
+    struct strbuf sb={0};
+    char name[_MAX_PATH+16];
+    static const unsigned char pad[1024];
+    tapoff cd,size;
+    int i,n;
+
+    if(!cont_file)
+    {
+        return 0;
+    }
+
+    // Manifest of the members, same format as the -r manifest
+    n=cont_n;
+    sb_printf(&sb, "# iTAP manifest: hash size mtime start end name\n");
+    for(i=0;i<n;i++)
+    {
+        sb_printf(&sb, "%016llx\t%" PRIOFF "u\t0\t%" PRIOFF "u\t%" PRIOFF "u\t%s\n",
+                  cont_list[i].hash, cont_list[i].size, cont_list[i].start,
+                  cont_list[i].end, cont_list[i].name);
+    }
+    out_base(name, "", tapname);
+    strcat(name, ".manifest");
+    container_add(name, sb.b, sb.len, 0, 0);
+    free(sb.b);
+
+    if(container==CONT_ZIP)
+    {
+        cd=ftell64(cont_file);
+        for(i=0;i<cont_n;i++)
+        {
+            put_le32(0x02014b50, cont_file);
+            put_le16(20, cont_file);            // Made by
+            put_le16(10, cont_file);            // Version needed
+            put_le16(0, cont_file);             // Flags
+            put_le16(0, cont_file);             // Stored
+            put_le16(0, cont_file);             // Time
+            put_le16(0x21, cont_file);          // Date
+            put_le32(cont_list[i].crc, cont_file);
+            put_le32((unsigned int)cont_list[i].size, cont_file);
+            put_le32((unsigned int)cont_list[i].size, cont_file);
+            put_le16(strlen(cont_list[i].name), cont_file);
+            put_le16(0, cont_file);             // Extra field
+            put_le16(0, cont_file);             // Comment
+            put_le16(0, cont_file);             // Disk
+            put_le16(0, cont_file);             // Internal attributes
+            put_le32(0, cont_file);             // External attributes
+            put_le32((unsigned int)cont_list[i].offset, cont_file);
+            fwrite(cont_list[i].name, 1, strlen(cont_list[i].name), cont_file);
+        }
+        size=ftell64(cont_file)-cd;
+        put_le32(0x06054b50, cont_file);
+        put_le16(0, cont_file);
+        put_le16(0, cont_file);
+        put_le16(cont_n, cont_file);
+        put_le16(cont_n, cont_file);
+        put_le32((unsigned int)size, cont_file);
+        put_le32((unsigned int)cd, cont_file);
+        put_le16(0, cont_file);
+    }
+    else
+    {
+        fwrite(pad, 1, sizeof(pad), cont_file);
+    }
+    if( fclose(cont_file) || cont_failed )
+    {
+        printf("\nError: Cannot write container: %s\n", cont_name);
+        remove(cont_name);
+        cont_failed=1;
+    }
+    else
+    {
+        printf("\n%d files written to %s\n", cont_n, cont_name);
+    }
+    cont_file=NULL;
+
+    for(i=0;i<cont_n;i++)
+    {
+        free(cont_list[i].name);
+    }
+    cont_n=0;
+    return cont_failed;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * tail_length() - Length of a block after fixendtape(), from its tail only
+ * @file_inp: Input TAP
+ * @start: Block start
+ * @len: Block length
+ *
+ * fixendtape() only looks at the last 0x4000 pulses, so a block can be
+ * streamed without loading it.
+ *
+ * Returns: Fixed block length
+ */
+tapoff tail_length(FILE *file_inp, tapoff start, tapoff len)
+{
+    unsigned char tail[0x4004];
+    tapoff n=(len<sizeof(tail)) ? len : sizeof(tail),fixed=n;
+
+    fseek64(file_inp, start+len-n, SEEK_SET);
+    if(fread(tail, 1, (size_t)n, file_inp)!=n)
+    {
+        return len;
+    }
+    fixendtape(tail, &fixed);
+    return len-(n-fixed);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * copy_range() - Append a range of a file to an output file
+ * @file_inp: Source
+ * @start: Position of the range
+ * @len: Length of the range
+ * @file_out: Output, written at its end
+ *
+ * On Linux the data goes from file to file in the kernel (sendfile);
+ * elsewhere, or if sendfile can't be used, through a buffer.
+ *
+ * Returns: 0 on success, 1 on a read or write error
+ */
+int copy_range(FILE *file_inp, tapoff start, tapoff len, FILE *file_out)
+{
+    unsigned char *b;
+    tapoff n;
+#ifdef __linux__
+    off_t off=(off_t)start;
+    ssize_t done;
+
+    fflush(file_out);
+    while(len>0)
+    {
+        done=sendfile(fileno(file_out), fileno(file_inp), &off,
+                      (len>0x40000000) ? 0x40000000 : (size_t)len);
+        if(done<=0)
+        {
+            break;
+        }
+        len-=done;
+    }
+    fseek64(file_out, 0, SEEK_END);
+    if(!len)
+    {
+        return 0;
+    }
+    start=(tapoff)off;
+#endif
+
+    if( (b=malloc(COPY_CHUNK))==NULL )
+    {
+        return 1;
+    }
+    for(;len>0;start+=n,len-=n)
+    {
+        n=read_at(file_inp, start, b, (len<COPY_CHUNK) ? len : COPY_CHUNK);
+        if( !n || (fwrite(b, 1, (size_t)n, file_out)!=n) )
+        {
+            break;
+        }
+    }
+    free(b);
+    return len>0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * stream_member() - Copy a block from the input TAP into the container
+ * @name: Output filename
+ * @header: TAP header of the output
+ * @start: Block start
+ * @len: Block length
+ */
+void stream_member(const char *name, unsigned char *header, tapoff start, tapoff len)
+{
+    unsigned char buf[COPY_CHUNK];
+    tapoff done,n;
+
+    if(container_begin(name, len+20, start, start+len))
+    {
+        return;
+    }
+    container_write(header, 20);
+    for(done=0;done<len;done+=n)
+    {
+        n=(len-done<COPY_CHUNK) ? len-done : COPY_CHUNK;
+        if(read_at(tap_inp, start+done, buf, n)!=n)
+        {
+            printf("Error: Cannot read the block of %s\n", name);
+            cont_failed=1;
+            break;
+        }
+        container_write(buf, (size_t)n);
+    }
+    container_end();
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * save() - Save a program block to a new TAP file
+ * @start: Start position in original TAP file
+ * @end: End position in original TAP file
+ * @chr1: Block number (0-based)
+ * @nameread: Original TAP filename (output names are built from it)
+ * 
+ * **THIS FUNCTION GENERATES THE NEW HEADER FOR EACH SPLIT TAP FILE**
+ * 
+ * Creates a new TAP file containing:
+ * 1. TAP signature (12 bytes): "C64-TAPE-RAW"
+ * 2. TAP version (1 byte): Version from original file
+ * 3. Reserved bytes (3 bytes): 0x00, 0x00, 0x00
+ * 4. Data size (4 bytes): Little-endian size of the extracted data
+ * 5. Tape data: The actual program data from start to end
+ */
+void save( tapoff start,
+           tapoff end,
+           int chr1,
+           char *nameread)
+{
+    char msg[] = "C64-TAPE-RAW";  // TAP file signature
+    unsigned char header[20];
+    unsigned int l0,l1,l2,l3;
+    FILE *file_out;
+    char name[_MAX_PATH+32]={0};
+    char file[32];
+    unsigned char *b;
+    tapoff len ;
+    int fixed,lost,streamed,failed;
+
+    // Construct output filename (original name without extension)
+    out_base(name,outdir,nameread);
+    
+    // Add suffix based on naming mode
+    switch(addnames)
+    {
+    case 1:
+        sprintf(name+strlen(name),"_%02d_%s",chr1+1,blocknames[chr1]);
+        break;
+    case 2:
+        sprintf(file,"%02d_%s",chr1+1,blocknames[chr1]);
+        out_path(name,outdir,file);
+        break;
+    case 3:
+        sprintf(file,"%s",blocknames[chr1]);
+        out_path(name,outdir,file);
+        break;
+    default:
+        sprintf(name+strlen(name),"_%02d",chr1+1);
+        break;
+    }
+    strcat(name,".tap");
+    printf("%s\n",name);
+
+    // The TAP header can't describe more than 4 GB of data
+    if(end-start > TAP_MAXSIZE)
+    {
+        printf("Error: block %d is %" PRIOFF "u bytes, too large for the "
+               "32-bit TAP size field. Not written.\n", chr1+1, end-start);
+        return;
+    }
+
+    // Plain copies are streamed from the input, only the tail is read
+    // to trim the trailing pulses
+    len=end-start;
+    streamed=!is_archive && !calibrate && !repairmode && !quantize && !fastpilot;
+    if(streamed)
+    {
+        len=tail_length(tap_inp,start,len);
+        b=NULL;
+    }
+    else
+    {
+        // Read data from original file
+        b=malloc((size_t)len);
+        if(!b)
+        {
+            printf("Error: Cannot allocate memory for block %d. Not written.\n", chr1+1);
+            return;
+        }
+        load_block(tap_inp,start,len,b);
+        trace_base=start;
+        trace_blk=chr1+1;
+        
+        // Fix tape ending (remove trailing pulses)
+        fixendtape(b,&len);
+    }
+
+    if(calibrate)
+    {
+        calib_block(b,len);
+        calib_report();
+    }
+
+    if(repairmode)
+    {
+        fixed=repair_block(b,len,&lost);
+        printf("  %d bytes repaired",fixed);
+        if(lost)
+        {
+            printf(", %d bytes unrecoverable",lost);
+        }
+        printf("\n");
+    }
+
+    if(quantize)
+    {
+        printf("  %" PRIOFF "u pulses quantized\n",quantize_block(b,len));
+    }
+
+    if(fastpilot)
+    {
+        printf("  %" PRIOFF "u bytes of pilots and pauses trimmed\n",fast_block(b,&len));
+    }
+        
+    // **PREPARE DATA SIZE FOR HEADER**
+    // Calculate little-endian bytes for data size
+    l3=(len    )&0xff;  // Byte 0 (LSB)
+    l2=(len>> 8)&0xff;  // Byte 1
+    l1=(len>>16)&0xff;  // Byte 2
+    l0=(len>>24)&0xff;  // Byte 3 (MSB)
+        
+    // **NEW TAP HEADER**
+    memcpy(header,msg,sizeof(msg)-1);  // Bytes 0-11: "C64-TAPE-RAW"
+    header[12]=tap_version;            // Byte 12: TAP version (0, 1, or 2)
+    header[13]=0;                      // Byte 13: Reserved
+    header[14]=0;                      // Byte 14: Reserved
+    header[15]=0;                      // Byte 15: Reserved
+    header[16]=l3;                     // Byte 16: Data size LSB
+    header[17]=l2;                     // Byte 17: Data size byte 1
+    header[18]=l1;                     // Byte 18: Data size byte 2
+    header[19]=l0;                     // Byte 19: Data size MSB
+
+    // Container member instead of a file
+    if( streamed && cont_file )
+    {
+        stream_member(name,header,start,len);
+        return;
+    }
+    if(cont_file)
+    {
+        if(!container_begin(name,len+20,start,start+len))
+        {
+            container_write(header,sizeof(header));
+            container_write(b,(size_t)len);
+            container_end();
+        }
+        free(b);
+        return;
+    }
+
+    // Incremental split: leave identical outputs alone
+    if( incremental && same_output(name,header,b,start,len) )
+    {
+        printf("  unchanged\n");
+        inc_same++;
+        manifest_record(name,header,b,len,start,end);
+        free(b);
+        return;
+    }
+
+    // Create output file
+    file_out=fopen(name,"wb");
+    if(!file_out)
+    {
+        printf("Error: Cannot create %s\n",name);
+        free(b);
+        return;
+    }
+    
+    // **WRITE TAP HEADER AND DATA**
+    fwrite(header,sizeof(header),1,file_out);
+    if(streamed)
+    {
+        failed=copy_range(tap_inp,start,len,file_out);
+    }
+    else
+    {
+        failed=(fwrite(b,(size_t)len,1,file_out)!=1) && len;
+    }
+    if( fclose(file_out) || failed )
+    {
+        printf("Error: Cannot write %s\n",name);
+        remove(name);
+        free(b);
+        return;
+    }
+    if(incremental)
+    {
+        inc_written++;
+        manifest_record(name,header,b,len,start,end);
+    }
+    free(b);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * create_cleaned_tap() - Create cleaned TAP file with validated programs
+ * @tapname: Original TAP filename
+ * @nblocks: Number of valid blocks/programs
+ * @array_blocks: Array of block start positions
+ * @file_inp: Input file pointer (original TAP)
+ * 
+ * Creates filename_cleaned.tap with:
+ * - 20-byte TAP header (corrected size)
+ * - All cleaned program data sequentially
+ */
+void create_cleaned_tap(char *tapname, 
+                       int nblocks, 
+                       tapoff *array_blocks,
+                       FILE *file_inp)
+{
+    FILE *cleaned_file;
+    char cleaned_filename[_MAX_PATH+16];
+    int i;
+    unsigned char *block_data;
+    tapoff block_len;
+    tapoff total_len = 0;
+    tapoff changed = 0;
+    tapoff trimmed = 0;
+    int fixed = 0, lost = 0;
+    int streamed = !is_archive && !calibrate && !repairmode && !quantize && !fastpilot;
+    unsigned int l0, l1, l2, l3;
+    char msg[] = "C64-TAPE-RAW";
+    
+    // ============================================================
+    // STEP A: Build file name
+    // ============================================================
+    out_base(cleaned_filename, outdir, tapname);
+    
+    // Añadir "_cleaned.tap"
+    strcat(cleaned_filename, "_cleaned.tap");
+    
+    printf("\nCreating cleaned TAP file: %s\n", cleaned_filename);
+    
+    // ============================================================
+    // Step B: Create clan tap file
+    // ============================================================
+    cleaned_file = fopen(cleaned_filename, "wb");
+    if(!cleaned_file)
+    {
+        printf("\nError: Cannot create cleaned file: %s\n", cleaned_filename);
+        return;
+    }
+    
+    // ============================================================
+    // Step C: Write heaader (20 bytes)
+    // ============================================================
+    
+    // Write sign TAP (12 bytes): "C64-TAPE-RAW"
+    fwrite(msg, 1, sizeof(msg)-1, cleaned_file);
+    
+    // Write TAP version (1 byte)
+    putc(tap_version, cleaned_file);
+    
+    // Write reserved bytes (3 bytes): 0x00, 0x00, 0x00
+    putc(0, cleaned_file);
+    putc(0, cleaned_file);
+    putc(0, cleaned_file);
+    
+    // Data size (4 bytes), patched once the blocks are written: quantizing
+    // and fast pilots change how much each block keeps
+    for(i = 0; i < 4; i++)
+    {
+        putc(0, cleaned_file);
+    }
+    
+    // ============================================================
+    // Step D: Write cleaned data
+    // ============================================================
+    for(i = 0; i < nblocks; i++)
+    {
+        block_len = array_blocks[i+1] - array_blocks[i];
+
+        // Streamed straight from the original TAP
+        if(streamed)
+        {
+            block_len = tail_length(file_inp, array_blocks[i], block_len);
+            if(copy_range(file_inp, array_blocks[i], block_len, cleaned_file))
+            {
+                break;
+            }
+            total_len += block_len;
+            printf("  Block %02d (%s): %" PRIOFF "u bytes\n", i+1, blocknames[i], block_len);
+            continue;
+        }
+        
+        // Buffered
+        block_data = malloc((size_t)block_len);
+        if(!block_data)
+        {
+            printf("\nError: Cannot allocate memory for block %d\n", i+1);
+            break;
+        }
+        
+        // Write block data (original TAP)
+        load_block(file_inp, array_blocks[i], block_len, block_data);
+        
+        // Clean end block
+        fixendtape(block_data, &block_len);
+
+        if(calibrate)
+        {
+            calib_block(block_data, block_len);
+        }
+
+        if(repairmode)
+        {
+            fixed = repair_block(block_data, block_len, &lost);
+        }
+
+        if(quantize)
+        {
+            changed = quantize_block(block_data, block_len);
+        }
+
+        if(fastpilot)
+        {
+            trimmed = fast_block(block_data, &block_len);
+        }
+        
+        // Write cleaned block
+        if( (fwrite(block_data, (size_t)block_len, 1, cleaned_file)!=1) && block_len )
+        {
+            free(block_data);
+            break;
+        }
+        total_len += block_len;
+        
+        // Show progress
+        printf("  Block %02d (%s): %" PRIOFF "u bytes", 
+               i+1, blocknames[i], block_len);
+        if(calibrate)
+        {
+            printf(", pulses %+.1f%%", (cal_pilot-1)*100);
+        }
+        if(repairmode)
+        {
+            printf(", %d bytes repaired", fixed);
+            if(lost)
+            {
+                printf(", %d bytes unrecoverable", lost);
+            }
+        }
+        if(quantize)
+        {
+            printf(", %" PRIOFF "u pulses quantized", changed);
+        }
+        if(fastpilot)
+        {
+            printf(", %" PRIOFF "u bytes trimmed", trimmed);
+        }
+        printf("\n");
+        
+        free(block_data);
+    }
+    
+    // Statistics
+    printf("\n");
+    printf("  Original size: %" PRIOFF "u bytes\n", array_blocks[nblocks] - 20);
+    printf("  Cleaned size:  %" PRIOFF "u bytes\n", total_len);
+    printf("  Reduction:     %" PRIOFF "u bytes (%.1f%%)\n", 
+           (array_blocks[nblocks] - 20) - total_len,
+           100.0 * ((array_blocks[nblocks] - 20) - total_len) / (array_blocks[nblocks] - 20));
+
+    // The TAP header can't describe more than 4 GB of data
+    if(total_len > TAP_MAXSIZE)
+    {
+        printf("\nError: cleaned data is %" PRIOFF "u bytes, too large for the "
+               "32-bit TAP size field. Not written.\n", total_len);
+        fclose(cleaned_file);
+        remove(cleaned_filename);
+        return;
+    }
+    
+    // ============================================================
+    // Step E: Patch data size (4 bytes, little-endian)
+    // ============================================================
+    if( (i == nblocks) && !fseek(cleaned_file, 16, SEEK_SET) )
+    {
+        l3 = (total_len      ) & 0xff;  // LSB
+        l2 = (total_len >>  8) & 0xff;
+        l1 = (total_len >> 16) & 0xff;
+        l0 = (total_len >> 24) & 0xff;  // MSB
+        
+        putc(l3, cleaned_file);  // Byte 16
+        putc(l2, cleaned_file);  // Byte 17
+        putc(l1, cleaned_file);  // Byte 18
+        putc(l0, cleaned_file);  // Byte 19
+    }
+    else
+    {
+        i = -1;
+    }
+    
+    // No half-written TAP with a header promising all the data
+    if( fclose(cleaned_file) || (i < nblocks) )
+    {
+        printf("\nError: Cannot write cleaned file: %s\n", cleaned_filename);
+        remove(cleaned_filename);
+        return;
+    }
+    
+    printf("\nCleaned TAP file created successfully: %s\n", cleaned_filename);
+    printf("  %d programs included\n", nblocks);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * create_idx_file() - Create index file with program positions and names
+ * @tapname: Original TAP filename
+ * @nblocks: Number of blocks/programs
+ * @array_blocks: Array of block start positions
+ * 
+ * Creates a .idx file with format:
+ * ; Index file generated by Split Tap
+ * 0x00000014 TESTATA         
+ * 0x0002a7c5 SPACE TRAVEL    
+ */
+void create_idx_file(char *tapname, int nblocks, tapoff *array_blocks)
+{
+    FILE *idx_file;
+    char idx_filename[_MAX_PATH+8];
+    struct strbuf sb={0};
+    int i;
+    
+    // Construct .idx filename from TAP filename
+    out_base(idx_filename, idxdir ? idxdir : outdir, tapname);
+    strcat(idx_filename, ".idx");
+    
+    // Write header comment
+    sb_printf(&sb, "; Index file generated by Split Tap\n");
+    
+    // Write each program entry: position (hex) + name
+    for(i = 0; i < nblocks; i++)
+    {
+        // Format: 0x%08X %-16s\n
+        sb_printf(&sb, "0x%08" PRIOFF "X %-16s\n", 
+                  array_blocks[i],      // Start position in hex
+                  blocknames[i]);       // Program name
+    }
+
+    if(cont_file)
+    {
+        // Index goes into the container
+        container_add(idx_filename, sb.b, sb.len, 0, 0);
+    }
+    else
+    {
+        // Open .idx file for writing
+        idx_file = fopen(idx_filename, "w");
+        if(!idx_file)
+        {
+            printf("\nError: Cannot create index file: %s\n", idx_filename);
+            free(sb.b);
+            return;
+        }
+        fwrite(sb.b, 1, sb.len, idx_file);
+        fclose(idx_file);
+    }
+    free(sb.b);
+    
+    // Print confirmation message
+    printf("\nIndex file created: %s\n", idx_filename);
+    printf("  %d programs indexed\n", nblocks);
+}
+
+
+/*------------------------------------------------------------------------*/
+/**
+ * filesize() - Get file size
+ * @stream: File pointer
+ * 
+ * Returns: File size in bytes
+ */
+tapoff filesize(FILE *stream)
+{
+   tapoff curpos, length;
+
+   curpos = ftell64(stream);
+   fseek64(stream, 0, SEEK_END);
+   length = ftell64(stream);
+   fseek64(stream, curpos, SEEK_SET);
+   return length;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * PrintBlocks() - Print block information
+ * @i: Block index
+ * @array_blocks: Array of block start positions
+ * @file_inp: Input file pointer
+ * 
+ * Displays block number, size, and program name
+ *
+ * MODIFIED VERSION: Now shows hexadecimal start/end positions
+ * 
+ * Output format:
+ * 01)    74565 [0x00000014-0x00012359] - PROGRAM NAME
+ * 
+ * Where:
+ * - 01) = Block number
+ * - 74565 = Size in bytes (decimal)
+ * - [0x00000014-0x00012359] = Start and end positions in hexadecimal
+ * - PROGRAM NAME = Name extracted from tape data
+ */
+void PrintBlocks( int i,
+                  tapoff *array_blocks,
+                  FILE *file_inp)
+{
+
+/*    printf("%02d) %8d - ",i+1,array_blocks[i+1]-array_blocks[i]);       */
+	// Print block number, size in decimal, and hex positions
+    printf("%02d) %8" PRIOFF "u bytes, 0x%08" PRIOFF "X to 0x%08" PRIOFF "X - ",
+           i+1,                               // Block number (1-based)
+           array_blocks[i+1]-array_blocks[i], // Size in bytes
+           array_blocks[i],                   // Start position (hex)
+           array_blocks[i+1]-0x01);           // End position (hex)
+
+    // Archived blocks carry their name in the index
+    if(is_archive)
+    {
+        blockinfo[i].hdr=-1;
+        printf("%-16s\n",blocknames[i]);
+        return ;
+    }
+
+    // Print the name decoded by decode_names(), or get and print it
+    trace_blk=i+1;
+    if(blockinfo[i].state!=NAME_TODO)
+    {
+        print_prg_name(blocknames[i], &blockinfo[i]);
+        return ;
+    }
+    GetPrgName( array_blocks[i],
+                array_blocks[i+1],
+                file_inp,
+                blocknames[i],
+                &blockinfo[i] );
+    return ;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * ShowBlock() - Print block information from the decoded names
+ * @i: Block index
+ * @array_blocks: Array of block start positions
+ *
+ * Same output as PrintBlocks(), without decoding the block again.
+ */
+void ShowBlock( int i,
+                tapoff *array_blocks)
+{
+    printf("%02d) %8" PRIOFF "u bytes, 0x%08" PRIOFF "X to 0x%08" PRIOFF "X - %-16s",
+           i+1,
+           array_blocks[i+1]-array_blocks[i],
+           array_blocks[i],
+           array_blocks[i+1]-0x01,
+           blocknames[i]);
+    if( verbose && (blockinfo[i].hdr>0) )
+    {
+        printf(" type %02X from $%04X to $%04X",
+               blockinfo[i].type, blockinfo[i].load, blockinfo[i].end);
+    }
+    if(blockinfo[i].sig)
+    {
+        printf(" = %s (%s)", sigs[blockinfo[i].sig].title, sigs[blockinfo[i].sig].loader);
+    }
+    printf("\n");
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * join_blocks() - Join a block with the following one
+ * @i: Index of the first block
+ * @nblocks: Number of blocks (updated)
+ *
+ * The joined block keeps the name and header of block @i.
+ */
+void join_blocks(int i, int *nblocks)
+{
+    int k;
+
+    blockinfo[i].sig=sig_better(blockinfo[i].sig, blockinfo[i+1].sig);
+    for (k=i+1;k<*nblocks;k++)
+    {
+        array_blocks[k]=array_blocks[k+1];
+        memcpy(blocknames[k],blocknames[k+1],sizeof(blocknames[0]));
+        blockinfo[k]=blockinfo[k+1];
+    }
+    (*nblocks)--;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * same_header() - Check if two blocks carry the same ROM header
+ *
+ * Returns: 1 if type, load range and name match (repeat copy), 0 otherwise
+ */
+int same_header(int a, int b)
+{
+    return ( blockinfo[a].type == blockinfo[b].type ) &&
+           ( blockinfo[a].load == blockinfo[b].load ) &&
+           ( blockinfo[a].end  == blockinfo[b].end  ) &&
+           !strcmp((char *)blocknames[a],(char *)blocknames[b]);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * group_blocks() - Group header and data blocks into complete programs
+ * @nblocks: Number of blocks (updated)
+ *
+ * With -g a block is joined to the program before it when:
+ * - it has no ROM header of its own (data or turbo block)
+ * - the program is shorter than its header load range needs (about 20
+ *   pulses per byte), so this block must be the data block
+ * - its header repeats the program header (same type, range and name)
+ * - it is a SEQ data block (type 2) following a SEQ header (type 4)
+ * - it is an end-of-tape marker (type 5)
+ * Blocks with unknown headers (archives) are never joined automatically.
+ *
+ * The -j spec overrides the automatic choice. It is a comma separated list
+ * of block numbers (as listed) or ranges: "1-3,4,5-6" makes blocks 1 to 3
+ * one program, 4 another one and 5 to 6 a third one.
+ *
+ * Returns: 0 on success, 1 on a bad -j spec
+ */
+int group_blocks(int *nblocks)
+{
+    char *join;  // Boundary before block k: 0 auto, 1 join, 2 split
+    char *p=joinspec;
+    int a,b,k,head=0,n=*nblocks;
+    tapoff need;
+
+    join=calloc(n+1,1);
+    if(!join)
+    {
+        printf("\nError: Cannot allocate memory for grouping\n");
+        return 1;
+    }
+
+    // Manual overrides
+    while(p && *p)
+    {
+        a=b=(int)strtol(p,&p,10);
+        if(*p=='-')
+        {
+            b=(int)strtol(p+1,&p,10);
+        }
+        if( (a<1)||(b<a)||(b>n)||((*p!=',')&&(*p!=0)) )
+        {
+            printf("\nBad -j spec: %s\n",joinspec);
+            free(join);
+            return 1;
+        }
+        join[a-1]=2;
+        for(k=a;k<b;k++)
+        {
+            join[k]=1;
+        }
+        join[b]=2;
+        if(*p==',')
+        {
+            p++;
+        }
+    }
+
+    // Automatic grouping
+    for(k=1;k<n;k++)
+    {
+        if( !join[k] && autogroup &&
+            (blockinfo[head].hdr>=0) && (blockinfo[k].hdr>=0) )
+        {
+            need=0;
+            if( (blockinfo[head].hdr>0) &&
+                (blockinfo[head].end>blockinfo[head].load) &&
+                (blockinfo[head].type!=5) )
+            {
+                need=(tapoff)(blockinfo[head].end-blockinfo[head].load)*20;
+            }
+            if( !blockinfo[k].hdr ||
+                ( array_blocks[k]-array_blocks[head] < need ) ||
+                ( blockinfo[head].hdr && same_header(head,k) ) ||
+                ( (blockinfo[head].type==4) && (blockinfo[k].type==2) ) ||
+                ( blockinfo[k].type==5 ) )
+            {
+                join[k]=1;
+            }
+        }
+        if(join[k]!=1)
+        {
+            head=k;
+        }
+    }
+
+    // Join from the end so indexes below stay valid
+    for(k=n-1;k>0;k--)
+    {
+        if(join[k]==1)
+        {
+            join_blocks(k-1,nblocks);
+        }
+    }
+    free(join);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * WAV capture input
+ *
+ * An 8/16-bit PCM WAV is turned into a version 1 TAP while it's read, one
+ * chunk of samples at a time: the DC offset is removed and every edge of
+ * the chosen polarity (crossing the hysteresis threshold) ends a pulse.
+ * Pulse lengths come from the interpolated crossing times, in C64 (PAL)
+ * clock cycles. The TAP goes to a temporary file, or to the file given by
+ * -w, and is then scanned like any other tape.
+ */
+#define WAV_CHUNK 0x10000       // Samples per chunk
+
+struct wav_edge
+{
+    double samples;       // Samples per C64 cycle (inverse)
+    double last;          // Time of the last edge (samples)
+    tapoff base;          // Index of the first sample of the chunk
+    short prev;           // Last sample of the previous chunk
+    int high;             // Above the upper threshold last
+    int seen;             // An edge was found already
+    tapoff pulses;        // Pulses written
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * wav_pulse() - Write one pulse to the TAP
+ * @cycles: Pulse length in C64 cycles
+ * @tap: Output TAP file
+ */
+void wav_pulse(double cycles, FILE *tap)
+{
+    unsigned long c=(unsigned long)(cycles+0.5);
+
+    if( (c+4)/8 < 0x100 )
+    {
+        putc((c+4)/8 ? (int)((c+4)/8) : 1, tap);
+        return;
+    }
+    if(c>0xffffff)
+    {
+        c=0xffffff;
+    }
+    putc(0, tap);
+    putc(c&0xff, tap);
+    putc((c>>8)&0xff, tap);
+    putc((c>>16)&0xff, tap);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * wav_edges() - Find the edges of a chunk of samples
+ * @e: Edge detector state
+ * @x: Samples (mono, signed 16-bit, DC removed)
+ * @n: Number of samples
+ * @thr: Hysteresis threshold
+ * @tap: Output TAP file
+ *
+ * Runs of 8 samples that stay on the current side are skipped with one
+ * SSE2 compare where available; the others are walked one by one.
+ */
+void wav_edges(struct wav_edge *e, const short *x, int n, int thr, FILE *tap)
+{
+    int i=0,j,end;
+    short prev=e->prev;
+    double t;
+#ifdef USE_SSE2
+    const __m128i hi_thr=_mm_set1_epi16((short)thr);
+    const __m128i lo_thr=_mm_set1_epi16((short)-thr);
+    __m128i v;
+    int mask;
+#endif
+
+    while(i<n)
+    {
+        end=n;
+#ifdef USE_SSE2
+        if(i+8<=n)
+        {
+            v=_mm_loadu_si128((const __m128i *)(x+i));
+            mask=_mm_movemask_epi8(e->high ? _mm_cmplt_epi16(v,lo_thr)
+                                           : _mm_cmpgt_epi16(v,hi_thr));
+            if(!mask)
+            {
+                prev=x[i+7];
+                i+=8;
+                continue;
+            }
+            end=i+8;
+        }
+#endif
+        for(j=i;j<end;j++)
+        {
+            if( !e->high && (x[j]>thr) )
+            {
+                e->high=1;
+                t=(double)(e->base+j)-1+(double)(thr-prev)/(x[j]-prev);
+                if(e->seen)
+                {
+                    wav_pulse((t-e->last)*e->samples, tap);
+                    e->pulses++;
+                }
+                e->seen=1;
+                e->last=t;
+            }
+            else if( e->high && (x[j]< -thr) )
+            {
+                e->high=0;
+            }
+            prev=x[j];
+        }
+        i=end;
+    }
+    e->prev=prev;
+    e->base+=n;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * wav_to_tap() - Convert a WAV capture to a TAP
+ * @wav: WAV file
+ *
+ * Returns: TAP file, positioned after the signature like a TAP just
+ * validated, or NULL if the WAV isn't supported
+ */
+FILE *wav_to_tap(FILE *wav)
+{
+    unsigned char *raw;
+    unsigned char fmt[16];
+    char name[_MAX_PATH+8];
+    short *x;
+    unsigned int id,size,rate=0,channels=0,bits=0,format=0;
+    unsigned int frame,n,i,k;
+    tapoff data=0,done,total;
+    struct wav_edge e;
+    long long sum;
+    int dc=0,thr,v;
+    FILE *tap;
+
+    // Find the format and data chunks
+    fseek(wav, 12, SEEK_SET);
+    for(;;)
+    {
+        id=get_le32(wav);
+        size=get_le32(wav);
+        if(feof(wav))
+        {
+            printf("\n\nWAV has no data chunk!\n\n");
+            return NULL;
+        }
+        if(id==0x20746d66)          // "fmt "
+        {
+            // Too short for PCM, or cut off: not supported
+            if( (size<16) || (fread(fmt, 1, 16, wav)!=16) )
+            {
+                format=0;
+                break;
+            }
+            format  =fmt[0]|(fmt[1]<<8);
+            channels=fmt[2]|(fmt[3]<<8);
+            rate    =fmt[4]|(fmt[5]<<8)|(fmt[6]<<16)|((unsigned int)fmt[7]<<24);
+            bits    =fmt[14]|(fmt[15]<<8);  // After byte rate and block align
+            fseek64(wav, (tapoff)size-16+(size&1), SEEK_CUR);
+        }
+        else if(id==0x61746164)     // "data"
+        {
+            data=size;
+            break;
+        }
+        else
+        {
+            fseek64(wav, (tapoff)size+(size&1), SEEK_CUR);
+        }
+    }
+    if( ((format!=1)&&(format!=0xfffe)) || !channels || ((bits!=8)&&(bits!=16)) )
+    {
+        printf("\n\nOnly 8/16-bit PCM WAV is supported!\n\n");
+        return NULL;
+    }
+    if(wav_rate)
+    {
+        rate=wav_rate;
+    }
+    if(!rate)
+    {
+        printf("\n\nWAV sample rate is 0, use --rate\n\n");
+        return NULL;
+    }
+
+    // Output TAP: -w file or temporary file
+    if(wavtap)
+    {
+        out_base(name, outdir, tapname);
+        strcat(name, ".tap");
+        if( !batchmode && (tap=fopen(name, "rb"))!=NULL )
+        {
+            fclose(tap);
+            printf("\n%s already exists, overwrite? (Y/n)", name);
+            if((getch()&0xdf)!='Y')
+            {
+                exit(1);
+            }
+            printf("\n");
+        }
+        tap=fopen(name, "w+b");
+    }
+    else
+    {
+        tap=tmpfile();
+    }
+    if(!tap)
+    {
+        printf("\nError: Cannot create the TAP of %s\n", tapname);
+        return NULL;
+    }
+    fwrite("C64-TAPE-RAW\1\0\0\0\0\0\0\0", 1, 20, tap);
+
+    frame=channels*bits/8;
+    raw=malloc(WAV_CHUNK*frame);
+    x=malloc(WAV_CHUNK*sizeof(*x));
+    if(!raw || !x)
+    {
+        printf("\nError: Cannot allocate memory\n");
+        itap_exit(1);
+    }
+    memset(&e,0,sizeof(e));
+    e.samples=C64_CLOCK/rate;
+    thr=wav_threshold*32767/100;
+
+    // Stream the samples through the edge detector
+    for(done=0;done<data;done+=n)
+    {
+        n=(data-done)/frame < WAV_CHUNK ? (unsigned int)((data-done)/frame) : WAV_CHUNK;
+        if( !n || (fread(raw,frame,n,wav)!=n) )
+        {
+            break;
+        }
+        sum=0;
+        for(i=0;i<n;i++)
+        {
+            k=i*frame;
+            v=(bits==8) ? (raw[k]-128)<<8 : (short)(raw[k]|(raw[k+1]<<8));
+            v-=dc;
+            v=(v>32767) ? 32767 : (v<-32767) ? -32767 : v;
+            x[i]=(short)(wav_invert ? -v : v);
+            sum+=v+dc;
+        }
+        dc=(int)(sum/n);
+        wav_edges(&e, x, n, thr, tap);
+    }
+    free(raw);
+    free(x);
+
+    // TAP size
+    total=ftell64(tap)-20;
+    fseek(tap, 16, SEEK_SET);
+    putc((total    )&0xff, tap);
+    putc((total>> 8)&0xff, tap);
+    putc((total>>16)&0xff, tap);
+    putc((total>>24)&0xff, tap);
+    fflush(tap);
+
+    printf("\n%s: %u Hz, %u bit, %u channel(s), %" PRIOFF "u pulses\n",
+           tapname, rate, bits, channels, e.pulses);
+    if(wavtap)
+    {
+        printf("TAP written: %s\n", name);
+    }
+    fseek(tap, 12, SEEK_SET);
+    return tap;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * scan_header() - Read the TAP version and check the header size
+ * @pfile_inp: Input file pointer, positioned after the signature (may be
+ *             reopened if the header size gets fixed)
+ *
+ * Images over 4 GB can't have a correct header size, the file size is
+ * used for them and the header is left alone. On return the file is
+ * positioned at the start of the TAP data.
+ *
+ * Returns: Length of the TAP data
+ */
+tapoff scan_header(FILE **pfile_inp)
+{
+    FILE *file_inp=*pfile_inp;
+    FILE *hin;
+    tapoff fs;
+    unsigned int l0,l1,l2,l3;
+    tapoff data_len;
+    int ok=0;
+
+    // Read TAP version (byte 12)
+    tap_version=(char)getc(file_inp);
+    select_kernels();
+    
+    // Read data size from header (bytes 16-19, little-endian)
+    fseek(file_inp, 16, SEEK_SET);
+    l3=getc(file_inp);
+    l2=getc(file_inp);
+    l1=getc(file_inp);
+    l0=getc(file_inp);
+    data_len=(l0<<24)+(l1<<16)+(l2<<8)+l3;
+    
+    // Check if file size matches header
+    fs=filesize(file_inp)-20;
+    if ( fs > TAP_MAXSIZE )
+    {
+        if(verbose)
+        {
+            printf("\nImage is %" PRIOFF "u bytes, header size field ignored\n",fs);
+        }
+        data_len=fs;
+    }
+    else if ( data_len != fs )
+    {
+        if(!(batchmode || listonly))
+        {
+            printf("\nFile internal problem\n"
+                   "Reported dimension 0x%08" PRIOFF "X instead of 0x%08" PRIOFF "X\n",
+                   data_len,
+                   fs );
+            printf("Fix it? (Y/n)");
+            ok=getch();
+            printf("\n");
+            if( (ok&0xdf)!='Y' )
+            {
+                exit(1);
+            }
+        }
+        // Fix file size in header
+        fclose(file_inp);
+        hin=fopen(tapname, "r+b");
+        if(!hin)
+        {
+            exit(1);
+        }
+
+        fseek(hin, 16, SEEK_SET);
+        putc((fs    )&0xff,hin);
+        putc((fs>> 8)&0xff,hin);
+        putc((fs>>16)&0xff,hin);
+        putc((fs>>24)&0xff,hin);
+        if(!(batchmode || listonly))
+            printf("Fixed.\n");
+        fclose(hin);
+        file_inp=fopen(tapname, "rb");
+        fseek(file_inp, 20, SEEK_SET);
+        data_len=fs;
+    }
+
+    *pfile_inp=file_inp;
+    return data_len;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * scan_tap() - Scan a TAP file for pilot tones and build block boundaries
+ * @pfile_inp: Input file pointer, positioned after the signature (may be
+ *             reopened if the header size gets fixed)
+ *
+ * Fills array_blocks with the block start positions, plus end of data.
+ *
+ * Returns: Number of blocks found
+ */
+int scan_tap(FILE **pfile_inp)
+{
+    FILE *file_inp;
+    tapoff data_len;
+    int i,pilot_tones=0,nblocks,chr2;
+
+    data_len=scan_header(pfile_inp);
+    file_inp=*pfile_inp;
+
+    // **CRITICAL SECTION: SCAN FOR PILOT TONES**
+    // This section identifies where each program starts by detecting
+    // long sequences of pilot tones (pulses with values 40-60)
+    pilot_tones=scan_pilots(file_inp);
+
+    // **BUILD BLOCK BOUNDARIES ARRAY**
+    // Convert pilot tone positions to block boundaries
+    grow_blocks(pilot_tones+1);
+    array_blocks[0]=0;
+    for (i=1;i<=pilot_tones;i++)
+    {
+        array_blocks[i]= array_pilot[i-1].start;
+    }
+    array_blocks[i]=data_len+20;  // End of file
+    nblocks=pilot_tones+1;
+
+    // Adjust first block to skip TAP header
+    array_blocks[0]+=20;
+
+    // **FILTER OUT SMALL BLOCKS**
+    // Remove blocks that are smaller than minimum size
+    for(i=0;i<nblocks;i++)
+    {
+        if (array_blocks[i+1]-array_blocks[i] < (tapoff)blockminsize)
+        {
+            // Shift array to remove small block
+            for (chr2=i+1;chr2<=nblocks;chr2++)
+            {
+                array_blocks[chr2]=array_blocks[chr2+1];
+            }
+            nblocks--;
+            pilot_tones--;
+            i--;
+        }
+    }
+    for(i=0;i<nblocks;i++)
+    {
+        trace_blk=i+1;
+        trace_put(TRACE_BLOCK, array_blocks[i], (unsigned int)(array_blocks[i+1]-array_blocks[i]));
+    }
+
+    *pfile_inp=file_inp;
+    return nblocks;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * Usage() - Print usage information
+ */
+void Usage(void)
+{
+    printf("\nUsage:\n iTAP <TAP/WAV name> [-b] [-l] [-i] [-c] [-a] [-f] [-q] [-s] [-w] [-z] [-u] [-x] [-g] [-j<spec>] [-r[x]] [-n[x]] [-d[x]] [-h[x]] [-k[x]] [--options]\n");
+    printf(" -b    batch mode, never ask any question\n");
+    printf(" -l    list mode, view file list and exit\n");
+    printf(" -i    create index file (.idx) with program positions and names\n");
+    printf(" -c    create cleaned TAP file (remove small blocks, fix little issues)\n");
+    printf(" -a    calibrate pulse windows on the pilot of each block, follow speed drift\n");
+    printf(" -f    repair ROM loader blocks from their two copies in split/cleaned files\n");
+    printf(" -q    quantize data pulses to 0x30/0x42/0x56 in split/cleaned files\n");
+    printf(" -p[x] fast load: cut pilots to x pulses (default 2000) in split/cleaned files\n");
+    printf(" -s    keep a pulse class sidecar (.cls), take blocks and names from it\n");
+    printf(" -w    write the TAP converted from a WAV capture\n");
+    printf(" -z    create compact archive (.itz) of the TAP\n");
+    printf(" -u    expand compact archive (.itz) back to TAP\n");
+    printf(" -x    split the blocks found by --catalog find\n");
+    printf(" -g    group header, data and repeat blocks into programs\n");
+    printf(" -j<spec> group blocks by hand, e.g. -j1-3,4,5-6 (overrides -g)\n");
+    printf(" -r[x] incremental split: skip identical outputs, report stale ones (-r2 removes them)\n");
+    printf(" -n[x] output filenames style. x can be from 0 to 3\n");
+    printf("    0: tapname_progressive (default when -n omitted)\n");
+    printf("    1: tapname_progressive_filename (equal to -n)\n");
+    printf("    2: progressive_filename\n");
+    printf("    3: filename\n");
+    printf(" -d[x] print debug informations. x is the verboseness, can be from 0 to 2\n");
+    printf("    0: no additional info (default when -d omitted)\n");
+    printf("    1: info on every header, sync/eof messages (equal to -d)\n");
+    printf("    2: debug messages and event trace (long pulses, bad bytes, block bounds)\n");
+    printf(" -h[x] Header minimum size (default 7000, try -h5000)\n");
+    printf(" -k[x] Block minimum size (default 14000, try -k18000)\n");
+    printf(" --out DIR      write split/cleaned/archive files to DIR\n");
+    printf(" --idx DIR      write index files to DIR (default: --out)\n");
+    printf(" --compare A B ...  compare captures block by block, assemble the best blocks\n");
+    printf(" --assemble OUT T[:list] ...  build OUT from blocks of tapes T (list: 2,5-3,NAME)\n");
+    printf(" --gap MS       pause before every block assembled by --assemble (default: 0)\n");
+    printf(" --rate HZ      WAV sample rate (default: from the WAV header)\n");
+    printf(" --polarity P   WAV edge polarity, pos or neg (default: pos)\n");
+    printf(" --threshold N  WAV hysteresis in %% of full scale (default: 2)\n");
+    printf(" --container F  write split files, index and manifest into one F (tar or zip)\n");
+    printf(" --catalog build DIR  catalog every block of the tapes under DIR (Linux)\n");
+    printf(" --catalog find TEXT  list catalog blocks whose name contains TEXT\n");
+    printf(" --catfile FILE catalog file (default: itap.cat)\n");
+    printf(" --threads N    threads decoding block names (default: one per CPU, 1 = none, no pipeline)\n");
+    printf(" --serve SOCK   answer list and block requests on Unix socket SOCK (Linux)\n");
+    printf(" --cache MB     memory for tapes kept by --serve (default: 256)\n");
+    printf(" --pause MS     longest pause kept by -p (default: 1000)\n");
+    printf(" --sigs FILE    identify known programs and loaders from signature FILE\n");
+    printf(" --reference R  flag blocks that disagree with TAPClean report R (tcreport.txt)\n");
+    printf(" --ndjson FILE  append one JSON result line per tape to FILE\n");
+    printf(" --watch DIR    process every tape completed in DIR (Linux)\n");
+    printf(" --workers N    worker processes for --watch (default: one per CPU)\n");
+    printf(" --journal FILE processed tapes journal (default: DIR/.itap-journal)\n");
+    printf(" --trace FILE   append the event trace to FILE on errors and crashes (every tape with -d2)\n");
+    printf(" --trace-dump FILE  print the event trace saved in FILE\n");
+    printf(" --trace-json FILE  convert the event trace in FILE to a .json file (chrome://tracing)\n");
+    printf("\n");
+
+    exit(1);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * open_tape() - Open the tape named in tapname and find its blocks
+ *
+ * Accepts a TAP, a compact archive or a WAV capture (converted first).
+ * The open input is left in tap_inp.
+ *
+ * Returns: Number of blocks
+ */
+int open_tape(void)
+{
+    FILE *file_inp;
+    char msg1[] = "C64-TAPE-RAW";
+    char  msg[] = "            ";
+    int val,nblocks=0,wav=0;
+
+    // Open TAP file
+    if ( ((file_inp=fopen(tapname,"rb"))==NULL) )
+    {
+        printf("\nOpen error or File not found: %s.\n",tapname);
+        itap_exit(1);
+    }
+    tap_inp=file_inp;
+    
+    // Validate TAP signature (or compact archive signature)
+    fseek(file_inp, 0, SEEK_SET);
+    fread(msg,1,sizeof(msg)-1,file_inp);
+    is_archive=!memcmp(msg,arc_magic,sizeof(arc_magic)-1);
+
+    // WAV capture: scan the TAP converted from it
+    if(!memcmp(msg,"RIFF",4))
+    {
+        if( (file_inp=wav_to_tap(tap_inp))==NULL )
+        {
+            itap_exit(1);
+        }
+        fclose(tap_inp);
+        tap_inp=file_inp;
+        strcpy(msg,msg1);
+        wav=1;
+    }
+    val=strcmp(msg1,msg);
+    if (val && !is_archive)
+    {
+        printf("\n\nFile isn't a valid TAP!\n\n");
+        itap_exit(1);
+    }
+    
+    if(is_archive)
+    {
+        nblocks=open_archive(file_inp);
+    }
+    else
+    {
+        // Blocks from a valid sidecar, or a scan that writes one
+        if(sidecar && !wav && !(nblocks=side_load(file_inp)))
+        {
+            side_begin();
+        }
+        if(!nblocks)
+        {
+            nblocks=scan_tap(&file_inp);
+            tap_inp=file_inp;
+            if(side.out)
+            {
+                side_finish(file_inp, nblocks);
+            }
+        }
+    }
+    return nblocks;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Reference check (--reference)
+ *
+ * Compares the blocks of the tape with the C64 ROM headers of a TAPClean
+ * report (tcreport.txt, tapclean -t). Every header TAPClean could read
+ * from either copy should have its first copy in a block of the same name,
+ * no other header before it, and every block with a header should be in
+ * the report.
+ */
+#define REF_MAX 4096            // Headers kept from a report
+
+char *reffile=NULL;             // TAPClean report to check against (--reference)
+int ref_bad=0;                  // Disagreements found by the reference check
+
+// C64 ROM header of the report
+struct ref_header
+{
+    tapoff start;               // Start of the pilot
+    tapoff data;                // Start of the data
+    int ok;                     // Checkbyte of a copy passed
+    char name[20];
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * ref_same_name() - Compare a block name with a report name
+ *
+ * Only letters and digits count, since both tools rewrite the others.
+ *
+ * Returns: 1 if the names match
+ */
+int ref_same_name(const char *a, const char *b)
+{
+    if(!*b)
+    {
+        b="NO-NAME";
+    }
+    for(;;)
+    {
+        while(*a && !isalnum((unsigned char)*a))
+        {
+            a++;
+        }
+        while(*b && !isalnum((unsigned char)*b))
+        {
+            b++;
+        }
+        if( toupper((unsigned char)*a)!=toupper((unsigned char)*b) )
+        {
+            return 0;
+        }
+        if(!*a)
+        {
+            return 1;
+        }
+        a++;
+        b++;
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * check_reference() - Report the blocks that disagree with a TAPClean report
+ * @report: TAPClean report filename
+ * @nblocks: Number of blocks
+ *
+ * Returns: Number of disagreements, -1 if the report can't be read
+ */
+int check_reference(const char *report, int nblocks)
+{
+    struct ref_header *ref;
+    char line[256],*s;
+    char *found;
+    FILE *f;
+    unsigned long long a,b;
+    int n=0,i,k,bad=0,hdr=0;
+
+    if( (ref=calloc(REF_MAX+1,sizeof(*ref)))==NULL ||
+        (found=calloc(nblocks+1,1))==NULL )
+    {
+        free(ref);
+        printf("\nError: Memory allocation failed\n");
+        return -1;
+    }
+    if( (f=fopen(report,"r"))==NULL )
+    {
+        printf("\nError: Cannot read %s\n", report);
+        free(ref);
+        free(found);
+        return -1;
+    }
+
+    // One entry per "Seq. no." record, kept for first copies of headers
+    while( fgets(line,sizeof(line),f) && (n<REF_MAX) )
+    {
+        line[strcspn(line,"\r\n")]=0;
+        if(!strncmp(line,"Seq. no.:",9))
+        {
+            hdr=0;
+            memset(&ref[n], 0, sizeof(ref[n]));
+        }
+        else if(!strcmp(line,"File Type: C64 ROM-TAPE HEADER"))
+        {
+            hdr=1;
+        }
+        else if( hdr && (sscanf(line,"Location: $%llx -> $%llx",&a,&b)==2) )
+        {
+            ref[n].start=a;
+            ref[n].data=b;
+        }
+        else if( hdr && !strncmp(line,"Checkbyte ",10) )
+        {
+            ref[n].ok=(strstr(line,"PASS")!=NULL);
+        }
+        else if( hdr && !strncmp(line,"File Name: ",11) )
+        {
+            snprintf(ref[n].name, sizeof(ref[n].name), "%.16s", line+11);
+            for(s=ref[n].name+strlen(ref[n].name);(s>ref[n].name) && (s[-1]==' ');)
+            {
+                *--s=0;
+            }
+        }
+        else if( hdr && strstr(line,"File ID : FIRST") )
+        {
+            n++;
+            hdr=0;
+        }
+        else if( hdr && strstr(line,"File ID : REPEAT") && n &&
+                 !strcmp(ref[n].name,ref[n-1].name) )
+        {
+            ref[n-1].ok|=ref[n].ok;
+            hdr=0;
+        }
+    }
+    fclose(f);
+
+    // Headers failed in both copies are mostly noise TAPClean picked up
+    for(i=k=0;k<n;k++)
+    {
+        if(ref[k].ok)
+        {
+            ref[i++]=ref[k];
+        }
+    }
+    n=i;
+
+    printf("\nReference %s: %d headers\n", report, n);
+    for(k=0;k<n;k++)
+    {
+        for(i=0;(i<nblocks) && (array_blocks[i+1]<=ref[k].data);i++)
+        {
+        }
+        if( (i==nblocks) || found[i] )
+        {
+            printf("!!! No block of its own for header %-16s at 0x%08" PRIOFF "X\n",
+                   ref[k].name, ref[k].start);
+            bad++;
+            continue;
+        }
+        found[i]=1;
+        if(!ref_same_name((char *)blocknames[i],ref[k].name))
+        {
+            printf("!!! Block %02d named %-16s, header %-16s\n",
+                   i+1, blocknames[i], ref[k].name);
+            bad++;
+        }
+    }
+    for(i=0;i<nblocks;i++)
+    {
+        if( (blockinfo[i].hdr>0) && !found[i] )
+        {
+            printf("!!! Block %02d header %-16s not in the reference\n",
+                   i+1, blocknames[i]);
+            bad++;
+        }
+    }
+    printf("%d disagreements\n", bad);
+    free(ref);
+    free(found);
+    return bad;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Pipelined split
+ *
+ * Plain listings and batch splits don't need the whole block table before
+ * the first block can be printed and written. pipe_split() runs them as
+ * four stages connected by bounded queues:
+ *
+ *   reader    reads the TAP data in SCAN_CHUNK pieces
+ *   scanner   finds the pilot tones and drops small blocks as scan_tap()
+ *             does, sending each block on as soon as its end is known
+ *   decoders  decode the name (and --sigs title) of the blocks, --threads
+ *             of them
+ *   writer    the main thread: prints and saves the blocks in order, as
+ *             soon as each one is decoded
+ *
+ * Only the writer touches the block tables; the other stages read the
+ * input through read_at(). Options that need every block first (-g, -j,
+ * -i, -c, -z, -u, -s, -a, -d2, --reference, interactive joining) keep the
+ * phased path, and so does --threads 1.
+ */
+#ifndef _WIN32
+
+#define PIPE_CHUNKS 8           // Pieces of TAP data in flight
+#define PIPE_BLOCKS 64          // Blocks in flight
+
+// Bounded queue of pointers between two stages
+struct bqueue
+{
+    void **slot;
+    int size,head,count;
+    int closed;             // No more pushes, pops drain what is left
+    pthread_mutex_t lock;
+    pthread_cond_t more,room;
+};
+
+// Piece of TAP data, from the reader to the scanner
+struct pipe_chunk
+{
+    unsigned char *b;
+    size_t n;
+};
+
+// Block on its way to the writer
+struct pipe_block
+{
+    tapoff start,end;
+    unsigned char name[20];
+    struct block_info info;
+    int num;                // Block number (1-based)
+    int done;               // Decoded, protected by pipe.lock
+};
+
+struct pipe
+{
+    FILE *file;             // Input, only read with read_at()
+    tapoff data_end;        // End of the TAP data
+    tapoff last;            // Start of the block being scanned
+    struct bqueue free;     // Empty chunks
+    struct bqueue full;     // Chunks to scan
+    struct bqueue work;     // Blocks to decode
+    struct bqueue blocks;   // Blocks to write, in order
+    pthread_mutex_t lock;   // Protects pipe_block.done
+    pthread_cond_t decoded;
+    int emitted;            // Blocks found so far
+    int stop;               // Set by the scanner when the writer is gone
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * bq_init() - Set up an empty queue
+ * @q: Queue
+ * @size: Capacity
+ *
+ * Returns: 0 on success, 1 if out of memory
+ */
+int bq_init(struct bqueue *q, int size)
+{
+    memset(q, 0, sizeof(*q));
+    if( (q->slot=malloc(size*sizeof(*q->slot)))==NULL )
+    {
+        return 1;
+    }
+    q->size=size;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->more, NULL);
+    pthread_cond_init(&q->room, NULL);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * bq_free() - Release a queue set up by bq_init()
+ * @q: Queue
+ */
+void bq_free(struct bqueue *q)
+{
+    if(q->slot)
+    {
+        pthread_mutex_destroy(&q->lock);
+        pthread_cond_destroy(&q->more);
+        pthread_cond_destroy(&q->room);
+        free(q->slot);
+        q->slot=NULL;
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * bq_push() - Append to a queue, waiting while it is full
+ * @q: Queue
+ * @p: Entry
+ *
+ * Returns: 0 on success, 1 if the queue is closed
+ */
+int bq_push(struct bqueue *q, void *p)
+{
+    pthread_mutex_lock(&q->lock);
+    while( (q->count==q->size) && !q->closed )
+    {
+        pthread_cond_wait(&q->room, &q->lock);
+    }
+    if(q->closed)
+    {
+        pthread_mutex_unlock(&q->lock);
+        return 1;
+    }
+    q->slot[(q->head+q->count++)%q->size]=p;
+    pthread_cond_signal(&q->more);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * bq_pop() - Take the oldest entry of a queue, waiting while it is empty
+ * @q: Queue
+ *
+ * Returns: Entry, NULL once the queue is closed and empty
+ */
+void *bq_pop(struct bqueue *q)
+{
+    void *p=NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while( (q->count==0) && !q->closed )
+    {
+        pthread_cond_wait(&q->more, &q->lock);
+    }
+    if(q->count)
+    {
+        p=q->slot[q->head];
+        q->head=(q->head+1)%q->size;
+        q->count--;
+        pthread_cond_signal(&q->room);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return p;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * bq_close() - Close a queue and wake everybody waiting on it
+ * @q: Queue
+ */
+void bq_close(struct bqueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed=1;
+    pthread_cond_broadcast(&q->more);
+    pthread_cond_broadcast(&q->room);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pipe_decoded() - Mark a block decoded and wake the writer
+ * @pp: Pipeline
+ * @blk: Block
+ */
+void pipe_decoded(struct pipe *pp, struct pipe_block *blk)
+{
+    pthread_mutex_lock(&pp->lock);
+    blk->done=1;
+    pthread_cond_broadcast(&pp->decoded);
+    pthread_mutex_unlock(&pp->lock);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pipe_emit() - Send a block to the writer and the decoders
+ * @pp: Pipeline
+ * @start: Start position in file
+ * @end: End position in file
+ */
+void pipe_emit(struct pipe *pp, tapoff start, tapoff end)
+{
+    struct pipe_block *blk;
+
+    if( pp->stop || (blk=calloc(1,sizeof(*blk)))==NULL )
+    {
+        pp->stop=1;
+        return;
+    }
+    blk->start=start;
+    blk->end=end;
+    blk->num=++pp->emitted;
+    trace_blk=blk->num;
+    trace_put(TRACE_BLOCK, start, (unsigned int)(end-start));
+    if(bq_push(&pp->blocks, blk))
+    {
+        free(blk);
+        pp->stop=1;
+        return;
+    }
+    // Left undecoded, PrintBlocks() decodes it
+    if(bq_push(&pp->work, blk))
+    {
+        pipe_decoded(pp, blk);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pipe_found() - Cut a block at a pilot tone (scan_piece callback)
+ * @ctx: Pipeline
+ * @start: First pulse of the pilot tone
+ * @end: Last pulse of the pilot tone
+ *
+ * A block shorter than blockminsize is merged with the next one, as in
+ * scan_tap().
+ */
+void pipe_found(void *ctx, tapoff start, tapoff end)
+{
+    struct pipe *pp=ctx;
+
+    (void)end;  // Blocks run from one pilot start to the next
+    if(start-pp->last >= (tapoff)blockminsize)
+    {
+        pipe_emit(pp, pp->last, start);
+        pp->last=start;
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pipe_reader() - Read the TAP data into chunks (thread)
+ * @arg: Pipeline
+ */
+void *pipe_reader(void *arg)
+{
+    struct pipe *pp=arg;
+    struct pipe_chunk *c;
+    tapoff pos=20;
+
+    while( (c=bq_pop(&pp->free))!=NULL )
+    {
+        c->n=(size_t)read_at(pp->file, pos, c->b, SCAN_CHUNK);
+        pos+=c->n;
+        if( !c->n || bq_push(&pp->full, c) )
+        {
+            break;
+        }
+    }
+    bq_close(&pp->full);
+    return NULL;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pipe_scanner() - Find the blocks in the chunks (thread)
+ * @arg: Pipeline
+ *
+ * A last block shorter than blockminsize is dropped, as in scan_tap().
+ */
+void *pipe_scanner(void *arg)
+{
+    struct pipe *pp=arg;
+    struct pipe_chunk *c;
+    struct scan_state st={.pos=20};
+    struct high_state hs={.pos=20};
+
+    pp->last=20;
+    while( !pp->stop && (c=bq_pop(&pp->full))!=NULL )
+    {
+        if(tap_version)
+        {
+            scan_piece(&st, c->b, c->n, 4, pipe_found, pp);
+        }
+        else
+        {
+            scan_piece(&st, c->b, c->n, 1, pipe_found, pp);
+        }
+        scan_high(&hs, c->b, c->n, tap_version ? 4 : 1);
+        bq_push(&pp->free, c);
+    }
+    if(pp->data_end-pp->last >= (tapoff)blockminsize)
+    {
+        pipe_emit(pp, pp->last, pp->data_end);
+    }
+    bq_close(&pp->free);
+    bq_close(&pp->work);
+    bq_close(&pp->blocks);
+    return NULL;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pipe_decoder() - Decode blocks until the scanner is done (thread)
+ * @arg: Pipeline
+ *
+ * A block whose decoding fails stays undecoded and PrintBlocks() decodes
+ * it again, reporting the error.
+ */
+void *pipe_decoder(void *arg)
+{
+    struct pipe *pp=arg;
+    struct pipe_block *blk;
+    unsigned char *copy=NULL;
+
+    if(sigfile)
+    {
+        copy=malloc(SIG_COPY);
+    }
+    while( (blk=bq_pop(&pp->work))!=NULL )
+    {
+        trace_blk=blk->num;
+        if(decode_prg_name(blk->start, blk->end, pp->file, blk->name, &blk->info))
+        {
+            blk->info.state=NAME_TODO;
+        }
+        if(copy)
+        {
+            blk->info.sig=identify_block(blk->start, blk->end, pp->file, copy);
+        }
+        pipe_decoded(pp, blk);
+    }
+    free(copy);
+    return NULL;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pipe_usable() - Check if the current options allow a pipelined split
+ *
+ * Returns: 1 if pipe_split() can process the tape
+ */
+int pipe_usable(void)
+{
+    return (batchmode || listonly) && !autogroup && !joinspec && !createidx &&
+           !cleanmode && !packmode && !unpackmode && !sidecar && !calibrate &&
+           (verbose<2) && !reffile && (threads!=1);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pipe_split() - List or split a plain TAP as its blocks are found
+ *
+ * Prints the same list as split_tap(). Block 1 is only written once a
+ * second block shows up, so a tape with nothing to split writes nothing.
+ *
+ * Returns: 0 on success, -1 if the tape needs the phased path
+ */
+int pipe_split(void)
+{
+    struct pipe pp;
+    struct pipe_chunk chunk[PIPE_CHUNKS];
+    struct pipe_block *blk;
+    pthread_t *tid;
+    FILE *file_inp;
+    char msg[13]={0};
+    int i,k,n=threads,nblocks=0,ok,started;
+
+    if( ((file_inp=fopen(tapname,"rb"))==NULL) )
+    {
+        return -1;
+    }
+    if( (fread(msg,1,12,file_inp)!=12) || strcmp(msg,"C64-TAPE-RAW") )
+    {
+        fclose(file_inp);  // Archives, WAV captures and errors
+        return -1;
+    }
+    pp.data_end=scan_header(&file_inp)+20;
+    tap_inp=file_inp;
+
+    if(n<1)
+    {
+        n=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    n=(n<1) ? 1 : n;
+    memset(chunk, 0, sizeof(chunk));
+    pp.file=file_inp;
+    pp.emitted=0;
+    pp.stop=0;
+    ok=!bq_init(&pp.free, PIPE_CHUNKS) & !bq_init(&pp.full, PIPE_CHUNKS) &
+       !bq_init(&pp.work, PIPE_BLOCKS) & !bq_init(&pp.blocks, PIPE_BLOCKS) &&
+       (tid=malloc((n+2)*sizeof(*tid)))!=NULL;
+    for(i=0;ok && (i<PIPE_CHUNKS);i++)
+    {
+        ok=( (chunk[i].b=malloc(SCAN_CHUNK))!=NULL ) && !bq_push(&pp.free, &chunk[i]);
+    }
+    if(!ok)
+    {
+        printf("\nError: Cannot allocate memory\n");
+        itap_exit(1);
+    }
+    pthread_mutex_init(&pp.lock, NULL);
+    pthread_cond_init(&pp.decoded, NULL);
+
+    // Decoders first, then the stages feeding them
+    for(k=0;k<n;k++)
+    {
+        if(pthread_create(&tid[k], NULL, pipe_decoder, &pp))
+        {
+            break;
+        }
+    }
+    started=0;
+    if( (k>0) && !pthread_create(&tid[k], NULL, pipe_scanner, &pp) )
+    {
+        k++;
+        if(!pthread_create(&tid[k], NULL, pipe_reader, &pp))
+        {
+            k++;
+            started=1;
+        }
+    }
+    if(started)
+    {
+        printf(listonly ? "\n%s:\n" : "\nBlocks list:\n", tapname);
+        if( container && !listonly && container_open(tapname) )
+        {
+            ok=0;
+        }
+        else if( incremental && !listonly )
+        {
+            manifest_load(tapname);
+        }
+    }
+    if(!started || !ok)
+    {
+        // Stops every stage, the writer only frees what is left
+        ok=0;
+        bq_close(&pp.free);
+        bq_close(&pp.full);
+        bq_close(&pp.work);
+        bq_close(&pp.blocks);
+    }
+
+    // Writer: print and save every block once it is decoded
+    while( (blk=bq_pop(&pp.blocks))!=NULL )
+    {
+        if(!ok)
+        {
+            free(blk);
+            continue;
+        }
+        pthread_mutex_lock(&pp.lock);
+        while(!blk->done)
+        {
+            pthread_cond_wait(&pp.decoded, &pp.lock);
+        }
+        pthread_mutex_unlock(&pp.lock);
+        grow_blocks(nblocks+1);
+        array_blocks[nblocks]=blk->start;
+        array_blocks[nblocks+1]=blk->end;
+        memcpy(blocknames[nblocks], blk->name, sizeof(blk->name));
+        blockinfo[nblocks]=blk->info;
+        free(blk);
+        PrintBlocks(nblocks, array_blocks, file_inp);
+        tap_nblocks=++nblocks;
+        if( !listonly && (nblocks>1) )
+        {
+            if(nblocks==2)
+            {
+                save(array_blocks[0], array_blocks[1], 0, tapname);
+            }
+            save(array_blocks[nblocks-1], array_blocks[nblocks], nblocks-1, tapname);
+        }
+    }
+
+    while(k--)
+    {
+        pthread_join(tid[k], NULL);
+    }
+    pthread_mutex_destroy(&pp.lock);
+    pthread_cond_destroy(&pp.decoded);
+    bq_free(&pp.free);
+    bq_free(&pp.full);
+    bq_free(&pp.work);
+    bq_free(&pp.blocks);
+    for(i=0;i<PIPE_CHUNKS;i++)
+    {
+        free(chunk[i].b);
+    }
+    free(tid);
+
+    if(!started)
+    {
+        fclose(file_inp);  // Phased path
+        tap_inp=NULL;
+        return -1;
+    }
+    if(!ok)
+    {
+        itap_exit(1);
+    }
+    if(listonly)
+    {
+        return 0;
+    }
+    if (nblocks<2)
+    {
+        printf("\nThere are no block to split.\n");
+        itap_exit(1);
+    }
+    if(incremental)
+    {
+        manifest_finish(tapname);
+    }
+    printf("\n%d blocks created with progressive names, TAP Version : %d\n",
+           nblocks, tap_version);
+    printf("\nOperation successfully completed.\n");
+    return 0;
+}
+
+#else
+
+int pipe_usable(void)
+{
+    return 0;
+}
+
+int pipe_split(void)
+{
+    return -1;
+}
+
+#endif
+
+/*------------------------------------------------------------------------*/
+/**
+ * split_tap() - List, index, clean or split one tape
+ *
+ * **PROGRAM FLOW:**
+ * 1. Open and validate TAP file
+ * 2. **SCAN FOR PILOT TONES** (scan_tap)
+ * 3. **BUILD BLOCK BOUNDARIES** (scan_tap)
+ * 4. Extract program names
+ * 5. Group or allow user to merge blocks (interactive mode)
+ * 6. **SAVE EACH BLOCK** with new header
+ *
+ * Returns: 0 on success
+ */
+int split_tap(void)
+{
+    FILE *file_inp;
+    int i=0;
+    char msg_join[]="\nDo you want to join 2 neighbour blocks (y/n)?\n";
+    int pilot_tones=0;
+    int chr1;
+    int ok=0;
+    int nblocks=0;
+
+    if( pipe_usable() && !pipe_split() )
+    {
+        return 0;
+    }
+    nblocks=open_tape();
+    file_inp=tap_inp;
+    pilot_tones=nblocks-1;
+    tap_nblocks=nblocks;
+
+    // Print blocks list
+    if(!listonly)
+    {
+        printf("\nBlocks list:\n");
+    }
+    else
+    {
+        printf("\n%s:\n",tapname);
+    }
+
+    decode_names(nblocks,file_inp);
+    if( sigfile && !is_archive )
+    {
+        identify_blocks(nblocks,file_inp);
+    }
+    for (i=0;i<nblocks;i++)
+    {
+        PrintBlocks(i,array_blocks,file_inp);
+    }
+    if(reffile)
+    {
+        ref_bad|=(check_reference(reffile,nblocks)!=0);
+    }
+
+    // ============================================================
+    // Group blocks into programs if -g or -j is active
+    // ============================================================
+    if(autogroup || joinspec)
+    {
+        if(group_blocks(&nblocks))
+        {
+            itap_exit(1);
+        }
+        pilot_tones=nblocks-1;
+        tap_nblocks=nblocks;
+        printf("\nPrograms list:\n");
+        for (i=0;i<nblocks;i++)
+        {
+            ShowBlock(i,array_blocks);
+        }
+    }
+
+    // ============================================================
+    // Create index file if -i is active
+    // ============================================================
+    // ============================================================
+    // Single container for the index and split files
+    // ============================================================
+    if( container && (createidx ||
+        !(listonly || unpackmode || packmode || cleanmode)) )
+    {
+        if(container_open(tapname))
+        {
+            itap_exit(1);
+        }
+    }
+
+    if(createidx)
+    {
+        create_idx_file(tapname, nblocks, array_blocks);
+        
+        // if list only, exit after create index file
+        if(listonly)
+        {
+            return 0;
+        }
+    }
+    // ============================================================
+
+    if(listonly)
+    {
+        return 0;
+    }
+    
+    // ============================================================
+    // Compact archive - Create (-z) or expand (-u)
+    // ============================================================
+    if(unpackmode)
+    {
+        if(!is_archive)
+        {
+            printf("\n%s isn't a compact archive.\n",tapname);
+            itap_exit(1);
+        }
+        expand_archive(tapname, file_inp, array_blocks, nblocks);
+        return 0;
+    }
+    if(packmode)
+    {
+        create_archive(tapname, nblocks, array_blocks, file_inp);
+        return 0;
+    }
+    // ============================================================
+
+	// ============================================================
+    // Clean - Create a cleaned TAP
+    // ============================================================
+    if(cleanmode)
+    {
+        create_cleaned_tap(tapname, nblocks, array_blocks, file_inp);
+        return 0;  // Exit before clean file created
+    }
+    // ============================================================
+
+    if (nblocks<2)
+    {
+        printf("\nThere are no block to split.\n");
+        itap_exit(1);
+    }
+    
+    // Interactive mode: allow user to merge blocks
+    if(!batchmode)
+    {
+        printf(msg_join);
+        ok=getch();
+        while ( (nblocks>1) && (ok&0xdf)=='Y' )
+        {
+            printf("\nWhich is the first block?");
+
+            chr1 = obtain_number(nblocks)-1;
+            if (chr1<nblocks)
+            {
+                join_blocks(chr1,&nblocks);
+                pilot_tones--;
+                tap_nblocks=nblocks;
+            }
+            printf("\nBlocks list:\n");
+            for (i=0;i<nblocks;i++)
+            {
+                ShowBlock(i,array_blocks);
+            }
+            if(nblocks<2)
+            {
+                break;
+            }
+            printf(msg_join);
+            ok=getch();
+        }
+    }
+
+    printf("\nNow  %d blocks will be created with progressive names",nblocks);
+    printf("\nAny file with the same name will be overwritten!");
+    printf("\nTAP Version : %d",tap_version);
+
+    if(!batchmode)
+    {
+        printf("\nPress Y to go on, any other key to cancel...\n");
+        if ((getch()&0xdf)!='Y')
+        {
+            itap_exit(1);
+        }
+    }
+    else
+    {
+        printf("\n");
+    }
+
+    // **SAVE EACH BLOCK TO SEPARATE TAP FILE**
+    // This calls save() for each block, which creates a new TAP file
+    // with corrected header
+    if(incremental)
+    {
+        manifest_load(tapname);
+    }
+    for (i=0;i<(pilot_tones+1);i++)
+    {
+        if(verbose>1)
+        {
+            printf("%-16s 0x%08" PRIOFF "x-0x%08" PRIOFF "x (0x%08" PRIOFF "x-0x%08" PRIOFF "x)\n",
+                   blocknames[i],
+                   array_blocks[i],
+                   array_blocks[i+1],
+                   array_pilot[i].start,
+                   array_pilot[i].end);
+        }
+        // Save block with new TAP header
+        save( array_blocks[i],
+              array_blocks[i+1],
+              i,
+              tapname);
+    }
+    if(incremental)
+    {
+        manifest_finish(tapname);
+    }
+    
+    printf("\nOperation successfully completed.\n");
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * process_reset() - Reset the per-tape state before opening a tape
+ */
+void process_reset(void)
+{
+    is_archive=0;
+    arc_nblocks=0;
+    free(arc_tap);
+    free(arc_pos);
+    arc_tap=arc_pos=NULL;
+    tap_nblocks=0;
+    side_close();
+    if(cont_file)
+    {
+        fclose(cont_file);  // Left open by a failed tape
+        cont_file=NULL;
+    }
+    memset(blocknames,0,(max_blocks+1)*sizeof(*blocknames));
+    memset(blockinfo ,0,(max_blocks+1)*sizeof(*blockinfo ));
+    trace_reset();
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * process_tap() - Process the tape named in tapname with the current options
+ *
+ * Per-tape state is reset first, so a watch worker can process any number
+ * of tapes in a row. The input file is always closed on return.
+ *
+ * Returns: 0 on success
+ */
+int process_tap(void)
+{
+    int ret;
+
+    process_reset();
+    ret=split_tap();
+    trace_flush(ret!=0);
+    if(container_close(tapname))
+    {
+        ret=1;
+    }
+    if(tap_inp)
+    {
+        fclose(tap_inp);
+        tap_inp=NULL;
+    }
+    return ret;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * result_json() - Describe the last processed tape as one NDJSON line
+ * @file: Tape filename
+ * @status: "ok", "error" or "crash"
+ * @ms: Processing time in milliseconds
+ *
+ * Returns: malloc'ed JSON text (no trailing newline)
+ */
+char *result_json(const char *file, const char *status, double ms)
+{
+    struct strbuf sb={0};
+    int i;
+
+    sb_printf(&sb, "{\"file\":");
+    sb_json(&sb, file);
+    sb_printf(&sb, ",\"status\":\"%s\",\"ms\":%.3f", status, ms);
+    if(!strcmp(status,"ok"))
+    {
+        sb_printf(&sb, ",\"tap_version\":%d,\"blocks\":[", tap_version);
+        for(i=0;i<tap_nblocks;i++)
+        {
+            sb_printf(&sb, "%s{\"n\":%d,\"start\":%" PRIOFF "u,\"size\":%" PRIOFF "u,\"name\":",
+                      i ? "," : "", i+1, array_blocks[i],
+                      array_blocks[i+1]-array_blocks[i]);
+            sb_json(&sb, (char *)blocknames[i]);
+            if(blockinfo[i].hdr>0)
+            {
+                sb_printf(&sb, ",\"type\":%d,\"load\":%u,\"end\":%u",
+                          blockinfo[i].type, blockinfo[i].load, blockinfo[i].end);
+            }
+            if(blockinfo[i].sig)
+            {
+                sb_printf(&sb, ",\"title\":");
+                sb_json(&sb, sigs[blockinfo[i].sig].title);
+                sb_printf(&sb, ",\"loader\":");
+                sb_json(&sb, sigs[blockinfo[i].sig].loader);
+            }
+            else if( (blockinfo[i].state==NAME_NOHDR) || (blockinfo[i].state==NAME_LIMIT) )
+            {
+                sb_printf(&sb, ",\"header\":\"%s\"",
+                          (blockinfo[i].state==NAME_LIMIT) ? "limit" : "none");
+            }
+            sb_printf(&sb, "}");
+        }
+        sb_printf(&sb, "]");
+    }
+    sb_printf(&sb, "}");
+    return sb.b;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Capture comparison (--compare)
+ *
+ * Every capture is scanned as usual, then the blocks of each capture are
+ * aligned to the blocks of the first one (decoded header first, block
+ * length otherwise) and measured: pulses outside the short/medium/long
+ * windows, ROM loader copies that decode with valid frames and checksum,
+ * and length. The best capture of every block is recommended and, unless
+ * listing only, the best blocks are assembled into <first>_best.tap.
+ */
+struct capture
+{
+    char *name;
+    FILE *file;
+    char version;
+    int nblocks;
+    tapoff *blocks;                 // Block starts, plus end of data
+    unsigned char (*names)[20];
+    struct block_info *info;
+    int *match;                     // Block aligned to each reference block
+};
+
+struct block_check
+{
+    tapoff len;          // Length after fixendtape()
+    tapoff bad;          // Pulses outside the classification windows
+    int frames;          // ROM frames decoded
+    int badframes;       // ROM frames with marker/bit/parity errors
+    int copies;          // ROM copies found
+    int goodcopies;      // ROM copies with all frames valid and checksum
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * count_bad_pulses() - Count the pulses outside the classification windows
+ * @b: Block data
+ * @cls: Pulse classes of the block
+ * @len: Block length
+ *
+ * Pauses and extended pulses are not counted. 16 pulses are checked at a
+ * time with SSE2 where available.
+ *
+ * Returns: Number of bad pulses
+ */
+tapoff count_bad_pulses(const unsigned char *b, const unsigned char *cls, tapoff len)
+{
+    tapoff i=0,bad=0;
+    const unsigned char *z;
+    int k;
+
+#ifdef USE_SSE2
+    const __m128i x_cls=_mm_set1_epi8(PULSE_X);
+    const __m128i zero=_mm_setzero_si128();
+    __m128i x,c;
+    int mask;
+
+    for( ;i+16<=len;i+=16)
+    {
+        x=_mm_loadu_si128((const __m128i *)(b+i));
+        c=_mm_loadu_si128((const __m128i *)(cls+i));
+        mask=_mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(x,zero),
+                                                _mm_cmpeq_epi8(c,x_cls)));
+        for( ;mask;mask&=mask-1)
+        {
+            bad++;
+        }
+    }
+#endif
+    for( ;i<len;i++)
+    {
+        bad+=b[i] && (cls[i]==PULSE_X);
+    }
+
+    // The length bytes of extended pulses aren't pulses
+    if(tap_version)
+    {
+        for(z=b;(z=memchr(z,0,len-(z-b)))!=NULL;z+=4)
+        {
+            for(k=1;(k<4)&&(z+k<b+len);k++)
+            {
+                bad-=z[k] && (cls[z-b+k]==PULSE_X);
+            }
+            if(z+4>=b+len)
+            {
+                break;
+            }
+        }
+    }
+    return bad;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * check_block() - Measure the quality of a block
+ * @b: Block data (after fixendtape)
+ * @len: Block length
+ * @chk: Output measures
+ */
+void check_block(unsigned char *b, tapoff len, struct block_check *chk)
+{
+    unsigned char *cls,x;
+    struct rom_byte *run=NULL;
+    int max=0,n,k,ok;
+    tapoff pos=0;
+
+    memset(chk,0,sizeof(*chk));
+    chk->len=len;
+
+    cls=malloc((size_t)len+1);
+    if(!cls)
+    {
+        printf("\nError: Cannot allocate memory\n");
+        itap_exit(1);
+    }
+    classify_block(b,cls,len);
+    chk->bad=count_bad_pulses(b,cls,len);
+    while(pos+ROM_FRAME<=len)
+    {
+        if( (cls[pos]!=PULSE_L) || (cls[pos+1]!=PULSE_M) )
+        {
+            pos++;
+            continue;
+        }
+        n=rom_run(cls,len,&pos,&run,&max);
+        if(!rom_copy(run,n))
+        {
+            continue;
+        }
+        chk->copies++;
+        chk->frames+=n;
+        ok=1;
+        x=0;
+        for(k=0;k<n;k++)
+        {
+            if(!run[k].ok)
+            {
+                chk->badframes++;
+                ok=0;
+            }
+            if(k>=ROM_COUNT)
+            {
+                x^=run[k].val;
+            }
+        }
+        chk->goodcopies+=ok && !x;
+    }
+    free(run);
+    free(cls);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * better_block() - Tell if a block measures better than another
+ *
+ * Returns: 1 if @a is better than @b
+ */
+int better_block(struct block_check *a, struct block_check *b)
+{
+    if(a->goodcopies!=b->goodcopies)
+    {
+        return a->goodcopies>b->goodcopies;
+    }
+    if(a->badframes!=b->badframes)
+    {
+        return a->badframes<b->badframes;
+    }
+    return a->bad<b->bad;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * same_block() - Score how likely two blocks are the same recording
+ *
+ * Returns: 3 for the same decoded header, 1 for a similar length, 0 for
+ * no match
+ */
+int same_block(struct capture *a, int i, struct capture *b, int j)
+{
+    tapoff la=a->blocks[i+1]-a->blocks[i];
+    tapoff lb=b->blocks[j+1]-b->blocks[j];
+
+    if( (a->info[i].hdr>0) && (b->info[j].hdr>0) )
+    {
+        return ( !strcmp((char *)a->names[i],(char *)b->names[j]) &&
+                 (a->info[i].type==b->info[j].type) &&
+                 (a->info[i].load==b->info[j].load) ) ? 3 : 0;
+    }
+    return ( (la<lb ? lb-la : la-lb) <= (la>lb ? la : lb)/10 ) ? 1 : 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * align_capture() - Align the blocks of a capture to the reference one
+ * @ref: Reference capture
+ * @cap: Capture to align, cap->match is filled in
+ *
+ * Blocks may be missing or split differently in a capture, so the match
+ * is the best scoring ordered alignment (dynamic programming on the
+ * same_block() scores).
+ */
+void align_capture(struct capture *ref, struct capture *cap)
+{
+    int n=ref->nblocks,m=cap->nblocks,i,j,s;
+    int *dp;
+
+    dp=calloc((n+1)*(m+1),sizeof(*dp));
+    if(!dp)
+    {
+        printf("\nError: Cannot allocate memory\n");
+        itap_exit(1);
+    }
+    for(i=1;i<=n;i++)
+    {
+        for(j=1;j<=m;j++)
+        {
+            s=dp[(i-1)*(m+1)+j];
+            if(dp[i*(m+1)+j-1]>s)
+            {
+                s=dp[i*(m+1)+j-1];
+            }
+            if( same_block(ref,i-1,cap,j-1) &&
+                (dp[(i-1)*(m+1)+j-1]+same_block(ref,i-1,cap,j-1)>s) )
+            {
+                s=dp[(i-1)*(m+1)+j-1]+same_block(ref,i-1,cap,j-1);
+            }
+            dp[i*(m+1)+j]=s;
+        }
+    }
+    for(i=0;i<n;i++)
+    {
+        cap->match[i]=-1;
+    }
+    for(i=n,j=m;(i>0)&&(j>0); )
+    {
+        s=same_block(ref,i-1,cap,j-1);
+        if( s && (dp[i*(m+1)+j]==dp[(i-1)*(m+1)+j-1]+s) )
+        {
+            cap->match[--i]=--j;
+        }
+        else if(dp[i*(m+1)+j]==dp[(i-1)*(m+1)+j])
+        {
+            i--;
+        }
+        else
+        {
+            j--;
+        }
+    }
+    free(dp);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * load_capture_block() - Read a block of a capture and fix its end
+ *
+ * Returns: malloc'ed block data, NULL if out of memory
+ */
+unsigned char *load_capture_block(struct capture *cap, int i, tapoff *len)
+{
+    unsigned char *b;
+
+    tap_version=cap->version;
+    select_kernels();
+    *len=cap->blocks[i+1]-cap->blocks[i];
+    if( (b=malloc((size_t)*len))==NULL )
+    {
+        return NULL;
+    }
+    load_block(cap->file,cap->blocks[i],*len,b);
+    fixendtape(b,len);
+    if(calibrate)
+    {
+        calib_block(b,*len);
+    }
+    return b;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * compare_write() - Assemble the best capture of every block
+ * @cap: Captures, the first one gives the block list
+ * @best: Best capture of every block
+ *
+ * Returns: 0 on success
+ */
+int compare_write(struct capture *cap, int *best)
+{
+    char best_name[_MAX_PATH+16];
+    unsigned char *b;
+    tapoff len,total=0;
+    int i,k,lost;
+    FILE *out;
+
+    out_base(best_name,outdir,cap[0].name);
+    strcat(best_name,"_best.tap");
+    if( (out=fopen(best_name,"wb"))==NULL )
+    {
+        printf("\nError: Cannot create %s\n",best_name);
+        return 1;
+    }
+    fwrite("C64-TAPE-RAW",1,12,out);
+    putc(cap[0].version,out);
+    fwrite("\0\0\0\0\0\0\0",1,7,out);
+    for(i=0;i<cap[0].nblocks;i++)
+    {
+        k=best[i];
+        if( (b=load_capture_block(&cap[k],cap[k].match[i],&len))==NULL )
+        {
+            printf("\nError: Cannot allocate memory for block %d\n",i+1);
+            break;
+        }
+        if(repairmode)
+        {
+            repair_block(b,len,&lost);
+        }
+        if(quantize)
+        {
+            quantize_block(b,len);
+        }
+        if( (fwrite(b,(size_t)len,1,out)!=1) && len )
+        {
+            free(b);
+            break;
+        }
+        total+=len;
+        free(b);
+    }
+
+    // The TAP header can't describe more than 4 GB of data
+    if( (i==cap[0].nblocks) && (total>TAP_MAXSIZE) )
+    {
+        printf("\nError: best blocks are %" PRIOFF "u bytes, too large for the "
+               "32-bit TAP size field. Not written.\n", total);
+        fclose(out);
+        remove(best_name);
+        return 1;
+    }
+    if( (i==cap[0].nblocks) && !fseek(out,16,SEEK_SET) )
+    {
+        put_le32((unsigned int)total,out);
+    }
+    else
+    {
+        i=-1;
+    }
+    if( fclose(out) || (i<cap[0].nblocks) )
+    {
+        printf("\nError: Cannot write %s\n",best_name);
+        remove(best_name);
+        return 1;
+    }
+    printf("\nBest blocks assembled: %s\n",best_name);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * compare_taps() - Compare captures of the same tape block by block
+ * @names: Capture filenames
+ * @ncap: Number of captures
+ *
+ * Returns: 0 on success
+ */
+int compare_taps(char **names, int ncap)
+{
+    struct capture *cap;
+    struct block_check chk,best_chk;
+    unsigned char *b;
+    int *best=NULL,*wins,i,k,mixed=0,ret=0;
+    tapoff len;
+
+    cap=calloc(ncap,sizeof(*cap));
+    wins=calloc(ncap,sizeof(*wins));
+    if( !cap || !wins )
+    {
+        printf("\nError: Cannot allocate memory\n");
+        free(cap);
+        free(wins);
+        return 1;
+    }
+
+    // Scan every capture
+    for(k=0;!ret && (k<ncap);k++)
+    {
+        process_reset();
+        strcpy(tapname,names[k]);
+        cap[k].nblocks=open_tape();
+
+        // The capture keeps the input, the next process_reset() mustn't close it
+        cap[k].file=tap_inp;
+        if(is_archive)
+        {
+            printf("\n%s is a compact archive, expand it first (-u).\n",tapname);
+            tap_inp=NULL;
+            ret=1;
+            continue;
+        }
+        printf("\n%s:\n",tapname);
+        decode_names(cap[k].nblocks,tap_inp);
+        for(i=0;i<cap[k].nblocks;i++)
+        {
+            PrintBlocks(i,array_blocks,tap_inp);
+        }
+        tap_inp=NULL;
+        cap[k].name=names[k];
+        cap[k].version=tap_version;
+        cap[k].blocks=malloc((cap[k].nblocks+1)*sizeof(*cap[k].blocks));
+        cap[k].names=malloc(cap[k].nblocks*sizeof(*cap[k].names));
+        cap[k].info=malloc(cap[k].nblocks*sizeof(*cap[k].info));
+        cap[k].match=malloc(cap[0].nblocks*sizeof(*cap[k].match));
+        if( !cap[k].blocks || !cap[k].names || !cap[k].info || !cap[k].match )
+        {
+            printf("\nError: Cannot allocate memory\n");
+            ret=1;
+            continue;
+        }
+        memcpy(cap[k].blocks,array_blocks,(cap[k].nblocks+1)*sizeof(*cap[k].blocks));
+        memcpy(cap[k].names,blocknames,cap[k].nblocks*sizeof(*cap[k].names));
+        memcpy(cap[k].info,blockinfo,cap[k].nblocks*sizeof(*cap[k].info));
+        mixed|=(cap[k].version!=cap[0].version);
+        align_capture(&cap[0],&cap[k]);
+    }
+
+    // Measure every aligned block and pick the best
+    if( !ret && ((best=malloc(cap[0].nblocks*sizeof(*best)))==NULL) )
+    {
+        printf("\nError: Cannot allocate memory\n");
+        ret=1;
+    }
+    if(!ret)
+    {
+        printf("\nComparison:\n");
+    }
+    for(i=0;!ret && (i<cap[0].nblocks);i++)
+    {
+        printf("%02d) %s\n",i+1,cap[0].names[i]);
+        best[i]=-1;
+        for(k=0;k<ncap;k++)
+        {
+            if(cap[k].match[i]<0)
+            {
+                printf("    %-24s missing\n",cap[k].name);
+                continue;
+            }
+            if( (b=load_capture_block(&cap[k],cap[k].match[i],&len))==NULL )
+            {
+                printf("\nError: Cannot allocate memory for block %d\n",i+1);
+                ret=1;
+                break;
+            }
+            check_block(b,len,&chk);
+            free(b);
+            printf("    %-24s %8" PRIOFF "u bytes, %6" PRIOFF "u bad pulses, "
+                   "%d/%d bad frames, %d/%d copies ok\n",
+                   cap[k].name, chk.len, chk.bad, chk.badframes, chk.frames,
+                   chk.goodcopies, chk.copies);
+            if( (best[i]<0) || better_block(&chk,&best_chk) )
+            {
+                best[i]=k;
+                best_chk=chk;
+            }
+        }
+        if(!ret)
+        {
+            wins[best[i]]++;
+            printf("    best: %s\n",cap[best[i]].name);
+        }
+    }
+
+    if(!ret)
+    {
+        for(k=0;k<ncap;k++)
+        {
+            printf("\n%-24s best for %d of %d blocks", cap[k].name, wins[k], cap[0].nblocks);
+        }
+        printf("\n");
+    }
+
+    // Assemble the best blocks
+    if( !ret && !listonly )
+    {
+        if(mixed)
+        {
+            printf("\nCaptures have different TAP versions, not assembled.\n");
+        }
+        else
+        {
+            ret=compare_write(cap,best);
+        }
+    }
+
+    for(k=0;k<ncap;k++)
+    {
+        if(cap[k].file)
+        {
+            fclose(cap[k].file);
+        }
+        free(cap[k].blocks);
+        free(cap[k].names);
+        free(cap[k].info);
+        free(cap[k].match);
+    }
+    free(cap);
+    free(wins);
+    free(best);
+    return ret;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Tape assembler (--assemble)
+ *
+ * itap --assemble out.tap spec... builds one TAP from blocks of other
+ * tapes, in the order given. A spec is a tape, optionally followed by a
+ * colon and a comma-separated list of block numbers, ranges (3-5) and
+ * names; a tape alone stands for all its blocks. Blocks are copied as
+ * split files would be (trailing pulses dropped, see tail_length()), with
+ * --gap ms of pause before every block but the first, straight from the
+ * sources to the output (sendfile on Linux). The index of the output is
+ * written next to it.
+ */
+char *asmfile=NULL;             // Assembled TAP (--assemble)
+int asm_gap=0;                  // Pause between assembled blocks, in ms (--gap)
+
+// Block of the assembled tape
+struct asm_block
+{
+    int src;                    // Source tape
+    tapoff start,len;           // Range of the source
+    tapoff pause;               // Bytes of pause written before it
+    unsigned char name[20];
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * put_pause() - Write a pause in the pulses of a TAP version
+ * @ms: Pause length
+ * @version: TAP version
+ * @file_out: Output, or NULL to count the bytes only
+ *
+ * v1/v2 store it as extended pulses of up to 0xffffff cycles, v0 as
+ * 0x00 pulses of 0x100*8 cycles.
+ *
+ * Returns: Bytes of pause
+ */
+tapoff put_pause(int ms, int version, FILE *file_out)
+{
+    tapoff cycles=(tapoff)(ms*(C64_CLOCK/1000.0)+0.5),c,n=0;
+
+    while(cycles>0)
+    {
+        if(version)
+        {
+            c=(cycles>0xffffff) ? 0xffffff : cycles;
+            if(file_out)
+            {
+                putc(0, file_out);
+                putc(c&0xff, file_out);
+                putc((c>>8)&0xff, file_out);
+                putc((c>>16)&0xff, file_out);
+            }
+            n+=4;
+        }
+        else
+        {
+            c=(cycles>0x800) ? 0x800 : cycles;
+            if(file_out)
+            {
+                putc(0, file_out);
+            }
+            n++;
+        }
+        cycles-=c;
+    }
+    return n;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * asm_add() - Add a block of the current tape to the assembled tape
+ * @blk: Assembled blocks (grown)
+ * @n: Number of assembled blocks (updated)
+ * @src: Source tape
+ * @i: Block of the source, in the block tables
+ *
+ * Returns: 0 on success, 1 if out of memory
+ */
+int asm_add(struct asm_block **blk, int *n, int src, int i)
+{
+    struct asm_block *a;
+
+    if( (*n&63)==0 )
+    {
+        if( (a=realloc(*blk, (*n+64)*sizeof(*a)))==NULL )
+        {
+            printf("\nError: Cannot allocate memory\n");
+            return 1;
+        }
+        *blk=a;
+    }
+    a=&(*blk)[(*n)++];
+    memset(a, 0, sizeof(*a));
+    a->src=src;
+    a->start=array_blocks[i];
+    a->len=tail_length(tap_inp, array_blocks[i], array_blocks[i+1]-array_blocks[i]);
+    memcpy(a->name, blocknames[i], sizeof(a->name));
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * asm_select() - Add the blocks picked by a spec to the assembled tape
+ * @sel: Block list of the spec (NULL for all blocks)
+ * @src: Source tape
+ * @nblocks: Number of blocks of the source, in the block tables
+ * @blk: Assembled blocks (grown)
+ * @n: Number of assembled blocks (updated)
+ *
+ * Numbers and ranges add blocks in the order written (5-3 is 5, 4, 3),
+ * a name adds every block of that name.
+ *
+ * Returns: 0 on success, 1 if a block doesn't exist or out of memory
+ */
+int asm_select(const char *sel, int src, int nblocks, struct asm_block **blk, int *n)
+{
+    char item[32];
+    int i,first,last,len,found=0;
+
+    if(!sel)
+    {
+        for(i=0;i<nblocks;i++)
+        {
+            if(asm_add(blk, n, src, i))
+            {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    for(;;sel++)
+    {
+        len=(int)strcspn(sel,",");
+        if( (len==0) || (len>=(int)sizeof(item)) )
+        {
+            printf("\nError: Bad block list in %s\n", tapname);
+            return 1;
+        }
+        memcpy(item, sel, len);
+        item[len]=0;
+        sel+=len;
+
+        if(strspn(item,"0123456789-")==(size_t)len)
+        {
+            // Block number or range
+            if(sscanf(item,"%d-%d",&first,&last)<2)
+            {
+                last=first;
+            }
+            if( (first<1) || (last<1) || (first>nblocks) || (last>nblocks) )
+            {
+                printf("\nError: %s has no block %s\n", tapname, item);
+                return 1;
+            }
+            for(i=first;;i+=(first<last) ? 1 : -1)
+            {
+                if(asm_add(blk, n, src, i-1))
+                {
+                    return 1;
+                }
+                if(i==last)
+                {
+                    break;
+                }
+            }
+        }
+        else
+        {
+            // Every block of that name
+            for(i=0,found=0;i<nblocks;i++)
+            {
+                if(strcmp((char *)blocknames[i],item))
+                {
+                    continue;
+                }
+                found++;
+                if(asm_add(blk, n, src, i))
+                {
+                    return 1;
+                }
+            }
+            if(!found)
+            {
+                printf("\nError: %s has no block named %s\n", tapname, item);
+                return 1;
+            }
+        }
+        if(!*sel)
+        {
+            return 0;
+        }
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * asm_write() - Write the assembled tape and its index
+ * @out: Output TAP
+ * @blk: Assembled blocks
+ * @n: Number of assembled blocks
+ * @src: Source tapes
+ * @version: TAP version of the sources
+ *
+ * Returns: 0 on success
+ */
+int asm_write(const char *out, struct asm_block *blk, int n, FILE **src, char version)
+{
+    FILE *file_out;
+    tapoff total=0;
+    int i;
+
+    // Output layout, the pause of a block goes before its pilot
+    process_reset();
+    grow_blocks(n);
+    for(i=0;i<n;i++)
+    {
+        blk[i].pause=put_pause(i ? asm_gap : 0, version, NULL);
+        total+=blk[i].pause;
+        array_blocks[i]=total+20;
+        total+=blk[i].len;
+        memcpy(blocknames[i], blk[i].name, sizeof(blocknames[i]));
+    }
+    array_blocks[n]=total+20;
+    if(total > TAP_MAXSIZE)
+    {
+        printf("\nError: assembled data is %" PRIOFF "u bytes, too large for the "
+               "32-bit TAP size field. Not written.\n", total);
+        return 1;
+    }
+
+    if( (file_out=fopen(out,"wb"))==NULL )
+    {
+        printf("\nError: Cannot create %s\n",out);
+        return 1;
+    }
+    fwrite("C64-TAPE-RAW",1,12,file_out);
+    putc(version,file_out);
+    fwrite("\0\0\0",1,3,file_out);
+    put_le32((unsigned int)total,file_out);
+    for(i=0;i<n;i++)
+    {
+        put_pause(i ? asm_gap : 0, version, file_out);
+        if(copy_range(src[blk[i].src], blk[i].start, blk[i].len, file_out))
+        {
+            break;
+        }
+    }
+    if( fclose(file_out) || (i<n) )
+    {
+        printf("\nError: Cannot write %s\n",out);
+        return 1;
+    }
+
+    printf("\n%s:\n",out);
+    for(i=0;i<n;i++)
+    {
+        ShowBlock(i,array_blocks);
+    }
+    strcpy(tapname,out);
+    create_idx_file(tapname, n, array_blocks);
+    printf("\nAssembled: %s, %d blocks, %" PRIOFF "u bytes\n", out, n, total+20);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * assemble_tape() - Build one TAP from blocks of other tapes
+ * @out: Output TAP
+ * @specs: Tapes and their block lists
+ * @nspec: Number of specs
+ *
+ * Returns: 0 on success
+ */
+int assemble_tape(const char *out, char **specs, int nspec)
+{
+    struct asm_block *blk=NULL;
+    FILE **src;
+    char *sel,*p;
+    char version=0;
+    int i,k,n=0,nblocks,ret=0;
+
+    if( (src=calloc(nspec,sizeof(*src)))==NULL )
+    {
+        printf("\nError: Cannot allocate memory\n");
+        return 1;
+    }
+
+    // Scan every source and pick its blocks
+    for(k=0;!ret && (k<nspec);k++)
+    {
+        // The block list follows the last colon, unless it is part of a path
+        process_reset();
+        strcpy(tapname,specs[k]);
+        sel=NULL;
+        p=strrchr(tapname,':');
+        if( p && (p-tapname>1) && !strpbrk(p,"/\\") )
+        {
+            *p=0;
+            sel=specs[k]+(p-tapname)+1;
+        }
+        nblocks=open_tape();
+        src[k]=tap_inp;
+        if(is_archive)
+        {
+            printf("\n%s is a compact archive, expand it first (-u).\n",tapname);
+            ret=1;
+        }
+        else if( k && (tap_version!=version) )
+        {
+            printf("\n%s is a v%d TAP, the first tape is v%d. Not assembled.\n",
+                   tapname, tap_version, version);
+            ret=1;
+        }
+        else
+        {
+            version=tap_version;
+            printf("\n%s:\n",tapname);
+            decode_names(nblocks,tap_inp);
+            for(i=0;i<nblocks;i++)
+            {
+                PrintBlocks(i,array_blocks,tap_inp);
+            }
+            ret=asm_select(sel, k, nblocks, &blk, &n);
+        }
+        tap_inp=NULL;
+    }
+    if( !ret && !n )
+    {
+        printf("\nThere are no blocks to assemble.\n");
+        ret=1;
+    }
+    if(!ret)
+    {
+        ret=asm_write(out, blk, n, src, version);
+    }
+
+    for(k=0;k<nspec;k++)
+    {
+        if(src[k])
+        {
+            fclose(src[k]);
+        }
+    }
+    free(src);
+    free(blk);
+    return ret;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Watch-folder mode (--watch)
+ *
+ * The parent process waits for completed tapes in the watched folder
+ * (inotify close-write or rename) and hands them out to a pool of worker
+ * processes started once at launch. Each worker runs process_tap() on the
+ * tapes it gets and sends back an NDJSON result line. Only after a result
+ * arrives is the tape written to the journal, so after a crash or restart
+ * any unfinished tape is processed again. A worker that dies is replaced
+ * and its tape is journaled as "crash" rather than retried forever.
+ * The journal key (path, size, mtime) is taken when a tape is handed out;
+ * a tape written again while a worker has it is queued again once its
+ * result is in.
+ *
+ * Pipe messages are a 32-bit length followed by the data (tape path from
+ * parent to worker, result line from worker to parent).
+ */
+#ifdef __linux__
+
+struct watch_worker
+{
+    pid_t pid;
+    int job_fd;          // Parent -> worker
+    int res_fd;          // Worker -> parent
+    char *job;           // Tape being processed, NULL if idle
+    char *key;           // Its journal key when it was handed out
+    int again;           // The tape was written again meanwhile
+};
+
+struct strset
+{
+    char **slot;
+    unsigned int size, used;
+};
+
+volatile sig_atomic_t watch_stop=0;
+
+/*------------------------------------------------------------------------*/
+/**
+ * strset_has() - Check a string set, adding the string if @add is set
+ *
+ * Returns: 1 if the string was already there, 0 otherwise
+ */
+int strset_has(struct strset *set, const char *str, int add)
+{
+    unsigned int i,k;
+    char **old;
+
+    if( add && (set->used*2 >= set->size) )
+    {
+        old=set->slot;
+        k=set->size;
+        set->size=k ? k*2 : 1024;
+        set->slot=calloc(set->size, sizeof(char *));
+        set->used=0;
+        for(i=0;i<k;i++)
+        {
+            if(old[i])
+            {
+                strset_has(set, old[i], 1);
+                free(old[i]);
+            }
+        }
+        free(old);
+    }
+    if(!set->size)
+    {
+        return 0;
+    }
+    i=(unsigned int)fnv1a(str, strlen(str), FNV_INIT) & (set->size-1);
+    for( ;set->slot[i];i=(i+1)&(set->size-1))
+    {
+        if(!strcmp(set->slot[i],str))
+        {
+            return 1;
+        }
+    }
+    if(add)
+    {
+        set->slot[i]=strdup(str);
+        set->used++;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * strset_del() - Remove a string from a string set
+ */
+void strset_del(struct strset *set, const char *str)
+{
+    unsigned int i,j,h,mask=set->size-1;
+
+    if(!set->size)
+    {
+        return;
+    }
+    i=(unsigned int)fnv1a(str, strlen(str), FNV_INIT) & mask;
+    for( ;set->slot[i] && strcmp(set->slot[i],str);i=(i+1)&mask);
+    if(!set->slot[i])
+    {
+        return;
+    }
+    free(set->slot[i]);
+    set->slot[i]=NULL;
+    set->used--;
+
+    // Move back the entries that probed past the freed slot
+    for(j=(i+1)&mask;set->slot[j];j=(j+1)&mask)
+    {
+        h=(unsigned int)fnv1a(set->slot[j], strlen(set->slot[j]), FNV_INIT) & mask;
+        if( (i<j) ? ((h<=i) || (h>j)) : ((h<=i) && (h>j)) )
+        {
+            set->slot[i]=set->slot[j];
+            set->slot[j]=NULL;
+            i=j;
+        }
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * strset_free() - Empty a string set and free its memory
+ */
+void strset_free(struct strset *set)
+{
+    unsigned int i;
+
+    for(i=0;i<set->size;i++)
+    {
+        free(set->slot[i]);
+    }
+    free(set->slot);
+    memset(set, 0, sizeof(*set));
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * read_full() / write_full() - Pipe I/O that doesn't stop halfway
+ *
+ * Returns: 1 on success, 0 on EOF or error
+ */
+int read_full(int fd, void *b, size_t len)
+{
+    ssize_t n;
+
+    while(len)
+    {
+        n=read(fd, b, len);
+        if( (n<0) && (errno==EINTR) )
+        {
+            continue;
+        }
+        if(n<=0)
+        {
+            return 0;
+        }
+        b=(char *)b+n;
+        len-=n;
+    }
+    return 1;
+}
+
+int write_full(int fd, const void *b, size_t len)
+{
+    ssize_t n;
+
+    while(len)
+    {
+        n=write(fd, b, len);
+        if( (n<0) && (errno==EINTR) )
+        {
+            continue;
+        }
+        if(n<=0)
+        {
+            return 0;
+        }
+        b=(const char *)b+n;
+        len-=n;
+    }
+    return 1;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * send_msg() / recv_msg() - Length-prefixed pipe messages
+ */
+int send_msg(int fd, const char *msg)
+{
+    unsigned int len=strlen(msg);
+
+    return write_full(fd, &len, sizeof(len)) && write_full(fd, msg, len);
+}
+
+char *recv_msg(int fd)
+{
+    unsigned int len;
+    char *msg;
+
+    if( !read_full(fd, &len, sizeof(len)) || (len>0x4000000) )
+    {
+        return NULL;
+    }
+    msg=malloc(len+1);
+    if( msg && !read_full(fd, msg, len) )
+    {
+        free(msg);
+        return NULL;
+    }
+    if(msg)
+    {
+        msg[len]=0;
+    }
+    return msg;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * watch_on_signal() - SIGINT/SIGTERM handler, stops the watch loop
+ */
+void watch_on_signal(int sig)
+{
+    (void)sig;
+    watch_stop=1;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * watch_worker_loop() - Body of a worker process
+ * @job_fd: Pipe to read tape paths from
+ * @res_fd: Pipe to send results to
+ *
+ * Options, tables and the quantization table stay warm between tapes.
+ */
+void watch_worker_loop(int job_fd, int res_fd)
+{
+    jmp_buf env;
+    char *job,*res;
+    const char *volatile status;
+    double t0;
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    if(!verbose)
+    {
+        freopen("/dev/null", "w", stdout);
+    }
+    while( (job=recv_msg(job_fd))!=NULL )
+    {
+        strncpy(tapname, job, _MAX_PATH-1);
+        t0=now_ms();
+        status="ok";
+        fail_jmp=&env;
+        if(setjmp(env)==0)
+        {
+            if(process_tap())
+            {
+                status="error";
+            }
+        }
+        else
+        {
+            status="error";
+            if(tap_inp)
+            {
+                fclose(tap_inp);
+                tap_inp=NULL;
+            }
+        }
+        fail_jmp=NULL;
+        fflush(stdout);
+        res=result_json(job, status, now_ms()-t0);
+        if(!send_msg(res_fd, res))
+        {
+            _exit(1);
+        }
+        free(res);
+        free(job);
+    }
+    _exit(0);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * watch_spawn() - Start (or restart) one worker process
+ *
+ * The tape of a restarted worker stays in @w->job, to be journaled.
+ *
+ * Returns: 0 on success
+ */
+int watch_spawn(struct watch_worker *w, struct watch_worker *pool, int n)
+{
+    int job[2],res[2],k;
+
+    if( pipe(job) || pipe(res) )
+    {
+        return 1;
+    }
+    w->pid=fork();
+    if(w->pid<0)
+    {
+        return 1;
+    }
+    if(w->pid==0)
+    {
+        // Don't keep the other workers' pipes open
+        for(k=0;k<n;k++)
+        {
+            if( (&pool[k]!=w) && pool[k].pid>0 )
+            {
+                close(pool[k].job_fd);
+                close(pool[k].res_fd);
+            }
+        }
+        close(job[1]);
+        close(res[0]);
+        watch_worker_loop(job[0], res[1]);
+    }
+    close(job[0]);
+    close(res[1]);
+    w->job_fd=job[1];
+    w->res_fd=res[0];
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * watch_wanted() - Check if a file in the watched folder is a tape
+ */
+int watch_wanted(const char *name)
+{
+    const char *ext=strrchr(name,'.');
+
+    return (name[0]!='.') && ext &&
+           ( !strcasecmp(ext,".tap") || !strcasecmp(ext,".itz") ||
+             !strcasecmp(ext,".wav") );
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * watch_key() - Build the journal key of a tape: path, size and mtime
+ *
+ * Returns: 0 on success, 1 if the file is gone
+ */
+int watch_key(const char *path, char *key, size_t keylen)
+{
+    struct stat st;
+
+    if(stat(path,&st) || !S_ISREG(st.st_mode))
+    {
+        return 1;
+    }
+    snprintf(key, keylen, "%s\t%lld\t%lld", path,
+             (long long)st.st_size, (long long)st.st_mtime);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * watch_enqueue() - Queue a tape for the workers
+ * @path: Tape
+ * @pool: Workers
+ * @n: Number of workers
+ * @queued: Paths waiting in the queue
+ * @queue: Queue, grown as needed
+ * @qtail: End of the queue
+ * @qcap: Capacity of the queue
+ *
+ * A tape a worker is busy with is flagged instead, and queued again once
+ * its result is in.
+ */
+void watch_enqueue(const char *path, struct watch_worker *pool, int n,
+                   struct strset *queued, char ***queue, size_t *qtail, size_t *qcap)
+{
+    int k;
+
+    for(k=0;k<n;k++)
+    {
+        if( pool[k].job && !strcmp(pool[k].job,path) )
+        {
+            pool[k].again=1;
+            return;
+        }
+    }
+    if(strset_has(queued,path,1))
+    {
+        return;
+    }
+    if(*qtail==*qcap)
+    {
+        *qcap=*qcap ? *qcap*2 : 256;
+        *queue=realloc(*queue, *qcap*sizeof(char *));
+    }
+    (*queue)[(*qtail)++]=strdup(path);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * watch_folder() - Watch a folder and process every completed tape
+ * @dir: Folder to watch
+ *
+ * Returns: Exit code
+ */
+int watch_folder(char *dir)
+{
+    struct watch_worker *pool;
+    struct strset done={0},queued={0};
+    struct pollfd *pfd;
+    struct dirent *de;
+    DIR *dp;
+    FILE *jf,*rf;
+    char jname[_MAX_PATH],path[_MAX_PATH],key[_MAX_PATH+64];
+    char rdir[_MAX_PATH],rout[_MAX_PATH];
+    char evbuf[16384];
+    const struct inotify_event *ev;
+    char **queue=NULL,*res,*line=NULL,*p;
+    size_t qhead=0,qtail=0,qcap=0,linecap=0;
+    ssize_t n;
+    int ifd,k,i,busy;
+
+    batchmode=1;
+    if(workers<1)
+    {
+        workers=(int)sysconf(_SC_NPROCESSORS_ONLN);
+        workers=(workers<1) ? 1 : workers;
+    }
+
+    // Outputs must not land in the watched folder, they would be picked up
+    if( !realpath(dir,rdir) )
+    {
+        printf("\nError: Cannot watch folder: %s\n",dir);
+        return 1;
+    }
+    if( !realpath(outdir ? outdir : ".",rout) || !strcmp(rdir,rout) ||
+        ( idxdir && realpath(idxdir,path) && !strcmp(rdir,path) ) )
+    {
+        printf("\nError: Use --out/--idx to write outputs outside %s\n",dir);
+        return 1;
+    }
+
+    // Journal of the tapes already processed
+    if( (journal ? snprintf(jname, sizeof(jname), "%s", journal) :
+                   snprintf(jname, sizeof(jname), "%s/.itap-journal", rdir)) >= (int)sizeof(jname) )
+    {
+        printf("\nError: Journal path too long\n");
+        return 1;
+    }
+    if( (jf=fopen(jname,"r"))!=NULL )
+    {
+        while( getline(&line,&linecap,jf)>0 )
+        {
+            // path \t size \t mtime \t status
+            if( (p=strrchr(line,'\t'))!=NULL )
+            {
+                *p=0;
+                strset_has(&done, line, 1);
+            }
+        }
+        fclose(jf);
+    }
+    if( (jf=fopen(jname,"a"))==NULL )
+    {
+        printf("\nError: Cannot open journal: %s\n",jname);
+        return 1;
+    }
+    rf=stdout;
+    if( ndjson && (rf=fopen(ndjson,"a"))==NULL )
+    {
+        printf("\nError: Cannot open results file: %s\n",ndjson);
+        return 1;
+    }
+
+    ifd=inotify_init1(IN_CLOEXEC);
+    if( (ifd<0) || (inotify_add_watch(ifd, rdir, IN_CLOSE_WRITE|IN_MOVED_TO)<0) )
+    {
+        printf("\nError: Cannot watch folder: %s\n",dir);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, watch_on_signal);
+    signal(SIGTERM, watch_on_signal);
+    fflush(stdout);
+
+    pool=calloc(workers, sizeof(*pool));
+    pfd=calloc(workers+1, sizeof(*pfd));
+    for(k=0;k<workers;k++)
+    {
+        if(watch_spawn(&pool[k], pool, workers))
+        {
+            printf("\nError: Cannot start worker %d\n",k+1);
+            return 1;
+        }
+    }
+    fprintf(stderr, "Watching %s with %d workers\n", rdir, workers);
+
+    // Tapes that arrived while we were not running
+    if( (dp=opendir(rdir))!=NULL )
+    {
+        while( (de=readdir(dp))!=NULL )
+        {
+            if(watch_wanted(de->d_name))
+            {
+                if( (snprintf(path, sizeof(path), "%s/%s", rdir, de->d_name) < (int)sizeof(path)) &&
+                    !watch_key(path,key,sizeof(key)) && !strset_has(&done,key,0) )
+                {
+                    watch_enqueue(path, pool, workers, &queued, &queue, &qtail, &qcap);
+                }
+            }
+        }
+        closedir(dp);
+    }
+
+    while(!watch_stop)
+    {
+        // Hand out queued tapes to idle workers
+        for(k=0;(k<workers)&&(qhead<qtail);k++)
+        {
+            if(pool[k].job)
+            {
+                continue;
+            }
+            pool[k].job=queue[qhead++];
+            strset_del(&queued, pool[k].job);
+            for(i=0;(i<workers)&&((i==k)||!pool[i].job||strcmp(pool[i].job,pool[k].job));i++);
+            if(i<workers)
+            {
+                pool[i].again=1;    // In progress, run it again afterwards
+            }
+            if( (i<workers) ||
+                watch_key(pool[k].job,key,sizeof(key)) || strset_has(&done,key,0) )
+            {
+                free(pool[k].job);  // In progress, gone or already done
+                pool[k].job=NULL;
+                k--;
+                continue;
+            }
+            pool[k].key=strdup(key);
+            send_msg(pool[k].job_fd, pool[k].job);
+        }
+        if(qhead==qtail)
+        {
+            qhead=qtail=0;
+            strset_free(&queued);   // Nothing waiting, forget the names
+        }
+
+        pfd[0].fd=ifd;
+        pfd[0].events=POLLIN;
+        for(k=0;k<workers;k++)
+        {
+            pfd[k+1].fd=pool[k].res_fd;
+            pfd[k+1].events=POLLIN;
+        }
+        if(poll(pfd, workers+1, -1)<0)
+        {
+            continue;  // EINTR, check watch_stop
+        }
+
+        // New tapes
+        if(pfd[0].revents & POLLIN)
+        {
+            n=read(ifd, evbuf, sizeof(evbuf));
+            for(p=evbuf;(n>0)&&(p<evbuf+n);p+=sizeof(*ev)+ev->len)
+            {
+                ev=(const struct inotify_event *)p;
+                if( ev->len && watch_wanted(ev->name) &&
+                    (snprintf(path, sizeof(path), "%s/%s", rdir, ev->name) < (int)sizeof(path)) )
+                {
+                    watch_enqueue(path, pool, workers, &queued, &queue, &qtail, &qcap);
+                }
+            }
+        }
+
+        // Results
+        for(k=0;k<workers;k++)
+        {
+            if( !(pfd[k+1].revents & (POLLIN|POLLHUP)) )
+            {
+                continue;
+            }
+            res=recv_msg(pool[k].res_fd);
+            if(!res)
+            {
+                // Worker died: replace it, don't retry its tape
+                close(pool[k].job_fd);
+                close(pool[k].res_fd);
+                waitpid(pool[k].pid, NULL, 0);
+                pool[k].pid=0;
+                if(pool[k].job)
+                {
+                    res=result_json(pool[k].job, "crash", 0);
+                }
+                if(watch_spawn(&pool[k], pool, workers))
+                {
+                    printf("\nError: Cannot restart worker %d\n",k+1);
+                    watch_stop=1;
+                }
+                if(!res)
+                {
+                    continue;
+                }
+            }
+            fprintf(rf, "%s\n", res);
+            fflush(rf);
+            if(pool[k].key)
+            {
+                busy=strstr(res,"\"status\":\"ok\"") ? 1 : 0;
+                p=strstr(res,"\"status\":\"crash\"") ? "crash" : (busy ? "ok" : "error");
+                fprintf(jf, "%s\t%s\n", pool[k].key, p);
+                fflush(jf);
+                fsync(fileno(jf));
+                strset_has(&done, pool[k].key, 1);
+                free(pool[k].key);
+                pool[k].key=NULL;
+            }
+            free(res);
+            p=pool[k].job;
+            pool[k].job=NULL;
+            if( p && pool[k].again )
+            {
+                // Written again while being processed: the journal key
+                // tells if this run already saw the final version
+                pool[k].again=0;
+                watch_enqueue(p, pool, workers, &queued, &queue, &qtail, &qcap);
+            }
+            free(p);
+        }
+    }
+
+    // Let the workers finish their current tape and leave
+    for(k=0;k<workers;k++)
+    {
+        close(pool[k].job_fd);
+    }
+    for(k=0;k<workers;k++)
+    {
+        if(pool[k].pid>0)
+        {
+            waitpid(pool[k].pid, NULL, 0);
+        }
+    }
+    fclose(jf);
+    if(rf!=stdout)
+    {
+        fclose(rf);
+    }
+    for(i=0;i<(int)qtail;i++)
+    {
+        free(queue[i]);
+    }
+    free(queue);
+    free(pool);
+    free(pfd);
+    free(line);
+    strset_free(&queued);
+    strset_free(&done);
+    return 0;
+}
+
+#else
+
+int watch_folder(char *dir)
+{
+    printf("\n--watch is only supported on Linux\n");
+    return 1;
+}
+
+#endif
+
+/*------------------------------------------------------------------------*/
+/*
+ * Collection catalog (--catalog)
+ *
+ * One file describes every block of every tape of a collection, with a
+ * trigram index over the program names:
+ *
+ *   header      "ITAPCAT1", entries, trigrams, then the offsets of the
+ *               paths, trigram table and postings (CAT_HEADER bytes)
+ *   entries     CAT_ENTRY bytes each: path offset, block, start, size,
+ *               hash, hdr, type, load, end, 16-byte name
+ *   paths       NUL-terminated tape paths
+ *   trigrams    sorted (trigram, first posting, postings) triplets
+ *   postings    entry numbers, ascending for each trigram
+ *
+ * A search reads the trigram table, the shortest postings list of the
+ * query and the entries it names, never the whole catalog.
+ */
+#define CAT_MAGIC  "ITAPCAT1"
+#define CAT_HEADER 40
+#define CAT_ENTRY  56
+#define CAT_GRAM   12
+
+struct cat_entry
+{
+    unsigned int path;      // Path number (offset once written)
+    unsigned int block;     // Block number in the tape
+    tapoff start,size;      // Block position in the tape
+    unsigned long long hash; // FNV-1a of the block pulses
+    unsigned char hdr;      // 1 header, 0 none, 0xff unknown (archive)
+    unsigned char type;     // Header type
+    unsigned short load,end; // Header addresses
+    unsigned char name[17]; // Program name
+};
+
+struct catalog
+{
+    struct cat_entry *e;    // Entries
+    unsigned int n,max;
+    char **paths;           // Tape paths
+    unsigned int npaths,maxpaths;
+};
+
+char *catfile="itap.cat";       // Catalog file (--catfile)
+char extract=0;                 // Extract catalog hits (-x)
+
+/*------------------------------------------------------------------------*/
+/**
+ * cat_upper() - Upper case of a name character, for case-blind search
+ */
+unsigned char cat_upper(unsigned char c)
+{
+    return ((c>='a')&&(c<='z')) ? c-0x20 : c;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * cat_gram() - Trigram key of three name characters
+ */
+unsigned int cat_gram(const unsigned char *s)
+{
+    return (cat_upper(s[0])<<16)|(cat_upper(s[1])<<8)|cat_upper(s[2]);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * catalog_tape() - Add every block of a tape to a catalog
+ * @cat: Catalog
+ * @path: Tape path
+ *
+ * Blocks of a TAP are hashed in COPY_CHUNK pieces straight from the file,
+ * blocks of a compact archive are decoded one at a time. A tape that can't
+ * be read is reported and left out, with none of its blocks.
+ */
+void catalog_tape(struct catalog *cat, const char *path)
+{
+    jmp_buf env;
+    struct cat_entry *e;
+    unsigned char *b;
+    unsigned long long hash;
+    unsigned int first=cat->n;
+    int i,nblocks;
+    tapoff len;
+
+    process_reset();
+    strncpy(tapname, path, _MAX_PATH-1);
+
+    if(cat->npaths==cat->maxpaths)
+    {
+        cat->maxpaths=cat->maxpaths ? cat->maxpaths*2 : 256;
+        cat->paths=realloc(cat->paths, cat->maxpaths*sizeof(*cat->paths));
+    }
+    if( !cat->paths || !(cat->paths[cat->npaths]=strdup(path)) )
+    {
+        printf("\nError: Cannot allocate memory\n");
+        exit(1);
+    }
+
+    fail_jmp=&env;
+    if(setjmp(env))
+    {
+        fail_jmp=NULL;
+        if(tap_inp)
+        {
+            fclose(tap_inp);
+            tap_inp=NULL;
+        }
+        cat->n=first;
+        free(cat->paths[cat->npaths]);
+        printf("%s left out of the catalog\n", path);
+        return;
+    }
+    nblocks=open_tape();
+    printf("\n%s:\n", tapname);
+
+    decode_names(nblocks,tap_inp);
+    for(i=0;i<nblocks;i++)
+    {
+        PrintBlocks(i,array_blocks,tap_inp);
+        len=array_blocks[i+1]-array_blocks[i];
+        if(cat->n==cat->max)
+        {
+            cat->max=cat->max ? cat->max*2 : 4096;
+            cat->e=realloc(cat->e, cat->max*sizeof(*cat->e));
+        }
+        if(!cat->e)
+        {
+            printf("\nError: Cannot allocate memory\n");
+            exit(1);
+        }
+
+        hash=FNV_INIT;
+        b=NULL;
+        if( is_archive && ((b=malloc((size_t)len))==NULL) )
+        {
+            printf("\nError: Cannot allocate memory for block %d\n", i+1);
+            longjmp(env, 1);
+        }
+        if( (b && !load_block(tap_inp, array_blocks[i], len, b)) ||
+            !data_hash(&hash, b, array_blocks[i], len) )
+        {
+            printf("\nError: Cannot read block %d\n", i+1);
+            free(b);
+            longjmp(env, 1);
+        }
+        free(b);
+
+        e=&cat->e[cat->n++];
+        memset(e, 0, sizeof(*e));
+        e->path=cat->npaths;
+        e->block=i;
+        e->start=array_blocks[i];
+        e->size=len;
+        e->hash=hash;
+        e->hdr=(blockinfo[i].hdr<0) ? 0xff : blockinfo[i].hdr;
+        e->type=blockinfo[i].type;
+        e->load=blockinfo[i].load;
+        e->end=blockinfo[i].end;
+        memcpy(e->name, blocknames[i], 16);
+    }
+    cat->npaths++;
+    fail_jmp=NULL;
+    fclose(tap_inp);
+    tap_inp=NULL;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * cmp_posting() - qsort() order of (trigram, entry) pairs
+ */
+int cmp_posting(const void *a, const void *b)
+{
+    unsigned long long x=*(const unsigned long long *)a;
+    unsigned long long y=*(const unsigned long long *)b;
+
+    return (x>y)-(x<y);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * catalog_write() - Write a catalog and its trigram index
+ * @cat: Catalog
+ *
+ * Returns: 0 on success
+ */
+int catalog_write(struct catalog *cat)
+{
+    FILE *out;
+    struct cat_entry *e;
+    unsigned long long *post=NULL;
+    unsigned int *pathoff;
+    size_t npost=0,maxpost=0,k,first;
+    tapoff paths_off,grams_off,post_off;
+    unsigned int i,j,p,ngrams=0,g;
+    int len,failed;
+
+    // (trigram, entry) pairs, once per distinct trigram of a name
+    for(i=0;i<cat->n;i++)
+    {
+        len=strlen((char *)cat->e[i].name);
+        for(j=0;(int)j+3<=len;j++)
+        {
+            if(npost==maxpost)
+            {
+                maxpost=maxpost ? maxpost*2 : 0x10000;
+                post=realloc(post, maxpost*sizeof(*post));
+                if(!post)
+                {
+                    printf("\nError: Cannot allocate memory\n");
+                    exit(1);
+                }
+            }
+            post[npost++]=((unsigned long long)cat_gram(cat->e[i].name+j)<<32)|i;
+        }
+    }
+    qsort(post, npost, sizeof(*post), cmp_posting);
+    for(k=0,j=0;k<npost;k++)
+    {
+        if( !k || (post[k]!=post[j-1]) )
+        {
+            post[j++]=post[k];
+        }
+    }
+    npost=j;
+    for(k=0;k<npost;k++)
+    {
+        ngrams+=( !k || ((post[k]>>32)!=(post[k-1]>>32)) );
+    }
+
+    if( (out=fopen(catfile,"wb"))==NULL )
+    {
+        printf("\nError: Cannot create %s\n", catfile);
+        free(post);
+        return 1;
+    }
+    pathoff=malloc((cat->npaths+1)*sizeof(*pathoff));
+    if(!pathoff)
+    {
+        printf("\nError: Cannot allocate memory\n");
+        exit(1);
+    }
+    for(p=0,i=0;i<cat->npaths;i++)
+    {
+        pathoff[i]=p;
+        p+=strlen(cat->paths[i])+1;
+    }
+    paths_off=CAT_HEADER+(tapoff)cat->n*CAT_ENTRY;
+    grams_off=paths_off+p;
+    post_off=grams_off+(tapoff)ngrams*CAT_GRAM;
+
+    fwrite(CAT_MAGIC, 1, 8, out);
+    put_le32(cat->n, out);
+    put_le32(ngrams, out);
+    put_le64(paths_off, out);
+    put_le64(grams_off, out);
+    put_le64(post_off, out);
+    for(i=0;i<cat->n;i++)
+    {
+        e=&cat->e[i];
+        put_le32(pathoff[e->path], out);
+        put_le32(e->block, out);
+        put_le64(e->start, out);
+        put_le64(e->size, out);
+        put_le64(e->hash, out);
+        putc(e->hdr, out);
+        putc(e->type, out);
+        put_le16(e->load, out);
+        put_le16(e->end, out);
+        put_le16(0, out);
+        fwrite(e->name, 1, 16, out);
+    }
+    for(i=0;i<cat->npaths;i++)
+    {
+        fwrite(cat->paths[i], 1, strlen(cat->paths[i])+1, out);
+    }
+    for(k=0;k<npost;k=first)
+    {
+        g=(unsigned int)(post[k]>>32);
+        for(first=k;(first<npost)&&((post[first]>>32)==g);first++);
+        put_le32(g, out);
+        put_le32((unsigned int)k, out);
+        put_le32((unsigned int)(first-k), out);
+    }
+    for(k=0;k<npost;k++)
+    {
+        put_le32((unsigned int)post[k], out);
+    }
+    free(pathoff);
+    free(post);
+
+    // The error indicator catches any failed fwrite()/putc() above
+    failed=ferror(out);
+    if( fclose(out) || failed )
+    {
+        printf("\nError: Cannot write %s\n", catfile);
+        remove(catfile);
+        return 1;
+    }
+    printf("\n%u blocks of %u tapes, %u trigrams written to %s\n",
+           cat->n, cat->npaths, ngrams, catfile);
+    return 0;
+}
+
+#ifdef __linux__
+
+/*------------------------------------------------------------------------*/
+/**
+ * catalog_walk() - Add the tapes of a folder and its subfolders
+ * @cat: Catalog
+ * @dir: Folder
+ *
+ * Entries are visited in name order so a catalog is reproducible.
+ * WAV captures are left out: their offsets only exist in the converted TAP.
+ */
+void catalog_walk(struct catalog *cat, const char *dir)
+{
+    struct dirent **list;
+    struct stat st;
+    char path[_MAX_PATH];
+    const char *ext;
+    int i,n;
+
+    if( (n=scandir(dir,&list,NULL,alphasort))<0 )
+    {
+        printf("\nError: Cannot read folder: %s\n", dir);
+        return;
+    }
+    for(i=0;i<n;i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+        ext=strrchr(list[i]->d_name,'.');
+        if( (list[i]->d_name[0]!='.') && !stat(path,&st) )
+        {
+            if(S_ISDIR(st.st_mode))
+            {
+                catalog_walk(cat, path);
+            }
+            else if( S_ISREG(st.st_mode) && ext &&
+                     (!strcasecmp(ext,".tap") || !strcasecmp(ext,".itz")) )
+            {
+                catalog_tape(cat, path);
+            }
+        }
+        free(list[i]);
+    }
+    free(list);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * catalog_build() - Build the catalog of a collection
+ * @dir: Collection folder
+ *
+ * Returns: Exit code
+ */
+int catalog_build(const char *dir)
+{
+    struct catalog cat={0};
+    char rdir[_MAX_PATH];
+    unsigned int i;
+    int ret;
+
+    batchmode=1;
+    listonly=1;
+    if( !realpath(dir,rdir) )
+    {
+        printf("\nError: Cannot read folder: %s\n", dir);
+        return 1;
+    }
+    catalog_walk(&cat, rdir);
+    ret=catalog_write(&cat);
+    for(i=0;i<cat.npaths;i++)
+    {
+        free(cat.paths[i]);
+    }
+    free(cat.paths);
+    free(cat.e);
+    return ret;
+}
+
+#else
+
+int catalog_build(const char *dir)
+{
+    printf("\n--catalog build is only supported on Linux\n");
+    return 1;
+}
+
+#endif
+
+/*------------------------------------------------------------------------*/
+/**
+ * catalog_extract() - Split one block of a catalog hit out of its tape
+ * @path: Tape path
+ * @e: Catalog entry
+ *
+ * The tape is scanned again (kept open for the next hit of the same tape)
+ * and the block saved as a split would save it.
+ *
+ * Returns: 0 on success
+ */
+int catalog_extract(const char *path, struct cat_entry *e)
+{
+    static int nblocks;
+
+    if( !tap_inp || strcmp(tapname,path) )
+    {
+        if(tap_inp)
+        {
+            fclose(tap_inp);
+            tap_inp=NULL;
+        }
+        process_reset();
+        strncpy(tapname, path, _MAX_PATH-1);
+        nblocks=open_tape();
+    }
+    if( (e->block>=(unsigned int)nblocks) || (array_blocks[e->block]!=e->start) ||
+        (array_blocks[e->block+1]-e->start!=e->size) )
+    {
+        printf("%s has changed since the catalog was built, block %u skipped\n",
+               path, e->block+1);
+        return 1;
+    }
+    PrintBlocks(e->block,array_blocks,tap_inp);
+    save(array_blocks[e->block], array_blocks[e->block+1], e->block, tapname);
+    return 0;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * catalog_find() - Search the program names of the catalog
+ * @query: Text to find anywhere in a name (case-blind)
+ *
+ * Queries of 3 characters or more only look at the entries listed under
+ * their rarest trigram, shorter ones read every entry.
+ *
+ * Returns: Exit code
+ */
+int catalog_find(const char *query)
+{
+    FILE *in;
+    unsigned char hdr[CAT_HEADER],rec[CAT_ENTRY],*grams=NULL;
+    unsigned char q[17],name[17];
+    char path[_MAX_PATH];
+    struct cat_entry e;
+    unsigned int n,ngrams,*cand=NULL,ncand,i,j,g,lo,hi,best=0,bestn=0;
+    tapoff paths_off,grams_off,post_off;
+    int k,ch,qlen,hits=0,failed=0;
+    double t0=now_ms();
+
+    qlen=strlen(query);
+    if( (qlen<1) || (qlen>16) )
+    {
+        printf("\nSearch text must be 1 to 16 characters\n");
+        return 1;
+    }
+    for(k=0;k<=qlen;k++)
+    {
+        q[k]=cat_upper(query[k]);
+    }
+    if( ((in=fopen(catfile,"rb"))==NULL) ||
+        (fread(hdr,1,CAT_HEADER,in)!=CAT_HEADER) || memcmp(hdr,CAT_MAGIC,8) )
+    {
+        printf("\nError: %s isn't an iTAP catalog\n", catfile);
+        return 1;
+    }
+    n=get_le(hdr+8,4);
+    ngrams=get_le(hdr+12,4);
+    paths_off=get_le(hdr+16,8);
+    grams_off=get_le(hdr+24,8);
+    post_off=get_le(hdr+32,8);
+
+    if(qlen>=3)
+    {
+        // Rarest trigram of the query; a missing one means no hit
+        grams=malloc((size_t)ngrams*CAT_GRAM+1);
+        fseek64(in, grams_off, SEEK_SET);
+        if( !grams || (fread(grams,CAT_GRAM,ngrams,in)!=ngrams) )
+        {
+            printf("\nError: Cannot read %s\n", catfile);
+            return 1;
+        }
+        for(k=0;k+3<=qlen;k++)
+        {
+            g=cat_gram(q+k);
+            for(lo=0,hi=ngrams;lo<hi;)
+            {
+                j=(lo+hi)/2;
+                if(get_le(grams+j*CAT_GRAM,4)<g)
+                {
+                    lo=j+1;
+                }
+                else
+                {
+                    hi=j;
+                }
+            }
+            if( (lo==ngrams) || (get_le(grams+lo*CAT_GRAM,4)!=g) )
+            {
+                bestn=0;
+                break;
+            }
+            if( !k || (get_le(grams+lo*CAT_GRAM+8,4)<bestn) )
+            {
+                best=get_le(grams+lo*CAT_GRAM+4,4);
+                bestn=get_le(grams+lo*CAT_GRAM+8,4);
+            }
+        }
+        ncand=bestn;
+        cand=malloc((size_t)ncand*4+4);
+        fseek64(in, post_off+(tapoff)best*4, SEEK_SET);
+        for(i=0;cand && (i<ncand);i++)
+        {
+            cand[i]=get_le32(in);
+        }
+        free(grams);
+    }
+    else
+    {
+        ncand=n;
+    }
+
+    for(i=0;i<ncand;i++)
+    {
+        fseek64(in, CAT_HEADER+(tapoff)(cand ? cand[i] : i)*CAT_ENTRY, SEEK_SET);
+        if(fread(rec,1,CAT_ENTRY,in)!=CAT_ENTRY)
+        {
+            break;
+        }
+        for(k=0;k<16;k++)
+        {
+            name[k]=cat_upper(rec[40+k]);
+        }
+        name[16]=0;
+        if(!strstr((char *)name,(char *)q))
+        {
+            continue;
+        }
+        e.path=get_le(rec,4);
+        e.block=get_le(rec+4,4);
+        e.start=get_le(rec+8,8);
+        e.size=get_le(rec+16,8);
+        e.hash=get_le(rec+24,8);
+        e.hdr=rec[32];
+        e.type=rec[33];
+        e.load=get_le(rec+34,2);
+        e.end=get_le(rec+36,2);
+        memcpy(e.name, rec+40, 16);
+        e.name[16]=0;
+        fseek64(in, paths_off+e.path, SEEK_SET);
+        for(k=0;(k<_MAX_PATH-1)&&((ch=getc(in))!=EOF)&&ch;k++)
+        {
+            path[k]=(char)ch;
+        }
+        path[k]=0;
+
+        hits++;
+        printf("%s %02u) %8" PRIOFF "u bytes, 0x%08" PRIOFF "X - %-16s %016llx",
+               path, e.block+1, e.size, e.start, e.name, e.hash);
+        if(e.hdr==1)
+        {
+            printf(" type %02X from $%04X to $%04X", e.type, e.load, e.end);
+        }
+        printf("\n");
+        if(extract)
+        {
+            failed|=catalog_extract(path, &e);
+        }
+    }
+    fclose(in);
+    free(cand);
+    if(tap_inp)
+    {
+        fclose(tap_inp);
+        tap_inp=NULL;
+    }
+    printf("\n%d hits in %u blocks, %.1f ms\n", hits, n, now_ms()-t0);
+    return failed;
+}
+
+/*------------------------------------------------------------------------*/
+/*
+ * Block server (--serve)
+ *
+ * Requests and replies are length-prefixed frames on a Unix socket, the
+ * length being 32 bits in host order as with send_msg():
+ *
+ *   request  op (1), block number counted from 1 (4), tape path
+ *   reply    status (1, 0 ok or 1 error), then the result or an error text
+ *
+ *   'L'  list    one line per block, as -l -d prints them (block ignored)
+ *   'H'  header  name, type, load and end address of a block (text)
+ *   'T'  tap     the block as a TAP file, as a split writes it
+ *   'P'  prg     the program whose header is in the block: load address
+ *                and data, from the data block that follows it
+ *
+ * Recently used tapes stay mapped along with their block tables in an LRU
+ * cache of at most --cache MB. A tape whose size or mtime changed is
+ * scanned again.
+ *
+ * Client sockets are non-blocking: requests are gathered in a buffer per
+ * connection and only complete frames are answered, so a client sending
+ * half a frame doesn't hold up the others. A reply goes out as far as the
+ * socket takes it, the rest is kept and sent when the socket is writable;
+ * no further request of that client is read meanwhile.
+ */
+#ifdef __linux__
+
+#define SERVE_CLIENTS 64        // Connections served at the same time
+#define SERVE_MAXREQ  0x10000   // Longest request frame
+#define SERVE_INBUF   (4+SERVE_MAXREQ)
+
+// Client connection
+struct serve_conn
+{
+    unsigned char *in;          // Request bytes received, SERVE_INBUF
+    size_t in_len;
+    unsigned char *out;         // Reply bytes the socket didn't take yet
+    size_t out_len;
+    size_t out_off;             // Bytes of out already sent
+    size_t out_size;
+    int fd;
+};
+
+struct served_tape
+{
+    char *path;
+    dev_t dev;                  // Identity of the mapped file
+    ino_t ino;
+    time_t mtime;
+    tapoff size;
+    unsigned char *map;         // Whole file, read only
+    unsigned char version;
+    int nblocks;
+    tapoff *blocks;             // Block starts, plus end of data
+    unsigned char (*names)[20];
+    struct block_info *info;
+    tapoff cost;                // Bytes charged to the cache
+    unsigned long long used;    // LRU clock of the last request
+    struct served_tape *next;
+};
+
+struct served_tape *serve_cache=NULL;   // Cached tapes
+tapoff serve_bytes=0;                   // Bytes charged to the cache
+unsigned long long serve_clock=0;
+
+/*------------------------------------------------------------------------*/
+/**
+ * serve_drop() - Unlink and free a cached tape
+ */
+void serve_drop(struct served_tape *t)
+{
+    struct served_tape **p;
+
+    for(p=&serve_cache;*p;p=&(*p)->next)
+    {
+        if(*p==t)
+        {
+            *p=t->next;
+            break;
+        }
+    }
+    serve_bytes-=t->cost;
+    munmap(t->map, (size_t)t->size);
+    free(t->path);
+    free(t->blocks);
+    free(t->names);
+    free(t->info);
+    free(t);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * serve_load() - Scan a tape and add it to the cache
+ * @path: Tape path
+ * @st: Tape stat
+ * @err: Error text on failure
+ *
+ * Returns: Cached tape, NULL on failure
+ */
+struct served_tape *serve_load(const char *path, struct stat *st, const char **err)
+{
+    struct served_tape *t,*lru;
+    jmp_buf env;
+    int fd,i,nblocks;
+
+    process_reset();
+    strncpy(tapname, path, _MAX_PATH-1);
+    fail_jmp=&env;
+    if(setjmp(env))
+    {
+        fail_jmp=NULL;
+        if(tap_inp)
+        {
+            fclose(tap_inp);
+            tap_inp=NULL;
+        }
+        *err="not a readable TAP";
+        return NULL;
+    }
+    nblocks=open_tape();
+    fail_jmp=NULL;
+    decode_names(nblocks,tap_inp);
+    for(i=0;i<nblocks;i++)
+    {
+        if( (blockinfo[i].state==NAME_TODO) &&
+            decode_prg_name(array_blocks[i], array_blocks[i+1], tap_inp,
+                            blocknames[i], &blockinfo[i]) )
+        {
+            break;
+        }
+    }
+    fclose(tap_inp);
+    tap_inp=NULL;
+
+    t=calloc(1, sizeof(*t));
+    if( is_archive || !t || (i<nblocks) )
+    {
+        free(t);
+        *err=is_archive ? "only TAP files are served" : "out of memory";
+        return NULL;
+    }
+    t->path=strdup(path);
+    t->blocks=malloc((nblocks+1)*sizeof(*t->blocks));
+    t->names=malloc(nblocks*sizeof(*t->names));
+    t->info=malloc(nblocks*sizeof(*t->info));
+    t->map=MAP_FAILED;
+    if( (fd=open(path,O_RDONLY))>=0 )
+    {
+        t->map=mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+    }
+    if( !t->path || !t->blocks || !t->names || !t->info || (t->map==MAP_FAILED) ||
+        (st->st_size<20) || memcmp(t->map,"C64-TAPE-RAW",12) )
+    {
+        if(t->map!=MAP_FAILED)
+        {
+            munmap(t->map, (size_t)st->st_size);
+        }
+        free(t->path);
+        free(t->blocks);
+        free(t->names);
+        free(t->info);
+        free(t);
+        *err="only TAP files are served";
+        return NULL;
+    }
+    memcpy(t->blocks, array_blocks, (nblocks+1)*sizeof(*t->blocks));
+    memcpy(t->names, blocknames, nblocks*sizeof(*t->names));
+    memcpy(t->info, blockinfo, nblocks*sizeof(*t->info));
+    t->dev=st->st_dev;
+    t->ino=st->st_ino;
+    t->mtime=st->st_mtime;
+    t->size=st->st_size;
+    t->version=tap_version;
+    t->nblocks=nblocks;
+    t->cost=t->size+(nblocks+1)*(sizeof(*t->blocks)+sizeof(*t->names)+sizeof(*t->info));
+    t->next=serve_cache;
+    serve_cache=t;
+    serve_bytes+=t->cost;
+
+    // Evict the least recently used tapes over the budget
+    while(serve_bytes>(tapoff)cache_mb<<20)
+    {
+        for(lru=NULL,t=serve_cache->next;t;t=t->next)
+        {
+            lru=(!lru || (t->used<lru->used)) ? t : lru;
+        }
+        if(!lru)
+        {
+            break;
+        }
+        serve_drop(lru);
+    }
+    return serve_cache;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * serve_tape() - Cached tape of a path, scanned again if it changed
+ *
+ * Returns: Cached tape, NULL on failure with @err set
+ */
+struct served_tape *serve_tape(const char *path, const char **err)
+{
+    struct served_tape *t;
+    struct stat st;
+
+    if( stat(path,&st) || !S_ISREG(st.st_mode) )
+    {
+        *err="tape not found";
+        return NULL;
+    }
+    for(t=serve_cache;t;t=t->next)
+    {
+        if(!strcmp(t->path,path))
+        {
+            if( (t->dev==st.st_dev) && (t->ino==st.st_ino) &&
+                (t->size==(tapoff)st.st_size) && (t->mtime==st.st_mtime) )
+            {
+                break;
+            }
+            serve_drop(t);
+            t=NULL;
+            break;
+        }
+    }
+    if( !t && ((t=serve_load(path,&st,err))==NULL) )
+    {
+        return NULL;
+    }
+    t->used=++serve_clock;
+    return t;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * serve_flush() - Send pending reply bytes as far as the socket takes them
+ *
+ * Returns: 1 on success (some may still be pending), 0 if the client is gone
+ */
+int serve_flush(struct serve_conn *c)
+{
+    ssize_t n;
+
+    while(c->out_off<c->out_len)
+    {
+        n=write(c->fd, c->out+c->out_off, c->out_len-c->out_off);
+        if(n<0)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+            return (errno==EAGAIN) || (errno==EWOULDBLOCK);
+        }
+        c->out_off+=n;
+    }
+    c->out_off=c->out_len=0;
+    return 1;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * serve_send() - Send bytes, keeping what the socket can't take now
+ *
+ * Returns: 1 on success, 0 if the client is gone or out of memory
+ */
+int serve_send(struct serve_conn *c, const void *b, size_t len)
+{
+    ssize_t n;
+    size_t size;
+    unsigned char *p;
+
+    // Straight to the socket while nothing is pending
+    while( len && (c->out_len==0) )
+    {
+        n=write(c->fd, b, len);
+        if(n<0)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+            if( (errno!=EAGAIN) && (errno!=EWOULDBLOCK) )
+            {
+                return 0;
+            }
+            break;
+        }
+        b=(const char *)b+n;
+        len-=n;
+    }
+    if(!len)
+    {
+        return 1;
+    }
+
+    if(c->out_len+len>c->out_size)
     {
-        block_len = array_blocks[i+1] - array_blocks[i];
-        
-        // Buffered
-        block_data = malloc(block_len);
-        if(!block_data)
+        for(size=c->out_size ? c->out_size : 0x1000;size<c->out_len+len;size*=2);
+        if( (p=realloc(c->out,size))==NULL )
         {
-            printf("\nError: Cannot allocate memory for block %d\n", i+1);
-            fclose(cleaned_file);
-            return;
+            return 0;
         }
-        
-        // Write block data (original TAP)
-        fseek(file_inp, array_blocks[i], SEEK_SET);
-        fread(block_data, block_len, 1, file_inp);
-        
-        // Clean end block
-        fixendtape(block_data, &block_len);
-        
-        // Write cleaned block
-        fwrite(block_data, block_len, 1, cleaned_file);
-        
-        // Show progress
-        printf("  Block %02d (%s): %u bytes\n", 
-               i+1, blocknames[i], block_len);
-        
-        free(block_data);
+        c->out=p;
+        c->out_size=size;
     }
-    
-    fclose(cleaned_file);
-    
-    printf("\nCleaned TAP file created successfully: %s\n", cleaned_filename);
-    printf("  %d programs included\n", nblocks);
+    memcpy(c->out+c->out_len, b, len);
+    c->out_len+=len;
+    return 1;
 }
 
 /*------------------------------------------------------------------------*/
 /**
- * create_idx_file() - Create index file with program positions and names
- * @tapname: Original TAP filename
- * @nblocks: Number of blocks/programs
- * @array_blocks: Array of block start positions
- * 
- * Creates a .idx file with format:
- * ; Index file generated by Split Tap
- * 0x00000014 TESTATA         
- * 0x0002a7c5 SPACE TRAVEL    
+ * serve_reply() - Send a reply made of up to two pieces
+ *
+ * Returns: 1 on success
  */
-void create_idx_file(char *tapname, int nblocks, unsigned int *array_blocks)
+int serve_reply(struct serve_conn *c, int status, const void *a, size_t alen, const void *b, size_t blen)
 {
-    FILE *idx_file;
-    char idx_filename[_MAX_PATH];
-    char *p;
-    int i;
-    
-    // Construct .idx filename from TAP filename
-    strcpy(idx_filename, tapname);
-    idx_filename[_MAX_PATH-1] = 0;
-    
-    // Find and replace extension with .idx
-    p = strrchr(idx_filename, '.');
-    if(p)
+    unsigned char head[5];
+    unsigned int len=(unsigned int)(1+alen+blen);
+
+    memcpy(head, &len, 4);
+    head[4]=(unsigned char)status;
+    return serve_send(c, head, 5) && serve_send(c, a, alen) && serve_send(c, b, blen);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * serve_error() - Send an error reply
+ *
+ * Returns: 1 on success
+ */
+int serve_error(struct serve_conn *c, const char *msg)
+{
+    return serve_reply(c, 1, msg, strlen(msg), NULL, 0);
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * serve_request() - Answer one request
+ * @c: Client connection
+ * @req: Request frame
+ * @len: Request length
+ *
+ * Returns: 1 to keep the connection, 0 to close it
+ */
+int serve_request(struct serve_conn *c, unsigned char *req, unsigned int len)
+{
+    struct served_tape *t;
+    struct strbuf sb={0};
+    struct block_info *info;
+    unsigned char header[20],*prg;
+    const char *err;
+    unsigned int blk,size;
+    tapoff start,n;
+    int i,ok;
+
+    if(len<6)
     {
-        *p = 0;  // Remove extension
+        return serve_error(c, "bad request");
     }
-    strcat(idx_filename, ".idx");
-    
-    // Open .idx file for writing
-    idx_file = fopen(idx_filename, "w");
-    if(!idx_file)
+    memcpy(&blk, req+1, 4);
+    if( (t=serve_tape((char *)req+5,&err))==NULL )
     {
-        printf("\nError: Cannot create index file: %s\n", idx_filename);
-        return;
+        return serve_error(c, err);
     }
-    
-    // Write header comment
-    fprintf(idx_file, "; Index file generated by Split Tap\n");
-    /* fprintf(idx_file, "\n");                                 */
-    
-    // Write each program entry: position (hex) + name
-    for(i = 0; i < nblocks; i++)
+    tap_version=t->version;
+    select_kernels();
+
+    if(req[0]=='L')
     {
-        // Format: 0x%08X %-16s\n
-        fprintf(idx_file, "0x%08X %-16s\n", 
-                array_blocks[i],      // Start position in hex
-                blocknames[i]);       // Program name
+        for(i=0;i<t->nblocks;i++)
+        {
+            sb_printf(&sb, "%02d) %8" PRIOFF "u bytes, 0x%08" PRIOFF "X to 0x%08" PRIOFF "X - %-16s",
+                      i+1, t->blocks[i+1]-t->blocks[i], t->blocks[i], t->blocks[i+1]-1,
+                      t->names[i]);
+            if(t->info[i].hdr>0)
+            {
+                sb_printf(&sb, " type %02X from $%04X to $%04X",
+                          t->info[i].type, t->info[i].load, t->info[i].end);
+            }
+            sb_printf(&sb, "\n");
+        }
+        ok=serve_reply(c, 0, sb.b, sb.len, NULL, 0);
+        free(sb.b);
+        return ok;
     }
-    
-    fclose(idx_file);
-    
-    // Print confirmation message
-    printf("\nIndex file created: %s\n", idx_filename);
-    printf("  %d programs indexed\n", nblocks);
-}
 
+    if( (blk<1) || (blk>(unsigned int)t->nblocks) )
+    {
+        return serve_error(c, "no such block");
+    }
+    i=blk-1;
+    info=&t->info[i];
+
+    switch(req[0])
+    {
+    case 'H':
+        if(info->hdr<=0)
+        {
+            return serve_error(c, "no header in block");
+        }
+        sb_printf(&sb, "%s\t%u\t%u\t%u\n", t->names[i], info->type, info->load, info->end);
+        ok=serve_reply(c, 0, sb.b, sb.len, NULL, 0);
+        free(sb.b);
+        return ok;
+
+    case 'T':
+        start=t->blocks[i];
+        n=((t->blocks[i+1]<t->size) ? t->blocks[i+1] : t->size)-start;
+        fixendtape(t->map+start, &n);
+        if(n>0xffffff00ULL)
+        {
+            return serve_error(c, "block too large");
+        }
+        memcpy(header, "C64-TAPE-RAW", 12);
+        header[12]=t->version;
+        header[13]=header[14]=header[15]=0;
+        header[16]=(n    )&0xff;
+        header[17]=(n>> 8)&0xff;
+        header[18]=(n>>16)&0xff;
+        header[19]=(n>>24)&0xff;
+        return serve_reply(c, 0, header, 20, t->map+start, (size_t)n);
+
+    case 'P':
+        if( (info->hdr<=0) || (info->end<=info->load) )
+        {
+            return serve_error(c, "no program header in block");
+        }
+        size=info->end-info->load;
+        if( (prg=malloc(size+2))==NULL )
+        {
+            return serve_error(c, "out of memory");
+        }
+        prg[0]=info->load&0xff;
+        prg[1]=info->load>>8;
+        start=t->blocks[i];
+        n=t->blocks[(i+2<=t->nblocks) ? i+2 : i+1];
+        n=((n<t->size) ? n : t->size)-start;
+        if(decode_program(t->map+start, n, info, prg+2))
+        {
+            ok=serve_error(c, "data block damaged");
+        }
+        else
+        {
+            ok=serve_reply(c, 0, prg, size+2, NULL, 0);
+        }
+        free(prg);
+        return ok;
+    }
+    return serve_error(c, "unknown request");
+}
 
 /*------------------------------------------------------------------------*/
 /**
- * filesize() - Get file size
- * @stream: File pointer
- * 
- * Returns: File size in bytes
+ * serve_pump() - Answer the complete requests received from a client
+ *
+ * Stops early while a reply is pending, the rest waits in the buffer.
+ *
+ * Returns: 1 to keep the connection, 0 to close it
  */
-int filesize(FILE *stream)
+int serve_pump(struct serve_conn *c)
 {
-   int curpos, length;
+    unsigned int len;
+    size_t used=0;
+    unsigned char save;
+    int keep=1;
 
-   curpos = ftell(stream);
-   fseek(stream, 0L, SEEK_END);
-   length = ftell(stream);
-   fseek(stream, curpos, SEEK_SET);
-   return length;
+    while( keep && (c->out_len==0) && (c->in_len-used>=4) )
+    {
+        memcpy(&len, c->in+used, 4);
+        if(len>=SERVE_MAXREQ)
+        {
+            return 0;
+        }
+        if(c->in_len-used<4+len)
+        {
+            break;
+        }
+
+        // Terminate the path in place, the next frame gets its byte back
+        save=c->in[used+4+len];
+        c->in[used+4+len]=0;
+        keep=serve_request(c, c->in+used+4, len);
+        c->in[used+4+len]=save;
+        used+=4+len;
+    }
+    memmove(c->in, c->in+used, c->in_len-used);
+    c->in_len-=used;
+    return keep;
 }
 
 /*------------------------------------------------------------------------*/
 /**
- * PrintBlocks() - Print block information
- * @i: Block index
- * @array_blocks: Array of block start positions
- * @file_inp: Input file pointer
- * 
- * Displays block number, size, and program name
+ * serve_client() - Handle a ready client connection
+ * @c: Client connection
+ * @revents: Poll events
  *
- * MODIFIED VERSION: Now shows hexadecimal start/end positions
- * 
- * Output format:
- * 01)    74565 [0x00000014-0x00012359] - PROGRAM NAME
- * 
- * Where:
- * - 01) = Block number
- * - 74565 = Size in bytes (decimal)
- * - [0x00000014-0x00012359] = Start and end positions in hexadecimal
- * - PROGRAM NAME = Name extracted from tape data
+ * Returns: 1 to keep the connection, 0 to close it
  */
-void PrintBlocks( int i,
-                  unsigned int *array_blocks,
-                  FILE *file_inp)
+int serve_client(struct serve_conn *c, short revents)
 {
+    ssize_t n;
 
-/*    printf("%02d) %8d - ",i+1,array_blocks[i+1]-array_blocks[i]);       */
-	// Print block number, size in decimal, and hex positions
-    printf("%02d) %8d bytes, 0x%08X to 0x%08X - ",
-           i+1,                               // Block number (1-based)
-           array_blocks[i+1]-array_blocks[i], // Size in bytes
-           array_blocks[i],                   // Start position (hex)
-           array_blocks[i+1]-0x01);           // End position (hex)
-
-    // Get and print program name
-    GetPrgName( array_blocks[i],
-                array_blocks[i+1],
-                file_inp,
-                blocknames[i] );
-    return ;
+    if(revents&POLLOUT)
+    {
+        return serve_flush(c) && serve_pump(c);
+    }
+    if(c->out_len)
+    {
+        return !(revents&(POLLHUP|POLLERR));
+    }
+    if(!(revents&(POLLIN|POLLHUP|POLLERR)))
+    {
+        return 1;
+    }
+    n=read(c->fd, c->in+c->in_len, SERVE_INBUF-c->in_len);
+    if(n<0)
+    {
+        return (errno==EINTR) || (errno==EAGAIN) || (errno==EWOULDBLOCK);
+    }
+    if(n==0)
+    {
+        return 0;
+    }
+    c->in_len+=n;
+    return serve_pump(c);
 }
 
 /*------------------------------------------------------------------------*/
 /**
- * Usage() - Print usage information
+ * serve() - Answer block requests on a Unix socket until stopped
+ * @sockname: Socket path
+ *
+ * Returns: Exit code
  */
-void Usage(void)
+int serve(const char *sockname)
 {
-    printf("\nUsage:\n iTAP <TAP name> [-b] [-l] [-i] [-c] [-n[x]] [-d[x]] [-h[x]] [-k[x]]\n");
-    printf(" -b    batch mode, never ask any question\n");
-    printf(" -l    list mode, view file list and exit\n");
-    printf(" -i    create index file (.idx) with program positions and names\n");
-    printf(" -c    create cleaned TAP file (remove small blocks, fix little issues)\n");
-    printf(" -n[x] output filenames style. x can be from 0 to 3\n");
-    printf("    0: tapname_progressive (default when -n omitted)\n");
-    printf("    1: tapname_progressive_filename (equal to -n)\n");
-    printf("    2: progressive_filename\n");
-    printf("    3: filename\n");
-    printf(" -d[x] print debug informations. x is the verboseness, can be from 0 to 2\n");
-    printf("    0: no additional info (default when -d omitted)\n");
-    printf("    1: info on every header, sync/eof messages (equal to -d)\n");
-    printf("    2: debug messages\n");
-    printf(" -h[x] Header minimum size (default 7000, try -h5000)\n");
-    printf(" -k[x] Block minimum size (default 14000, try -k18000)\n");
-    printf("\n");
+    struct sockaddr_un addr;
+    struct pollfd pfd[SERVE_CLIENTS+1];
+    struct serve_conn conn[SERVE_CLIENTS+1];
+    int lfd,fd,n=1,i;
 
-    exit(1);
+    batchmode=1;
+    listonly=1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    if(strlen(sockname)>=sizeof(addr.sun_path))
+    {
+        printf("\nError: Socket path too long: %s\n", sockname);
+        return 1;
+    }
+    strcpy(addr.sun_path, sockname);
+    unlink(sockname);
+    if( ((lfd=socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK,0))<0) ||
+        bind(lfd,(struct sockaddr *)&addr,sizeof(addr)) || listen(lfd,16) )
+    {
+        printf("\nError: Cannot listen on %s\n", sockname);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, watch_on_signal);
+    signal(SIGTERM, watch_on_signal);
+    printf("Serving on %s, cache %d MB\n", sockname, cache_mb);
+    fflush(stdout);
+
+    pfd[0].fd=lfd;
+    pfd[0].events=POLLIN;
+    while(!watch_stop)
+    {
+        // Read requests, or write replies the socket didn't take yet
+        for(i=1;i<n;i++)
+        {
+            pfd[i].events=conn[i].out_len ? POLLOUT : POLLIN;
+            pfd[i].revents=0;
+        }
+        if(poll(pfd,n,-1)<0)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        for(i=n-1;i>0;i--)
+        {
+            if(pfd[i].revents && !serve_client(&conn[i],pfd[i].revents))
+            {
+                close(conn[i].fd);
+                free(conn[i].in);
+                free(conn[i].out);
+                pfd[i]=pfd[--n];
+                conn[i]=conn[n];
+            }
+        }
+        if( (pfd[0].revents&POLLIN) && ((fd=accept(lfd,NULL,NULL))>=0) )
+        {
+            if( (n>SERVE_CLIENTS) || fcntl(fd,F_SETFL,O_NONBLOCK) ||
+                ((conn[n].in=malloc(SERVE_INBUF+1))==NULL) )
+            {
+                close(fd);
+            }
+            else
+            {
+                conn[n].in_len=conn[n].out_len=conn[n].out_off=conn[n].out_size=0;
+                conn[n].out=NULL;
+                conn[n].fd=pfd[n].fd=fd;
+                n++;
+            }
+        }
+    }
+
+    for(i=1;i<n;i++)
+    {
+        close(conn[i].fd);
+        free(conn[i].in);
+        free(conn[i].out);
+    }
+    close(lfd);
+    unlink(sockname);
+    while(serve_cache)
+    {
+        serve_drop(serve_cache);
+    }
+    return 0;
+}
+
+#else
+
+int serve(const char *sockname)
+{
+    printf("\n--serve is only supported on Linux\n");
+    return 1;
 }
 
+#endif
+
 /*------------------------------------------------------------------------*/
 /**
  * main() - Main program entry point
  * 
  * **PROGRAM FLOW:**
  * 1. Parse command line arguments
- * 2. Open and validate TAP file
- * 3. **SCAN FOR PILOT TONES** (lines 637-675)
- * 4. **BUILD BLOCK BOUNDARIES** (lines 688-726)
- * 5. Extract program names
- * 6. Allow user to merge blocks (interactive mode)
- * 7. **SAVE EACH BLOCK** with new header (lines 801-817)
+ * 2. Watch a folder (--watch), or process the given tape (split_tap)
+ * 3. Append the NDJSON result if --ndjson is given
  */
 int main(int argc,char **argv)
 {
-    FILE *file_inp;
-    FILE *hin;
-    unsigned int fs;
-    int i=0,val,batchmode=0;
-    char msg1[] = "C64-TAPE-RAW";
-    char  msg[] = "            ";
-    char msg_join[]="\nDo you want to join 2 neighbour blocks (y/n)?\n";
-    unsigned int l0,l1,l2,l3,start=0,pos_current;
-    unsigned int data_len;
-    int hdrminsize=7000,blockminsize=14000;  // Minimum sizes for detection
-    char cleanmode = 0;    // Flag -c option
-
-    // Structure to store pilot tone positions
-    struct record_pilot
-    {
-      unsigned int start;  // Start position of pilot tone
-      unsigned int end;    // End position of pilot tone
-    } array_pilot[100];
-    
-    int pilot_tones=0;
-    unsigned char byte,chr1,chr2;
-    unsigned int count;
-    int ok=0;
-    unsigned int array_blocks[100];  // Array of block start positions
-    int nblocks=0;
-    char createidx = 0;   // Create index (idx)
+    FILE *res_file;
+    char *res;
+    char **captures;
+    double t0;
+    char *catmode=NULL,*catarg=NULL;
+    int i=0,ret,ncap=0,comparemode=0;
 
-    memset(array_pilot ,0,sizeof(array_pilot ));
-    memset(array_blocks,0,sizeof(array_blocks));
+    grow_blocks(1);
+    captures=malloc(argc*sizeof(*captures));
 
     printf("\niTAP by @Shark (v.%s)\n",PROGVERSION);
     printf("Based on STAP by Carmine_TSM - Porting by iAN CooG\n");
@@ -979,7 +10105,125 @@ int main(int argc,char **argv)
     // Parse command line arguments
     for(i=1;i<argc;i++)
     {
-        if(argv[i][0] == '-')
+        if( (argv[i][0] == '-') && (argv[i][1] == '-') )
+        {
+            // Long options, all take a value
+            if(i+1>=argc)
+            {
+                Usage();
+            }
+            if(!strcmp(argv[i],"--watch"))
+            {
+                watchdir=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--out"))
+            {
+                outdir=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--idx"))
+            {
+                idxdir=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--ndjson"))
+            {
+                ndjson=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--reference"))
+            {
+                reffile=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--pause"))
+            {
+                fastpause=atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i],"--sigs"))
+            {
+                sigfile=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--journal"))
+            {
+                journal=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--assemble"))
+            {
+                asmfile=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--trace"))
+            {
+                tracefile=argv[++i];
+            }
+            else if( !strcmp(argv[i],"--trace-dump") || !strcmp(argv[i],"--trace-json") )
+            {
+                tracejson=(argv[i][8]=='j');
+                tracedump=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--gap"))
+            {
+                asm_gap=atoi(argv[++i]);
+                asm_gap=(asm_gap<0) ? 0 : asm_gap;
+            }
+            else if(!strcmp(argv[i],"--compare"))
+            {
+                comparemode=1;
+                captures[ncap++]=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--catalog"))
+            {
+                catmode=argv[++i];
+                if(i+1>=argc)
+                {
+                    Usage();
+                }
+                catarg=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--catfile"))
+            {
+                catfile=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--container"))
+            {
+                i++;
+                container=!strcmp(argv[i],"zip") ? CONT_ZIP :
+                          !strcmp(argv[i],"tar") ? CONT_TAR : 0;
+                if(!container)
+                {
+                    Usage();
+                }
+            }
+            else if(!strcmp(argv[i],"--rate"))
+            {
+                wav_rate=atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i],"--polarity"))
+            {
+                wav_invert=!strcmp(argv[++i],"neg");
+            }
+            else if(!strcmp(argv[i],"--threshold"))
+            {
+                wav_threshold=atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i],"--threads"))
+            {
+                threads=atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i],"--serve"))
+            {
+                servesock=argv[++i];
+            }
+            else if(!strcmp(argv[i],"--cache"))
+            {
+                cache_mb=atoi(argv[++i]);
+            }
+            else if(!strcmp(argv[i],"--workers"))
+            {
+                workers=atoi(argv[++i]);
+            }
+            else
+            {
+                Usage();
+            }
+        }
+        else if(argv[i][0] == '-')
         {
             switch ( argv[i][1]&0xdf )
             {
@@ -999,6 +10243,59 @@ int main(int argc,char **argv)
                 cleanmode = 1;
                 break;
 
+            case 'W':           // Write the TAP of a WAV
+                wavtap = 1;
+                break;
+
+            case 'X':           // Extract catalog hits
+                extract = 1;
+                break;
+
+            case 'S':           // Pulse class sidecar
+                sidecar = 1;
+                break;
+
+            case 'A':           // Adaptive pulse windows
+                calibrate = 1;
+                break;
+
+            case 'F':           // Repair ROM blocks
+                repairmode = 1;
+                break;
+
+            case 'P':           // Fast-load pilots and pauses
+                fastpilot=argv[i][2] ? atoi(argv[i]+2) : 2000;
+                if(fastpilot < 200 )
+                   fastpilot = 200;
+                break;
+            case 'Q':           // Quantize
+                quantize = 1;
+                break;
+
+            case 'R':           // Incremental split
+                incremental=1;
+                if(argv[i][2])
+                {
+                    incremental=(argv[i][2]&0x03);
+                }
+                break;
+
+            case 'G':           // Group programs
+                autogroup = 1;
+                break;
+
+            case 'J':           // Manual grouping
+                joinspec = argv[i]+2;
+                break;
+
+            case 'Z':           // Compact archive
+                packmode = 1;
+                break;
+
+            case 'U':           // Expand compact archive
+                unpackmode = 1;
+                break;
+
             case 'N':
                 addnames=1;
                 if(argv[i][2])
@@ -1035,280 +10332,86 @@ int main(int argc,char **argv)
         else
         {
             strcpy(tapname,argv[i]);
+            captures[ncap++]=argv[i];
         }
     }
 
-    if ( !*tapname )
+    init_quant_table();
+    init_class_table();
+    if(sigfile)
     {
-        Usage();
+        load_sigs(sigfile);
     }
-    
-    // Open TAP file
-    if ( ((file_inp=fopen(tapname,"rb"))==NULL) )
+    if(container && incremental)
     {
-        printf("\nOpen error or File not found: %s.\n",tapname);
-        exit(1);
+        printf("\n-r is ignored with --container\n");
+        incremental=0;
     }
-    
-    // Validate TAP signature
-    fseek(file_inp, 0, SEEK_SET);
-    fread(msg,1,sizeof(msg)-1,file_inp);
-    val=strcmp(msg1,msg);
-    if (val)
+    if(tracedump)
     {
-        printf("\n\nFile isn't a valid TAP!\n\n");
-        exit(1);
+        return trace_decode(tracedump,tracejson);
     }
-    
-    // Read TAP version (byte 12)
-    tap_version=(char)getc(file_inp);
-    
-    // Read data size from header (bytes 16-19, little-endian)
-    fseek(file_inp, 16, SEEK_SET);
-    l3=getc(file_inp);
-    l2=getc(file_inp);
-    l1=getc(file_inp);
-    l0=getc(file_inp);
-    data_len=(l0<<24)+(l1<<16)+(l2<<8)+l3;
-    
-    // Check if file size matches header
-    fs=filesize(file_inp)-20;
-    if ( data_len != fs )
+    if(tracefile)
     {
-        if(!(batchmode || listonly))
-        {
-            printf("\nFile internal problem\n"
-                   "Reported dimension 0x%08X instead of 0x%08X\n",
-                   (unsigned int)data_len,
-                   (unsigned int)fs );
-            printf("Fix it? (Y/n)");
-            ok=getch();
-            printf("\n");
-            if( (ok&0xdf)!='Y' )
-            {
-                exit(1);
-            }
-        }
-        // Fix file size in header
-        fclose(file_inp);
-        hin=fopen(tapname, "r+b");
-        if(!hin)
-        {
-            exit(1);
-        }
-
-        fseek(hin, 16, SEEK_SET);
-        putc((fs    )&0xff,hin);
-        putc((fs>> 8)&0xff,hin);
-        putc((fs>>16)&0xff,hin);
-        putc((fs>>24)&0xff,hin);
-        if(!(batchmode || listonly))
-            printf("Fixed.\n");
-        fclose(hin);
-        file_inp=fopen(tapname, "rb");
-        fseek(file_inp, 20, SEEK_SET);
-        data_len=fs;
+        trace_crash_dumps();
     }
-
-    // **CRITICAL SECTION: SCAN FOR PILOT TONES**
-    // This section identifies where each program starts by detecting
-    // long sequences of pilot tones (pulses with values 40-60)
-    count=0; ok=0; pilot_tones=0; start=0;
-    pos_current=20;  // Start after 20-byte header
-    
-    while (!feof(file_inp))
+    if(watchdir)
     {
-        i=getc(file_inp);
-        if(i==EOF)
-        {
-            break;
-        }
-        byte=(char)i;
-        
-        // Check if current byte is a pilot tone
-        if (ispilot(byte))
-        {
-            if (!ok)  // Start of new pilot sequence
-            {
-                ok=1;
-                count=1;
-                start=pos_current;
-            }
-            else  // Continue pilot sequence
-            {
-                count++;
-            }
-        }
-        else  // Non-pilot byte
-        {
-            if (ok)  // End of pilot sequence
-            {
-                ok=0;
-                // If pilot sequence is long enough, record it
-                if (count>hdrminsize)
-                {
-                    array_pilot[pilot_tones].start=start;
-                    array_pilot[pilot_tones].end=pos_current-1;
-                    pilot_tones++;
-                }
-                count=0;
-            }
-        }
-        pos_current++;
+        return watch_folder(watchdir);
     }
-
-    // **BUILD BLOCK BOUNDARIES ARRAY**
-    // Convert pilot tone positions to block boundaries
-    array_blocks[0]=0;
-    for (i=1;i<=pilot_tones;i++)
+    if(servesock)
     {
-        array_blocks[i]= array_pilot[i-1].start;
+        return serve(servesock);
     }
-    array_blocks[i]=data_len+20;  // End of file
-    nblocks=pilot_tones+1;
-
-    // Adjust first block to skip TAP header
-    array_blocks[0]+=20;
-
-    // **FILTER OUT SMALL BLOCKS**
-    // Remove blocks that are smaller than minimum size
-    for(i=0;i<=nblocks;i++)
+    if(catmode)
     {
-        if (array_blocks[i+1]-array_blocks[i] < blockminsize)
+        if(!strcmp(catmode,"build"))
         {
-            // Shift array to remove small block
-            for (chr2=i+1;chr2<=nblocks;chr2++)
-            {
-                array_blocks[chr2]=array_blocks[chr2+1];
-            }
-            nblocks--;
-            pilot_tones--;
-            i--;
+            return catalog_build(catarg);
         }
-    }
-
-    // Print blocks list
-    if(!listonly)
-    {
-        printf("\nBlocks list:\n");
-    }
-    else
-    {
-        printf("\n%s:\n",tapname);
-    }
-
-    for (i=0;i<nblocks;i++)
-    {
-        PrintBlocks(i,array_blocks,file_inp);
-    }
-
-    // ============================================================
-    // Create index file if -i is active
-    // ============================================================
-    if(createidx)
-    {
-        create_idx_file(tapname, nblocks, array_blocks);
-        
-        // if list only, exit after create index file
-        if(listonly)
+        if(!strcmp(catmode,"find"))
         {
-            return 0;
+            batchmode=1;
+            return catalog_find(catarg);
         }
+        Usage();
     }
-    // ============================================================
-
-    if(listonly)
-    {
-        return 0;
-    }
-    
-	// ============================================================
-    // Clean - Create a cleaned TAP
-    // ============================================================
-    if(cleanmode)
-    {
-        create_cleaned_tap(tapname, nblocks, array_blocks, file_inp);
-        return 0;  // Exit before clean file created
-    }
-    // ============================================================
-
-    if (i<2)
-    {
-        printf("\nThere are no block to split.\n");
-        exit(1);
-    }
-    
-    // Interactive mode: allow user to merge blocks
-    if(!batchmode)
+    if(comparemode)
     {
-        printf(msg_join);
-        ok=getch();
-        while ( (nblocks>1) && (ok&0xdf)=='Y' )
+        if(ncap<2)
         {
-            printf("\nWhich is the first block?");
-
-            chr1 = obtain_number(nblocks)-1;
-            if (chr1<nblocks)
-            {
-                for (chr2=chr1+1;chr2<nblocks;chr2++)
-                {
-                    array_blocks[chr2]=array_blocks[chr2+1];
-                }
-                nblocks--;
-                pilot_tones--;
-            }
-            printf("\nBlocks list:\n");
-            for (i=0;i<nblocks;i++)
-            {
-                PrintBlocks(i,array_blocks,file_inp);
-            }
-            if(nblocks<2)
-            {
-                break;
-            }
-            printf(msg_join);
-            ok=getch();
+            Usage();
         }
+        return compare_taps(captures,ncap);
     }
-
-    printf("\nNow  %d blocks will be created with progressive names",nblocks);
-    printf("\nAny file with the same name will be overwritten!");
-    printf("\nTAP Version : %d",tap_version);
-
-    if(!batchmode)
+    if(asmfile)
     {
-        printf("\nPress Y to go on, any other key to cancel...\n");
-        if ((getch()&0xdf)!='Y')
+        if(ncap<1)
         {
-            exit(1);
+            Usage();
         }
+        return assemble_tape(asmfile,captures,ncap);
     }
-    else
+    if ( !*tapname )
     {
-        printf("\n");
+        Usage();
     }
 
-    // **SAVE EACH BLOCK TO SEPARATE TAP FILE**
-    // This calls save() for each block, which creates a new TAP file
-    // with corrected header
-    for (i=0;i<(pilot_tones+1);i++)
+    t0=now_ms();
+    ret=process_tap();
+
+    // One NDJSON line per tape, same as the watch results
+    if(ndjson)
     {
-        if(verbose>1)
+        if( (res_file=fopen(ndjson,"a"))==NULL )
         {
-            printf("%-16s 0x%08x-0x%08x (0x%08x-0x%08x)\n",
-                   blocknames[i],
-                   (unsigned int)array_blocks[i],
-                   (unsigned int)array_blocks[i+1],
-                   (unsigned int)array_pilot[i].start,
-                   (unsigned int)array_pilot[i].end);
+            printf("\nError: Cannot open results file: %s\n",ndjson);
+            return 1;
         }
-        // Save block with new TAP header
-        save( array_blocks[i],
-              array_blocks[i+1],
-              i,
-              tapname);
+        res=result_json(tapname, ret ? "error" : "ok", now_ms()-t0);
+        fprintf(res_file,"%s\n",res);
+        fclose(res_file);
+        free(res);
     }
-    
-    printf("\nOperation successfully completed.\n");
-    return 0;
+    return ret ? ret : ref_bad;
 }
@@ -0,0 +1,233 @@
+#!/usr/bin/env bash
+#
+# bench.sh - Compare iTAP with TAPClean and run the regression checks
+#
+# Builds iTAP, TAPClean (sources/tapclean-0.38-src.tgz) and mktap into
+# WORK (default: _bench), generates the synthetic corpus, then runs both
+# tools on every tape and prints the blocks iTAP found next to the ROM
+# headers TAPClean read, the --reference disagreements (!!!) and the
+# throughput of both. Real tapes are given as arguments, files or
+# directories searched for *.tap.
+#
+# Every tape also goes through the regression checks: -z/-u round trip,
+# the same split from the .itz as from the TAP, and a -c -q -p cleaned TAP
+# whose header size matches its data. Synthetic tapes must also give the
+# names mktap wrote and agree with TAPClean. The exit code is 1 if any
+# check fails.
+#
+#   tools/bench.sh [TAP|DIR ...]
+#
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=${WORK:-$ROOT/_bench}
+FAILED=0
+RUNS=0
+SUMMARY=
+
+mkdir -p "$WORK" || exit 1
+WORK=$(cd "$WORK" && pwd)
+
+# ------------------------------------------------------------------------
+# Build
+
+echo "Building in $WORK"
+gcc -O2 -w -pthread "$ROOT/itap.c" -o "$WORK/itap" || exit 1
+gcc -O2 -w "$ROOT/tools/mktap.c" -o "$WORK/mktap" || exit 1
+if [ ! -x "$WORK/tapclean/src/tapclean" ]; then
+    tar xzf "$ROOT/sources/tapclean-0.38-src.tgz" -C "$WORK" &&
+    make -s -C "$WORK/tapclean/src" >"$WORK/tapclean-build.log" 2>&1 || {
+        echo "TAPClean build failed, see $WORK/tapclean-build.log"
+        exit 1
+    }
+fi
+ITAP=$WORK/itap
+TAPCLEAN=$WORK/tapclean/src/tapclean
+
+# ------------------------------------------------------------------------
+# Synthetic corpus: name and mktap options. Damage can hit a header, so
+# the damaged tape is compared but not required to agree.
+
+LOOSE="damaged"
+SYNTH=(
+    "rom-v1:-n 4"
+    "rom-v0:-v 0 -n 3"
+    "jitter:-j 3 -n 5 -r 2"
+    "slow:-s 110 -n 3 -r 3"
+    "fast:-s 92 -n 3 -r 4"
+    "turbo:-t 1 -n 4 -r 5"
+    "damaged:-d 20 -n 4 -r 6"
+    "long:-n 12 -b 8000 -r 7"
+)
+
+rm -rf "$WORK/corpus"
+mkdir -p "$WORK/corpus"
+for s in "${SYNTH[@]}"; do
+    "$WORK/mktap" ${s#*:} "$WORK/corpus/${s%%:*}.tap" \
+        >"$WORK/corpus/${s%%:*}.names" || exit 1
+done
+
+# ------------------------------------------------------------------------
+# Helpers
+
+now_ms()
+{
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# MB/s of SIZE bytes in MS milliseconds
+rate()
+{
+    awk -v b="$1" -v ms="$2" 'BEGIN { printf "%.1f", ms ? b/1048576/(ms/1000) : 0 }'
+}
+
+# Result of a regression check
+check()
+{
+    if [ "$2" = 0 ]; then
+        printf "  ok    %s\n" "$1"
+    else
+        printf "  FAIL  %s\n" "$1"
+        FAILED=1
+    fi
+}
+
+# Blocks of an NDJSON line next to the first copies of the TAPClean headers
+side_by_side()
+{
+    awk -v nd="$2" '
+    function hex(s,  v, i) {
+        v = 0
+        for (i = 1; i <= length(s); i++)
+            v = v * 16 + index("0123456789abcdef", tolower(substr(s, i, 1))) - 1
+        return v
+    }
+    BEGIN {
+        s = nd
+        while (match(s, /"start":[0-9]+,"size":[0-9]+,"name":"([^"\\]|\\.)*"/)) {
+            b = substr(s, RSTART, RLENGTH)
+            s = substr(s, RSTART + RLENGTH)
+            split(b, f, /[:,]/)
+            n++
+            start[n] = f[2]
+            size[n] = f[4]
+            name[n] = substr(b, index(b, "\"name\":") + 8)
+            sub(/"$/, "", name[n])
+        }
+    }
+    /^Seq\. no\.:/                      { hdr = 0 }
+    /^File Type: C64 ROM-TAPE HEADER/   { hdr = 1 }
+    hdr && /^Location: /                { loc = $2; dat = $4 }
+    hdr && /^File Name: /               { nm = substr($0, 12); sub(/ +$/, "", nm) }
+    hdr && /File ID : FIRST/ {
+        d = hex(substr(dat, 2))
+        for (i = 1; i <= n && start[i] + size[i] <= d; i++)
+            ;
+        tc[i] = tc[i] (tc[i] ? ", " : "") sprintf("%s %s", loc, nm == "" ? "NO-NAME" : nm)
+        hdr = 0
+    }
+    END {
+        printf "  %-3s %-10s %8s  %-16s  %s\n", "#", "start", "size", "iTAP", "TAPClean"
+        for (i = 1; i <= n; i++)
+            printf "  %02d  0x%08X %8d  %-16s  %s\n", i, start[i], size[i], name[i], tc[i] ? tc[i] : "-"
+        if (tc[n + 1])
+            printf "  --  %-29s %s\n", "past the last block", tc[n + 1]
+    }' "$1"
+}
+
+# ------------------------------------------------------------------------
+# One tape: $1 path, $2 name list from mktap (synthetic tapes only)
+
+run_tape()
+{
+    local tap=$1 names=$2 base dir size t0 tc_ms it_ms line bad hdrs blocks
+
+    base=$(basename "$tap" .tap)
+    RUNS=$((RUNS+1))
+    dir=$WORK/run/$RUNS-$base
+    rm -rf "$dir"
+    mkdir -p "$dir"
+    size=$(stat -c %s "$tap")
+    echo
+    echo "== $tap ($size bytes)"
+
+    # TAPClean writes tcreport.txt in the current directory
+    t0=$(now_ms)
+    (cd "$dir" && "$TAPCLEAN" -t "$tap" >tapclean.log 2>&1)
+    tc_ms=$(( $(now_ms) - t0 ))
+    if [ ! -f "$dir/tcreport.txt" ]; then
+        echo "  TAPClean gave no report, see $dir/tapclean.log"
+        FAILED=1
+        return
+    fi
+
+    t0=$(now_ms)
+    "$ITAP" -b -l --reference "$dir/tcreport.txt" --ndjson "$dir/itap.ndjson" \
+        "$tap" >"$dir/itap.log" 2>&1
+    it_ms=$(( $(now_ms) - t0 ))
+    line=$(tail -n 1 "$dir/itap.ndjson")
+
+    side_by_side "$dir/tcreport.txt" "$line"
+    grep '^!!!' "$dir/itap.log" | sed 's/^/  /'
+    bad=$(sed -n 's/^\([0-9]*\) disagreements$/\1/p' "$dir/itap.log")
+    hdrs=$(sed -n 's/^Reference .*: \([0-9]*\) headers$/\1/p' "$dir/itap.log")
+    blocks=$(grep -o '"start":' <<<"$line" | wc -l)
+    SUMMARY+=$(printf "%-24s %10d %7d %7d %9s %9s %9s\\\\n" \
+        "${base:0:24}" "$size" "$blocks" "${hdrs:-?}" "${bad:-?}" \
+        "$(rate "$size" "$it_ms")" "$(rate "$size" "$tc_ms")")
+
+    echo
+    if [ -n "$names" ] && [[ " $LOOSE " != *" $base "* ]]; then
+        check "names as written by mktap" \
+            "$(diff <(grep -o '"name":"[^"]*","type"' <<<"$line" | cut -d'"' -f4) \
+                   "$names" >/dev/null; echo $?)"
+        check "agrees with TAPClean" "$([ "${bad:-1}" = 0 ]; echo $?)"
+    fi
+
+    # Archive round trip, split from the archive
+    "$ITAP" -b -z --out "$dir" "$tap" >/dev/null 2>&1
+    mkdir -p "$dir/u" "$dir/s1" "$dir/s2"
+    "$ITAP" -b -u --out "$dir/u" "$dir/$base.itz" >/dev/null 2>&1
+    check "-z/-u round trip" "$(cmp -s "$tap" "$dir/u/$base.tap"; echo $?)"
+    "$ITAP" -b --out "$dir/s1" "$tap" >/dev/null 2>&1
+    "$ITAP" -b --out "$dir/s2" "$dir/$base.itz" >/dev/null 2>&1
+    check "split from .itz" "$(diff -r "$dir/s1" "$dir/s2" >/dev/null; echo $?)"
+
+    # Cleaned TAP header against its data
+    mkdir -p "$dir/c"
+    "$ITAP" -b -c -q -p --out "$dir/c" "$tap" >/dev/null 2>&1
+    check "-c -q -p header size" "$(
+        f=$dir/c/${base}_cleaned.tap
+        [ -f "$f" ] &&
+        [ "$(od -An -tu4 -j16 -N4 "$f" | tr -d ' ')" = $(( $(stat -c %s "$f") - 20 )) ]
+        echo $?)"
+}
+
+# ------------------------------------------------------------------------
+# Run
+
+for s in "${SYNTH[@]}"; do
+    run_tape "$WORK/corpus/${s%%:*}.tap" "$WORK/corpus/${s%%:*}.names"
+done
+for arg in "$@"; do
+    if [ -d "$arg" ]; then
+        find "$arg" -type f -iname '*.tap' | sort
+    else
+        echo "$arg"
+    fi
+done | while read -r tap; do
+    echo "$(cd "$(dirname "$tap")" && pwd)/$(basename "$tap")"
+done >"$WORK/real.list"
+while read -r tap; do
+    run_tape "$tap" ""
+done <"$WORK/real.list"
+
+echo
+printf "%-24s %10s %7s %7s %9s %9s %9s\n" \
+    "tape" "bytes" "blocks" "headers" "disagree" "iTAP MB/s" "TC MB/s"
+printf "$SUMMARY"
+echo
+if [ "$FAILED" != 0 ]; then
+    echo "Some checks FAILED"
+    exit 1
+fi
+echo "All checks passed"
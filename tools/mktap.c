@@ -0,0 +1,293 @@
+/*
+ * mktap - Synthetic C64 ROM tape generator for tools/bench.sh
+ *
+ * Writes a TAP with a number of programs saved by the C64 ROM routines
+ * (header and data block, both copies, pauses in between) and prints the
+ * name of every program, in tape order, one per line.
+ *
+ *   mktap [options] OUT.tap
+ *    -n N     programs (default: 3)
+ *    -v V     TAP version 0 or 1 (default: 1)
+ *    -j J     random jitter of +/-J on every pulse (default: 0)
+ *    -s PCT   tape speed in % of nominal (default: 100)
+ *    -b SIZE  size of the first program (default: 2000)
+ *    -t N     turbo-like noise blocks after every program (default: 0)
+ *    -d N     pulses overwritten with garbage (default: 0)
+ *    -r SEED  random seed (default: 1)
+ *
+ * Compile:
+ *   gcc mktap.c -o mktap
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PULSE_S 0x30
+#define PULSE_M 0x42
+#define PULSE_L 0x56
+
+unsigned char *tap=NULL;        // Pulses written so far
+size_t tap_len=0;
+size_t tap_size=0;
+int version=1;
+int jitter=0;
+int speed=100;
+unsigned int seed=1;
+
+const char *names[]=
+{
+    "ELITE", "SPACE TRAVEL", "", "BOULDER DASH", "IK+", "PARADROID",
+    "URIDIUM", "NEBULUS", "COMIC BAKERY", "HEAD OVER HEELS"
+};
+
+/*------------------------------------------------------------------------*/
+/**
+ * rnd() - Next pseudo-random number, same sequence everywhere
+ */
+unsigned int rnd(void)
+{
+    seed^=seed<<13;
+    seed^=seed>>17;
+    seed^=seed<<5;
+    return seed;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * put() - Append one raw byte to the tape
+ */
+void put(unsigned char v)
+{
+    if(tap_len==tap_size)
+    {
+        tap_size=tap_size ? tap_size*2 : 0x100000;
+        if( (tap=realloc(tap,tap_size))==NULL )
+        {
+            printf("\nError: Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    tap[tap_len++]=v;
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pulse() - Append a pulse with the tape speed and jitter applied
+ */
+void pulse(int v)
+{
+    v=(v*speed+50)/100;
+    if(jitter)
+    {
+        v+=(int)(rnd()%(2*jitter+1))-jitter;
+    }
+    put( (v<1) ? 1 : (v>255) ? 255 : v );
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * pulses() - Append @n equal pulses
+ */
+void pulses(int v, int n)
+{
+    while(n--)
+    {
+        pulse(v);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * put_byte() - Append a byte as the ROM writes it
+ *
+ * Byte marker, 8 bits LSB first, odd parity; a 0 is short-medium, a 1
+ * medium-short.
+ */
+void put_byte(unsigned char b)
+{
+    int k,bit,parity=1;
+
+    pulse(PULSE_L);
+    pulse(PULSE_M);
+    for(k=0;k<9;k++)
+    {
+        bit=(k<8) ? (b>>k)&1 : parity;
+        parity^=bit;
+        pulse(bit ? PULSE_M : PULSE_S);
+        pulse(bit ? PULSE_S : PULSE_M);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * put_block() - Append a ROM block: pilot, then the two copies
+ */
+void put_block(const unsigned char *b, int len, int pilot)
+{
+    int copy,k;
+    unsigned char check;
+
+    pulses(PULSE_S, pilot);
+    for(copy=0;copy<2;copy++)
+    {
+        for(k=0;k<9;k++)
+        {
+            put_byte( (copy ? 0x09 : 0x89)-k );
+        }
+        for(k=0,check=0;k<len;k++)
+        {
+            put_byte(b[k]);
+            check^=b[k];
+        }
+        put_byte(check);
+        pulse(PULSE_L);
+        pulse(PULSE_S);
+        pulses(PULSE_S, copy ? 200 : 79);
+    }
+}
+
+/*------------------------------------------------------------------------*/
+/**
+ * put_pause() - Append a pause of @cycles
+ */
+void put_pause(unsigned int cycles)
+{
+    unsigned int k;
+
+    if(!version)
+    {
+        for(k=0;k<cycles/2048;k++)
+        {
+            put(0);
+        }
+        return;
+    }
+    put(0);
+    put(cycles&0xff);
+    put((cycles>>8)&0xff);
+    put((cycles>>16)&0xff);
+}
+
+/*------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    unsigned char header[192];
+    unsigned char *data;
+    char name[17];                  // ROM names are 16 characters
+    const char *out=NULL;
+    int programs=3,size=2000,turbo=0,damage=0;
+    int i,k,len,end;
+    FILE *f;
+
+    for(i=1;i<argc;i++)
+    {
+        if( (argv[i][0]=='-') && argv[i][1] && !argv[i][2] && (i+1<argc) )
+        {
+            k=atoi(argv[++i]);
+            switch(argv[i-1][1])
+            {
+            case 'n': programs=k; continue;
+            case 'v': version=k;  continue;
+            case 'j': jitter=k;   continue;
+            case 's': speed=k;    continue;
+            case 'b': size=k;     continue;
+            case 't': turbo=k;    continue;
+            case 'd': damage=k;   continue;
+            case 'r': seed=k ? k : 1; continue;
+            }
+        }
+        else if(!out && (argv[i][0]!='-'))
+        {
+            out=argv[i];
+            continue;
+        }
+        out=NULL;
+        break;
+    }
+    if( !out || (programs<1) || (version<0) || (version>1) || (speed<50) ||
+        (size<1) || (size>0xf000) )
+    {
+        printf("Usage: mktap [-n N] [-v V] [-j J] [-s PCT] [-b SIZE] [-t N] "
+               "[-d N] [-r SEED] OUT.tap\n");
+        return 1;
+    }
+
+    for(i=0;i<programs;i++)
+    {
+        if(i<(int)(sizeof(names)/sizeof(*names)))
+        {
+            snprintf(name, sizeof(name), "%s", names[i]);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "%s%d",
+                     names[i%(sizeof(names)/sizeof(*names))], i);
+        }
+        printf("%s\n", *name ? name : "NO-NAME");
+
+        // Header: BASIC program at $0801
+        len=size+i*37;
+        end=0x0801+len;
+        memset(header, ' ', sizeof(header));
+        header[0]=1;
+        header[1]=0x01;
+        header[2]=0x08;
+        header[3]=end&0xff;
+        header[4]=(end>>8)&0xff;
+        memcpy(header+5, name, strlen(name));
+        put_block(header, sizeof(header), 0x6a00);
+        put_pause(400000);
+
+        if( (data=malloc(len))==NULL )
+        {
+            printf("\nError: Memory allocation failed\n");
+            return 1;
+        }
+        for(k=0;k<len;k++)
+        {
+            data[k]=rnd()&0xff;
+        }
+        put_block(data, len, 0x1a00);
+        free(data);
+
+        for(k=0;k<turbo;k++)
+        {
+            pulses(PULSE_S, 8000);
+            for(end=0;end<20000;end++)
+            {
+                pulse( (rnd()&1) ? 0x1a : 0x28 );
+            }
+        }
+        put_pause(1500000);
+    }
+
+    for(i=0;i<damage;i++)
+    {
+        k=rnd()%3;
+        tap[rnd()%tap_len]=(k==0) ? 0x10 : (k==1) ? 0x70 : 0x90;
+    }
+
+    if( (f=fopen(out,"wb"))==NULL )
+    {
+        printf("\nError: Cannot create %s\n", out);
+        return 1;
+    }
+    fwrite("C64-TAPE-RAW", 1, 12, f);
+    putc(version, f);
+    putc(0, f);
+    putc(0, f);
+    putc(0, f);
+    putc(tap_len&0xff, f);
+    putc((tap_len>>8)&0xff, f);
+    putc((tap_len>>16)&0xff, f);
+    putc((tap_len>>24)&0xff, f);
+    fwrite(tap, 1, tap_len, f);
+    if(fclose(f))
+    {
+        printf("\nError: Cannot write %s\n", out);
+        return 1;
+    }
+    free(tap);
+    return 0;
+}